@@ -1,5 +1,16 @@
 #include "mpc.h"
 
+/*
+** Scratch state that has to be global is kept per
+** thread, so parsers can run on several threads.
+*/
+
+#if defined(__GNUC__)
+#define MPC_THREAD_LOCAL __thread
+#else
+#define MPC_THREAD_LOCAL
+#endif
+
 /*
 ** State Type
 */
@@ -30,20 +41,6 @@ static mpc_state_t *mpc_state_copy(mpc_state_t s) {
 ** Error Type
 */
 
-static mpc_err_t *mpc_err_new(const char *filename, mpc_state_t s, const char *expected, char recieved) {
-  mpc_err_t *x = malloc(sizeof(mpc_err_t));
-  x->filename = malloc(strlen(filename) + 1);
-  strcpy(x->filename, filename);
-  x->state = s;
-  x->expected_num = 1;
-  x->expected = malloc(sizeof(char*));
-  x->expected[0] = malloc(strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  x->failure = NULL;
-  x->recieved = recieved;
-  return x;
-}
-
 static mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *failure) {
   mpc_err_t *x = malloc(sizeof(mpc_err_t));
   x->filename = malloc(strlen(filename) + 1);
@@ -70,38 +67,6 @@ void mpc_err_delete(mpc_err_t *x) {
   free(x);
 }
 
-static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
-  
-  int i;
-  for (i = 0; i < x->expected_num; i++) {
-    if (strcmp(x->expected[i], expected) == 0) { return 1; }
-  }
-  
-  return 0;
-}
-
-static void mpc_err_add_expected(mpc_err_t *x, char *expected) {
-  
-  x->expected_num++;
-  x->expected = realloc(x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = malloc(strlen(expected) + 1);
-  strcpy(x->expected[x->expected_num-1], expected);
-  
-}
-
-static void mpc_err_clear_expected(mpc_err_t *x, char *expected) {
-  
-  int i;
-  for (i = 0; i < x->expected_num; i++) {
-    free(x->expected[i]);
-  }
-  x->expected_num = 1;
-  x->expected = realloc(x->expected, sizeof(char*) * x->expected_num);
-  x->expected[0] = malloc(strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  
-}
-
 void mpc_err_print(mpc_err_t *x) {
   mpc_err_print_to(x, stdout);
 }
@@ -122,7 +87,7 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt, ...)
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
+static MPC_THREAD_LOCAL char char_unescape_buffer[4];
 
 static const char *mpc_err_char_unescape(char c) {
   
@@ -185,93 +150,6 @@ char *mpc_err_string(mpc_err_t *x) {
   return realloc(buffer, strlen(buffer) + 1);
 }
 
-static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
-  
-  int i, j;
-  mpc_err_t *e = malloc(sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = malloc(strlen(x[0]->filename)+1);
-  strcpy(e->filename, x[0]->filename);
-  
-  for (i = 0; i < n; i++) {
-    if (x[i]->state.pos > e->state.pos) { e->state = x[i]->state; }
-  }
-  
-  for (i = 0; i < n; i++) {
-    
-    if (x[i]->state.pos < e->state.pos) { continue; }
-    
-    if (x[i]->failure) {
-      e->failure = malloc(strlen(x[i]->failure)+1);
-      strcpy(e->failure, x[i]->failure);
-      break;
-    }
-    
-    e->recieved = x[i]->recieved;
-    
-    for (j = 0; j < x[i]->expected_num; j++) {
-      if (!mpc_err_contains_expected(e, x[i]->expected[j])) { mpc_err_add_expected(e, x[i]->expected[j]); }
-    }
-  }
-  
-  for (i = 0; i < n; i++) {
-    mpc_err_delete(x[i]);
-  }
-  
-  return e;
-}
-
-static mpc_err_t *mpc_err_repeat(mpc_err_t *x, const char *prefix) {
-
-  int i;
-  char *expect = malloc(strlen(prefix) + 1);
-  strcpy(expect, prefix);
-  
-  if (x->expected_num == 1) {
-    expect = realloc(expect, strlen(expect) + strlen(x->expected[0]) + 1);
-    strcat(expect, x->expected[0]);
-  }
-  
-  if (x->expected_num > 1) {
-  
-    for (i = 0; i < x->expected_num-2; i++) {
-      expect = realloc(expect, strlen(expect) + strlen(x->expected[i]) + strlen(", ") + 1);
-      strcat(expect, x->expected[i]);
-      strcat(expect, ", ");
-    }
-    
-    expect = realloc(expect, strlen(expect) + strlen(x->expected[x->expected_num-2]) + strlen(" or ") + 1);
-    strcat(expect, x->expected[x->expected_num-2]);
-    strcat(expect, " or ");
-    expect = realloc(expect, strlen(expect) + strlen(x->expected[x->expected_num-1]) + 1);
-    strcat(expect, x->expected[x->expected_num-1]);
-
-  }
-  
-  mpc_err_clear_expected(x, expect);
-  free(expect);
-  
-  return x;
-
-}
-
-static mpc_err_t *mpc_err_many1(mpc_err_t *x) {
-  return mpc_err_repeat(x, "one or more of ");
-}
-
-static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
-  mpc_err_t *y;
-  int digits = n/10 + 1;
-  char *prefix = malloc(digits + strlen(" of ") + 1);
-  sprintf(prefix, "%i of ", n);
-  y = mpc_err_repeat(x, prefix);
-  free(prefix);
-  return y;
-}
-
 /*
 ** Input Type
 */
@@ -316,15 +194,17 @@ enum {
 typedef struct {
 
   int type;
-  char *filename;  
+  const char *filename;  
   mpc_state_t state;
   
-  char *string;
+  const char *string;
+  long length;
   char *buffer;
   FILE *file;
   
   int backtrack;
   int marks_num;
+  int marks_slots;
   mpc_state_t* marks;
   char* lasts;
   
@@ -332,84 +212,72 @@ typedef struct {
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+/*
+** Inputs only borrow the filename and string
+** they are given. Parsing is synchronous so
+** both outlive the input, and not copying them
+** makes setting up a parse cheap. The marks
+** arrays are grown geometrically and never
+** shrunk so that an input can be reset and
+** reused by a `mpc_context_t`.
+*/
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-  
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+static void mpc_input_reset(mpc_input_t *i, int type, const char *filename) {
   
+  i->type = type;
+  i->filename = filename;
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = NULL;
   
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks = NULL;
-  i->lasts = NULL;
-
-  i->last = '\0';
   
-  return i;
+  i->last = '\0';
 }
 
-static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
+static mpc_input_t *mpc_input_new(int type, const char *filename) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  
-  i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
-  
-  i->string = NULL;
-  i->buffer = NULL;
-  i->file = pipe;
-  
-  i->backtrack = 1;
-  i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
-  i->last = '\0';
+  mpc_input_reset(i, type, filename);
   
   return i;
-  
+}
+
+static void mpc_input_reset_string(mpc_input_t *i, const char *filename, const char *string) {
+  mpc_input_reset(i, MPC_INPUT_STRING, filename);
+  i->string = string;
+  i->length = strlen(string);
+}
+
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  mpc_input_t *i = mpc_input_new(MPC_INPUT_STRING, filename);
+  mpc_input_reset_string(i, filename, string);
+  return i;
+}
+
+static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
+  mpc_input_t *i = mpc_input_new(MPC_INPUT_PIPE, filename);
+  i->file = pipe;
+  return i;
 }
 
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
-  
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-  
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
-  
-  i->string = NULL;
-  i->buffer = NULL;
+  mpc_input_t *i = mpc_input_new(MPC_INPUT_FILE, filename);
   i->file = file;
-  
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks = NULL;
-  i->lasts = NULL;
-  
-  i->last = '\0';
-  
   return i;
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
   
-  free(i->filename);
-  
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
   free(i->marks);
@@ -425,8 +293,13 @@ static void mpc_input_mark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
+  
+  if (i->marks_num > i->marks_slots) {
+    i->marks_slots = i->marks_slots ? i->marks_slots * 2 : 32;
+    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+  }
+  
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
@@ -441,8 +314,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
     free(i->buffer);
@@ -474,7 +345,7 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -652,6 +523,142 @@ static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char)) {
   return f(i->last, mpc_input_peekc(i));
 }
 
+/*
+** A compiled regular expression. Each state has
+** a row of 256 transitions in `next`, with -1 for
+** the dead state. Matching is leftmost-longest:
+** input is consumed while the automaton is alive
+** and the match ends at the last accepting state.
+**
+** On failure `dead` is set to where the automaton
+** died and `recieved` to the character there, so
+** that errors point at the furthest character read
+** like they do with the combinator version.
+*/
+
+typedef struct {
+  char *re;
+  char *expected;
+  int states_num;
+  int *next;
+  char *accept;
+} mpc_dfa_t;
+
+static void mpc_state_skip(mpc_state_t *s, const unsigned char *x, long n) {
+  long j;
+  for (j = 0; j < n; j++) {
+    if (x[j] == '\n') { s->col = 0; s->row++; }
+    else { s->col++; }
+  }
+  s->pos += n;
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, char **o, mpc_state_t *dead, char *recieved) {
+  
+  long j, len, end;
+  int q = 0;
+  char c;
+  
+  end = d->accept[0] ? 0 : -1;
+  
+  /* Strings are scanned in place with no marks */
+  if (i->type == MPC_INPUT_STRING) {
+    
+    const unsigned char *x = (const unsigned char*)i->string + i->state.pos;
+    len = i->length - i->state.pos;
+    
+    for (j = 0; j < len; j++) {
+      q = d->next[q * 256 + x[j]];
+      if (q < 0) { break; }
+      if (d->accept[q]) { end = j + 1; }
+    }
+    
+    if (end < 0) {
+      *dead = i->state;
+      mpc_state_skip(dead, x, j);
+      *recieved = j < len ? (char)x[j] : '\0';
+      return 0;
+    }
+    
+    mpc_state_skip(&i->state, x, end);
+    if (end > 0) { i->last = x[end-1]; }
+    
+    *o = malloc(end + 1);
+    memcpy(*o, x, end);
+    (*o)[end] = '\0';
+    return 1;
+  }
+  
+  /*
+  ** Without backtracking there are no marks to
+  ** scan ahead with, and only the peeked character
+  ** can be put back. The match is then everything
+  ** read while the automaton is alive, which is
+  ** what the predictive combinators would take.
+  */
+  if (i->backtrack < 1) {
+
+    long slots = 16;
+    *o = malloc(slots);
+
+    len = 0;
+    while (1) {
+      c = mpc_input_peekc(i);
+      if (c == '\0' || d->next[q * 256 + (unsigned char)c] < 0) { break; }
+      q = d->next[q * 256 + (unsigned char)c];
+      mpc_input_getc(i);
+      mpc_input_success(i, c, NULL);
+      if (len + 1 == slots) { slots *= 2; *o = realloc(*o, slots); }
+      (*o)[len++] = c;
+    }
+
+    if (!d->accept[q]) {
+      *dead = i->state;
+      *recieved = c;
+      free(*o);
+      return 0;
+    }
+
+    (*o)[len] = '\0';
+    return 1;
+  }
+
+  /*
+  ** Files and pipes scan ahead then replay the match.
+  ** A pipe that has hit its end counts as terminated
+  ** even while marked characters remain in its buffer,
+  ** so characters already peeked are taken directly
+  ** rather than through mpc_input_any's check.
+  */
+  mpc_input_mark(i);
+  
+  len = 0;
+  while (1) {
+    c = mpc_input_peekc(i);
+    if (c == '\0') { break; }
+    q = d->next[q * 256 + (unsigned char)c];
+    if (q < 0) { break; }
+    mpc_input_getc(i);
+    mpc_input_success(i, c, NULL);
+    len++;
+    if (d->accept[q]) { end = len; }
+  }
+  
+  *dead = i->state;
+  *recieved = c;
+  mpc_input_rewind(i);
+  
+  if (end < 0) { return 0; }
+  
+  *o = malloc(end + 1);
+  for (j = 0; j < end; j++) {
+    (*o)[j] = mpc_input_getc(i);
+    mpc_input_success(i, (*o)[j], NULL);
+  }
+  (*o)[end] = '\0';
+  return 1;
+}
+
 /*
 ** Parser Type
 */
@@ -684,7 +691,10 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_MEMO      = 25,
+  MPC_TYPE_DFA       = 26
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -700,8 +710,10 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; char *first; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t ref; mpc_dtor_t dx; } mpc_pdata_memo_t;
+typedef struct { mpc_dfa_t *d; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -718,6 +730,8 @@ typedef union {
   mpc_pdata_not_t not;
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_dfa_t dfa;
   mpc_pdata_or_t or;
 } mpc_pdata_t;
 
@@ -728,6 +742,82 @@ struct mpc_parser_t {
   mpc_pdata_t data;
 };
 
+/*
+** Failure Type
+*/
+
+/*
+** Errors are not built while parsing. Instead
+** a failure records the furthest position it
+** reached, what was expected there and the
+** character found. An `mpc_err_t` is only made
+** from these records if the parse as a whole
+** fails.
+**
+** Records are kept in frames on the stack which
+** mirror where errors used to be passed around.
+** Parsers such as `expect`, `or` and `many` push
+** a frame for their children and when done merge
+** it into the frame below, drop it, or merge it
+** into the `leak` record which holds the errors
+** of failures that some parser recovered from.
+**
+** The expected strings of every frame sit one
+** after another in a single buffer which, like
+** the rest of the stack, is kept between parses.
+*/
+
+typedef struct {
+  mpc_state_t state;
+  char recieved;
+  const char *failure;
+  int expected_num;
+  long start;
+} mpc_fail_t;
+
+typedef struct {
+  long num;
+  long slots;
+  char *x;
+} mpc_fail_strs_t;
+
+enum {
+  MPC_FAIL_DROP   = 0,
+  MPC_FAIL_PARENT = 1,
+  MPC_FAIL_LEAK   = 2
+};
+
+/*
+** Memo Type
+*/
+
+/*
+** Packrat memoization caches the result of a
+** memo parser at a given input position. The
+** result is kept by reference, not copied, so
+** storing and hitting an entry is constant time.
+** The table is direct-mapped with a fixed number
+** of slots, so a colliding entry simply evicts
+** the older one. The input covered by cached
+** matches is capped at MPC_MEMO_BYTES, which
+** bounds the results the cache keeps alive; it
+** is emptied when a new match would go over.
+*/
+
+enum { MPC_MEMO_SLOTS = 4096, MPC_MEMO_BYTES = 1 << 16 };
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_result_t result;
+  mpc_dtor_t dx;
+  mpc_fail_t fail;
+  mpc_fail_strs_t strs;
+} mpc_memo_t;
+
 /*
 ** Stack Type
 */
@@ -744,12 +834,34 @@ typedef struct {
   mpc_result_t *results;
   int *returns;
   
-  mpc_err_t *err;
+  int fails_num;
+  int fails_slots;
+  mpc_fail_t *fails;
+  mpc_fail_strs_t strs;
+  mpc_fail_t leak;
+  mpc_fail_strs_t leak_strs;
+  mpc_fail_strs_t repeat_strs;
+  
+  mpc_memo_t *memos;
+  int memos_used_num;
+  int *memos_used;
+  long memos_bytes;
+  
+  int memo_starts_num;
+  int memo_starts_slots;
+  long *memo_starts;
   
 } mpc_stack_t;
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
-  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+/*
+** The stack only ever grows. Its slots are kept
+** between parses so a `mpc_context_t` running
+** many small parses in a row reaches a steady
+** state where pushing and popping never touches
+** the allocator.
+*/
+
+static void mpc_stack_init(mpc_stack_t *s) {
   
   s->parsers_num = 0;
   s->parsers_slots = 0;
@@ -761,34 +873,70 @@ static mpc_stack_t *mpc_stack_new(const char *filename) {
   s->results = NULL;
   s->returns = NULL;
   
-  s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+  s->fails_num = 0;
+  s->fails_slots = 0;
+  s->fails = NULL;
+  memset(&s->strs, 0, sizeof(mpc_fail_strs_t));
+  memset(&s->leak_strs, 0, sizeof(mpc_fail_strs_t));
+  memset(&s->repeat_strs, 0, sizeof(mpc_fail_strs_t));
   
-  return s;
+  s->memos = NULL;
+  s->memos_used_num = 0;
+  s->memos_used = NULL;
+  s->memos_bytes = 0;
+  
+  s->memo_starts_num = 0;
+  s->memo_starts_slots = 0;
+  s->memo_starts = NULL;
+}
+
+static void mpc_fail_init(mpc_fail_t *f, long start);
+static void mpc_stack_fail_push(mpc_stack_t *s);
+
+static void mpc_stack_reset(mpc_stack_t *s) {
+  s->parsers_num = 0;
+  s->results_num = 0;
+  s->memo_starts_num = 0;
+  s->fails_num = 0;
+  s->strs.num = 0;
+  s->leak_strs.num = 0;
+  mpc_fail_init(&s->leak, 0);
+  mpc_stack_fail_push(s);
 }
 
-static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
-  mpc_err_t *errs[2];
-  errs[0] = s->err;
-  errs[1] = e;
-  s->err = mpc_err_or(errs, 2);
+static void mpc_stack_memo_clear(mpc_stack_t *s);
+static mpc_err_t *mpc_stack_fail_err(mpc_stack_t *s, const char *filename);
+
+static void mpc_stack_free(mpc_stack_t *s) {
+  int i;
+  free(s->parsers);
+  free(s->states);
+  free(s->results);
+  free(s->returns);
+  free(s->fails);
+  free(s->strs.x);
+  free(s->leak_strs.x);
+  free(s->repeat_strs.x);
+  if (s->memos) {
+    for (i = 0; i < MPC_MEMO_SLOTS; i++) { free(s->memos[i].strs.x); }
+  }
+  free(s->memos);
+  free(s->memos_used);
+  free(s->memo_starts);
 }
 
-static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
+static int mpc_stack_terminate(mpc_stack_t *s, const char *filename, mpc_result_t *r) {
   int success = s->returns[0];
   
   if (success) {
     r->output = s->results[0].output;
-    mpc_err_delete(s->err);
   } else {
-    mpc_stack_err(s, s->results[0].error);
-    r->error = s->err;
+    r->error = mpc_stack_fail_err(s, filename);
   }
   
-  free(s->parsers);
-  free(s->states);
-  free(s->results);
-  free(s->returns);
-  free(s);
+  s->parsers_num = 0;
+  s->results_num = 0;
+  mpc_stack_memo_clear(s);
   
   return success;
 }
@@ -801,15 +949,7 @@ static void mpc_stack_set_state(mpc_stack_t *s, int x) {
 
 static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
   if (s->parsers_num > s->parsers_slots) {
-    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
-}
-
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
+    s->parsers_slots = s->parsers_slots ? s->parsers_slots * 2 : 64;
     s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
     s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
   }
@@ -826,7 +966,6 @@ static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
   *p = s->parsers[s->parsers_num-1];
   *st = s->states[s->parsers_num-1];
   s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
 }
 
 static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
@@ -854,15 +993,7 @@ static mpc_result_t mpc_result_out(mpc_val_t *x) {
 
 static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
   if (s->results_num > s->results_slots) {
-    s->results_slots = ceil((s->results_slots + 1) * 1.5);
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-  }
-}
-
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-    s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
+    s->results_slots = s->results_slots ? s->results_slots * 2 : 64;
     s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
     s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
   }
@@ -875,65 +1006,460 @@ static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
   s->returns[s->results_num-1] = r;
 }
 
-static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
-  int r;
-  *x = s->results[s->results_num-1];
-  r = s->returns[s->results_num-1];
-  s->results_num--;
-  mpc_stack_results_reserve_less(s);
-  return r;
+static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
+  int r;
+  *x = s->results[s->results_num-1];
+  r = s->returns[s->results_num-1];
+  s->results_num--;
+  return r;
+}
+
+static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
+  *x = s->results[s->results_num-1];
+  return s->returns[s->results_num-1];
+}
+
+static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    ds[n-1](x.output);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    dx(x.output);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    n--;
+  }
+}
+
+static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
+  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
+  mpc_stack_popr_n(s, n);
+  return x;
+}
+
+/* Stack Failure Stuff */
+
+static void mpc_fail_init(mpc_fail_t *f, long start) {
+  f->state = mpc_state_invalid();
+  f->recieved = ' ';
+  f->failure = NULL;
+  f->expected_num = 0;
+  f->start = start;
+}
+
+static void mpc_fail_reserve(mpc_fail_strs_t *b, long n) {
+  if (b->num + n > b->slots) {
+    while (b->num + n > b->slots) { b->slots = b->slots ? b->slots * 2 : 256; }
+    b->x = realloc(b->x, b->slots);
+  }
+}
+
+static int mpc_fail_contains(mpc_fail_strs_t *b, mpc_fail_t *f, const char *x) {
+  int k;
+  long j = f->start;
+  for (k = 0; k < f->expected_num; k++) {
+    if (strcmp(b->x + j, x) == 0) { return 1; }
+    j += strlen(b->x + j) + 1;
+  }
+  return 0;
+}
+
+/*
+** A record further along replaces what came
+** before, one at the same position adds to it,
+** and the first failure message at a position
+** hides everything else.
+*/
+
+static int mpc_fail_at(mpc_fail_strs_t *b, mpc_fail_t *f, mpc_state_t state) {
+  if (state.pos < f->state.pos) { return 0; }
+  if (state.pos > f->state.pos) {
+    f->state = state;
+    f->failure = NULL;
+    f->expected_num = 0;
+    b->num = f->start;
+  }
+  return f->failure == NULL;
+}
+
+/*
+** Merges `c` into `f`. The two may share a buffer
+** as long as the strings of `c` come after `f`'s,
+** in which case they are only ever moved down.
+*/
+
+static void mpc_fail_merge(mpc_fail_strs_t *b, mpc_fail_t *f, mpc_fail_strs_t *cb, mpc_fail_t *c) {
+  
+  int k;
+  long j, n;
+  
+  if (c->state.pos < 0 || !mpc_fail_at(b, f, c->state)) { return; }
+  
+  if (c->failure) { f->failure = c->failure; return; }
+  
+  f->recieved = c->recieved;
+  
+  for (j = c->start, k = 0; k < c->expected_num; k++, j += n) {
+    n = strlen(cb->x + j) + 1;
+    if (mpc_fail_contains(b, f, cb->x + j)) { continue; }
+    mpc_fail_reserve(b, n);
+    memmove(b->x + b->num, cb->x + j, n);
+    b->num += n;
+    f->expected_num++;
+  }
+}
+
+static void mpc_stack_fail_push(mpc_stack_t *s) {
+  s->fails_num++;
+  if (s->fails_num > s->fails_slots) {
+    s->fails_slots = s->fails_slots ? s->fails_slots * 2 : 16;
+    s->fails = realloc(s->fails, sizeof(mpc_fail_t) * s->fails_slots);
+  }
+  mpc_fail_init(&s->fails[s->fails_num-1], s->strs.num);
+}
+
+static void mpc_stack_fail_pop(mpc_stack_t *s, int to) {
+  mpc_fail_t *c = &s->fails[--s->fails_num];
+  s->strs.num = c->start;
+  if (to == MPC_FAIL_PARENT) { mpc_fail_merge(&s->strs, c-1, &s->strs, c); }
+  if (to == MPC_FAIL_LEAK)   { mpc_fail_merge(&s->leak_strs, &s->leak, &s->strs, c); }
+}
+
+static void mpc_stack_fail_expected(mpc_stack_t *s, mpc_state_t state, const char *x, char recieved) {
+  
+  long n;
+  mpc_fail_t *f = &s->fails[s->fails_num-1];
+  
+  if (!mpc_fail_at(&s->strs, f, state)) { return; }
+  
+  f->recieved = recieved;
+  if (mpc_fail_contains(&s->strs, f, x)) { return; }
+  
+  n = strlen(x) + 1;
+  mpc_fail_reserve(&s->strs, n);
+  memcpy(s->strs.x + s->strs.num, x, n);
+  s->strs.num += n;
+  f->expected_num++;
+}
+
+static void mpc_stack_fail_failure(mpc_stack_t *s, mpc_state_t state, const char *x) {
+  if (!mpc_fail_at(&s->strs, &s->fails[s->fails_num-1], state)) { return; }
+  s->fails[s->fails_num-1].failure = x;
+}
+
+/* Collapses the expected strings into one such as "one or more of a or b" */
+static void mpc_stack_fail_repeat(mpc_stack_t *s, const char *prefix) {
+  
+  int k;
+  long j, n;
+  mpc_fail_strs_t *b = &s->repeat_strs;
+  mpc_fail_t *f = &s->fails[s->fails_num-1];
+  
+  if (f->state.pos < 0) { return; }
+  
+  b->num = 0;
+  mpc_fail_reserve(b, strlen(prefix) + (s->strs.num - f->start) + 4 * f->expected_num + 1);
+  
+  n = strlen(prefix);
+  memcpy(b->x, prefix, n);
+  b->num = n;
+  
+  for (j = f->start, k = 0; k < f->expected_num; k++, j += n + 1) {
+    n = strlen(s->strs.x + j);
+    memcpy(b->x + b->num, s->strs.x + j, n);
+    b->num += n;
+    if (k <  f->expected_num-2) { memcpy(b->x + b->num, ", ", 2);   b->num += 2; }
+    if (k == f->expected_num-2) { memcpy(b->x + b->num, " or ", 4); b->num += 4; }
+  }
+  b->x[b->num++] = '\0';
+  
+  s->strs.num = f->start;
+  mpc_fail_reserve(&s->strs, b->num);
+  memcpy(s->strs.x + f->start, b->x, b->num);
+  s->strs.num = f->start + b->num;
+  f->expected_num = 1;
+}
+
+static mpc_err_t *mpc_stack_fail_err(mpc_stack_t *s, const char *filename) {
+  
+  int k;
+  long j;
+  mpc_fail_t *f = &s->leak;
+  mpc_err_t *e;
+  
+  mpc_fail_merge(&s->leak_strs, f, &s->strs, &s->fails[0]);
+  
+  if (f->state.pos < 0) { return mpc_err_fail(filename, f->state, "Unknown Error"); }
+  
+  e = malloc(sizeof(mpc_err_t));
+  e->filename = malloc(strlen(filename) + 1);
+  strcpy(e->filename, filename);
+  e->state = f->state;
+  e->expected_num = f->expected_num;
+  e->expected = malloc(sizeof(char*) * f->expected_num);
+  for (j = 0, k = 0; k < f->expected_num; k++) {
+    e->expected[k] = malloc(strlen(s->leak_strs.x + j) + 1);
+    strcpy(e->expected[k], s->leak_strs.x + j);
+    j += strlen(s->leak_strs.x + j) + 1;
+  }
+  e->failure = NULL;
+  if (f->failure) {
+    e->failure = malloc(strlen(f->failure) + 1);
+    strcpy(e->failure, f->failure);
+  }
+  e->recieved = f->recieved;
+  return e;
+}
+
+/* Dispatch Stuff */
+
+/*
+** An optimised `or` has a table saying which
+** alternatives could match given the next
+** character. The viable alternatives are tried
+** first and, only if they all fail, the rest
+** are tried too so the error still lists what
+** every alternative expected.
+*/
+
+static int mpc_or_viable(mpc_parser_t *p, char c, int j) {
+  return p->data.or.first[(unsigned char)c * p->data.or.n + j];
+}
+
+static int mpc_or_next(mpc_parser_t *p, char c, int j, int viable) {
+  while (j < p->data.or.n && mpc_or_viable(p, c, j) != viable) { j++; }
+  return j;
+}
+
+
+/* Stack Memo Stuff */
+
+static mpc_memo_t *mpc_stack_memo_slot(mpc_stack_t *s, mpc_parser_t *p, long pos) {
+  unsigned long h = ((unsigned long)p >> 4) ^ ((unsigned long)pos * 2654435761UL);
+  
+  if (s->memos == NULL) {
+    s->memos = calloc(MPC_MEMO_SLOTS, sizeof(mpc_memo_t));
+    s->memos_used = malloc(sizeof(int) * MPC_MEMO_SLOTS);
+  }
+  
+  return &s->memos[h % MPC_MEMO_SLOTS];
+}
+
+static void mpc_stack_memo_release(mpc_stack_t *s, mpc_memo_t *m) {
+  if (m->p == NULL) { return; }
+  if (m->success) {
+    s->memos_bytes -= m->state.pos - m->pos;
+    m->dx(m->result.output);
+  }
+  m->p = NULL;
+}
+
+static mpc_memo_t *mpc_stack_memo_find(mpc_stack_t *s, mpc_parser_t *p, long pos) {
+  mpc_memo_t *m = mpc_stack_memo_slot(s, p, pos);
+  return (m->p == p && m->pos == pos) ? m : NULL;
+}
+
+static void mpc_stack_memo_store(mpc_stack_t *s, mpc_parser_t *p, long pos, mpc_input_t *i, int success, mpc_result_t r, mpc_dtor_t dx) {
+  mpc_memo_t *m;
+  long bytes = success ? i->state.pos - pos : 0;
+  
+  if (bytes > MPC_MEMO_BYTES) { dx(r.output); return; }
+  if (s->memos_bytes + bytes > MPC_MEMO_BYTES) { mpc_stack_memo_clear(s); }
+  
+  m = mpc_stack_memo_slot(s, p, pos);
+  if (m->p == NULL) { s->memos_used[s->memos_used_num++] = (int)(m - s->memos); }
+  else { mpc_stack_memo_release(s, m); }
+  
+  s->memos_bytes += bytes;
+  
+  m->p = p;
+  m->pos = pos;
+  m->success = success;
+  m->state = i->state;
+  m->last = i->last;
+  m->result = r;
+  m->dx = dx;
+  
+  /* The failures recorded under the memo frame are replayed on a hit */
+  m->strs.num = 0;
+  mpc_fail_init(&m->fail, 0);
+  mpc_fail_merge(&m->strs, &m->fail, &s->strs, &s->fails[s->fails_num-1]);
+}
+
+static void mpc_stack_memo_replay(mpc_stack_t *s, mpc_memo_t *m) {
+  mpc_fail_merge(&s->strs, &s->fails[s->fails_num-1], &m->strs, &m->fail);
+}
+
+static void mpc_stack_memo_clear(mpc_stack_t *s) {
+  while (s->memos_used_num) {
+    mpc_stack_memo_release(s, &s->memos[s->memos_used[--s->memos_used_num]]);
+  }
+}
+
+static void mpc_stack_memo_start(mpc_stack_t *s, long pos) {
+  s->memo_starts_num++;
+  if (s->memo_starts_num > s->memo_starts_slots) {
+    s->memo_starts_slots = s->memo_starts_slots ? s->memo_starts_slots * 2 : 64;
+    s->memo_starts = realloc(s->memo_starts, sizeof(long) * s->memo_starts_slots);
+  }
+  s->memo_starts[s->memo_starts_num-1] = pos;
+}
+
+static long mpc_stack_memo_end(mpc_stack_t *s) {
+  return s->memo_starts[--s->memo_starts_num];
+}
+
+static void mpc_input_restore(mpc_input_t *i, mpc_state_t state, char last) {
+  i->state = state;
+  i->last = last;
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->state.pos, SEEK_SET);
+  }
+}
+
+/*
+** AST Arena Type
+**
+** Blocks are bump allocated and grow geometrically,
+** so clearing keeps only the newest (largest) block
+** and a steady stream of parses stops allocating.
+**
+** The fold and apply functions which build the AST
+** have no way to reach the context, so the arena in
+** use is kept per thread while a context parses.
+*/
+
+enum {
+  MPC_AST_ARENA_ALIGN = 16,
+  MPC_AST_ARENA_BLOCK = 4096,
+  MPC_AST_ARENA_BLOCK_MAX = 1048576
+};
+
+typedef struct mpc_ast_block_t {
+  struct mpc_ast_block_t *next;
+  size_t size;
+  size_t used;
+} mpc_ast_block_t;
+
+struct mpc_ast_arena_t {
+  mpc_ast_block_t *blocks;
+};
+
+static MPC_THREAD_LOCAL mpc_ast_arena_t *mpc_ast_arena_current = NULL;
+
+static size_t mpc_ast_arena_round(size_t n) {
+  return (n + MPC_AST_ARENA_ALIGN - 1) & ~(size_t)(MPC_AST_ARENA_ALIGN - 1);
+}
+
+mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  mpc_ast_arena_t *a = malloc(sizeof(mpc_ast_arena_t));
+  a->blocks = NULL;
+  return a;
+}
+
+void mpc_ast_arena_clear(mpc_ast_arena_t *a) {
+  
+  mpc_ast_block_t *b, *n;
+  
+  if (a->blocks == NULL) { return; }
+  
+  b = a->blocks->next;
+  while (b) { n = b->next; free(b); b = n; }
+  
+  a->blocks->next = NULL;
+  a->blocks->used = 0;
+  
 }
 
-static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
-  *x = s->results[s->results_num-1];
-  return s->returns[s->results_num-1];
+void mpc_ast_arena_delete(mpc_ast_arena_t *a) {
+  mpc_ast_arena_clear(a);
+  free(a->blocks);
+  free(a);
 }
 
-static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    mpc_stack_err(s, x.error);
-    n--;
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *a, size_t n) {
+  
+  size_t size;
+  mpc_ast_block_t *b = a->blocks;
+  
+  n = mpc_ast_arena_round(n);
+  
+  if (b == NULL || b->used + n > b->size) {
+    size = b ? b->size * 2 : MPC_AST_ARENA_BLOCK;
+    size = size > MPC_AST_ARENA_BLOCK_MAX ? MPC_AST_ARENA_BLOCK_MAX : size;
+    size = size < n ? n : size;
+    b = malloc(mpc_ast_arena_round(sizeof(mpc_ast_block_t)) + size);
+    b->next = a->blocks;
+    b->size = size;
+    b->used = 0;
+    a->blocks = b;
   }
+  
+  b->used += n;
+  return (char*)b + mpc_ast_arena_round(sizeof(mpc_ast_block_t)) + b->used - n;
 }
 
-static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    ds[n-1](x.output);
-    n--;
-  }
+static void *mpc_ast_malloc(size_t n) {
+  if (mpc_ast_arena_current) { return mpc_ast_arena_alloc(mpc_ast_arena_current, n); }
+  return malloc(n);
 }
 
-static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    dx(x.output);
-    n--;
-  }
+static void *mpc_ast_realloc(void *p, size_t old, size_t n) {
+  void *q;
+  if (mpc_ast_arena_current == NULL) { return realloc(p, n); }
+  q = mpc_ast_arena_alloc(mpc_ast_arena_current, n);
+  if (p) { memcpy(q, p, old < n ? old : n); }
+  return q;
 }
 
-static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    n--;
-  }
+static void mpc_ast_free(void *p) {
+  if (mpc_ast_arena_current == NULL) { free(p); }
 }
 
-static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
-  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
-  mpc_stack_popr_n(s, n);
-  return x;
+/*
+** Context Type
+*/
+
+struct mpc_context_t {
+  mpc_input_t input;
+  mpc_stack_t stack;
+  mpc_ast_arena_t *arena;
+};
+
+mpc_context_t *mpc_context_new(void) {
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
+  c->input.marks_slots = 0;
+  c->input.marks = NULL;
+  c->input.lasts = NULL;
+  mpc_input_reset(&c->input, MPC_INPUT_STRING, "");
+  mpc_stack_init(&c->stack);
+  c->arena = NULL;
+  return c;
 }
 
-static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
-  mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
-  mpc_stack_popr_n(s, n);
-  return x;
+void mpc_context_arena(mpc_context_t *c, mpc_ast_arena_t *a) {
+  c->arena = a;
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  free(c->input.marks);
+  free(c->input.lasts);
+  mpc_stack_free(&c->stack);
+  free(c);
 }
 
 /*
@@ -959,21 +1485,25 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 
 #define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
 #define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
-#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
-#define MPC_PRIMITIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+#define MPC_FAILURE() mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(NULL), 0); continue
+#define MPC_PRIMITIVE(x, f) if (f) { MPC_SUCCESS(x); } else { mpc_stack_fail_failure(stk, i->state, "Incorrect Input"); MPC_FAILURE(); }
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+static int mpc_parse_run(mpc_input_t *i, mpc_stack_t *stk, mpc_parser_t *init, mpc_result_t *final) {
   
   /* Stack */
   int st = 0;
   mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
   
   /* Variables */
-  char *s;
+  char *s, c, prefix[32];
+  int j;
+  long pos;
+  mpc_state_t dead;
+  mpc_memo_t *m;
   mpc_result_t r;
 
   /* Go! */
+  mpc_stack_reset(stk);
   mpc_stack_pushp(stk, init);
   
   while (!mpc_stack_empty(stk)) {
@@ -991,12 +1521,16 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       case MPC_TYPE_NONEOF:    MPC_PRIMITIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
       case MPC_TYPE_SATISFY:   MPC_PRIMITIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
       case MPC_TYPE_STRING:    MPC_PRIMITIVE(s, mpc_input_string(i, p->data.string.x, &s));
+      case MPC_TYPE_DFA:
+        if (mpc_input_dfa(i, p->data.dfa.d, &s, &dead, &c)) { MPC_SUCCESS(s); }
+        mpc_stack_fail_expected(stk, dead, p->data.dfa.d->expected, c);
+        MPC_FAILURE();
       
       /* Other parsers */
       
-      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
+      case MPC_TYPE_UNDEFINED: mpc_stack_fail_failure(stk, i->state, "Parser Undefined!"); MPC_FAILURE();
       case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
+      case MPC_TYPE_FAIL:      mpc_stack_fail_failure(stk, i->state, p->data.fail.m); MPC_FAILURE();
       case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
       case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
       case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(i->state));
@@ -1005,19 +1539,22 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (mpc_input_anchor(i, p->data.anchor.f)) {
           MPC_SUCCESS(NULL);
         } else {
-          MPC_FAILURE(mpc_err_new(i->filename, i->state, "anchor", mpc_input_peekc(i)));
+          mpc_stack_fail_expected(stk, i->state, "anchor", mpc_input_peekc(i));
+          MPC_FAILURE();
         }
       
       /* Application Parsers */
       
       case MPC_TYPE_EXPECT:
-        if (st == 0) { MPC_CONTINUE(1, p->data.expect.x); }
+        if (st == 0) { mpc_stack_fail_push(stk); MPC_CONTINUE(1, p->data.expect.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
+            mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
             MPC_SUCCESS(r.output);
           } else {
-            mpc_err_delete(r.error); 
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m, mpc_input_peekc(i)));
+            mpc_stack_fail_pop(stk, MPC_FAIL_DROP);
+            mpc_stack_fail_expected(stk, i->state, p->data.expect.m, mpc_input_peekc(i));
+            MPC_FAILURE();
           }
         }
       
@@ -1027,7 +1564,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(p->data.apply.f(r.output));
           } else {
-            MPC_FAILURE(r.error);
+            MPC_FAILURE();
           }
         }
       
@@ -1037,7 +1574,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(p->data.apply_to.f(r.output, p->data.apply_to.d));
           } else {
-            MPC_FAILURE(r.error);
+            MPC_FAILURE();
           }
         }
       
@@ -1054,26 +1591,29 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       /* TODO: Update Not Error Message */
       
       case MPC_TYPE_NOT:
-        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(1, p->data.not.x); }
+        if (st == 0) { mpc_input_mark(i); mpc_stack_fail_push(stk); MPC_CONTINUE(1, p->data.not.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
+            mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
             mpc_input_rewind(i);
             p->data.not.dx(r.output);
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite", mpc_input_peekc(i)));
+            mpc_stack_fail_expected(stk, i->state, "opposite", mpc_input_peekc(i));
+            MPC_FAILURE();
           } else {
+            mpc_stack_fail_pop(stk, MPC_FAIL_LEAK);
             mpc_input_unmark(i);
-            mpc_stack_err(stk, r.error);
             MPC_SUCCESS(p->data.not.lf());
           }
         }
       
       case MPC_TYPE_MAYBE:
-        if (st == 0) { MPC_CONTINUE(1, p->data.not.x); }
+        if (st == 0) { mpc_stack_fail_push(stk); MPC_CONTINUE(1, p->data.not.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
+            mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
             MPC_SUCCESS(r.output);
           } else {
-            mpc_stack_err(stk, r.error);
+            mpc_stack_fail_pop(stk, MPC_FAIL_LEAK);
             MPC_SUCCESS(p->data.not.lf());
           }
         }
@@ -1081,44 +1621,55 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       /* Repeat Parsers */
       
       case MPC_TYPE_MANY:
-        if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
+        if (st == 0) { mpc_stack_fail_push(stk); MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
+            mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
+            mpc_stack_fail_push(stk);
             MPC_CONTINUE(st+1, p->data.repeat.x);
           } else {
+            mpc_stack_fail_pop(stk, MPC_FAIL_LEAK);
             mpc_stack_popr(stk, &r);
-            mpc_stack_err(stk, r.error);
             MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
           }
         }
       
       case MPC_TYPE_MANY1:
-        if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
+        if (st == 0) { mpc_stack_fail_push(stk); MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
+            mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
+            mpc_stack_fail_push(stk);
             MPC_CONTINUE(st+1, p->data.repeat.x);
           } else {
             if (st == 1) {
+              mpc_stack_fail_repeat(stk, "one or more of ");
+              mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
               mpc_stack_popr(stk, &r);
-              MPC_FAILURE(mpc_err_many1(r.error));
+              MPC_FAILURE();
             } else {
+              mpc_stack_fail_pop(stk, MPC_FAIL_LEAK);
               mpc_stack_popr(stk, &r);
-              mpc_stack_err(stk, r.error);
               MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
             }
           }
         }
       
       case MPC_TYPE_COUNT:
-        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.repeat.x); }
+        if (st == 0) { mpc_input_mark(i); mpc_stack_fail_push(stk); MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (!mpc_stack_peekr(stk, &r)) {
+            sprintf(prefix, "%i of ", p->data.repeat.n);
+            mpc_stack_fail_repeat(stk, prefix);
+            mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
             mpc_stack_popr(stk, &r);
             mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
             mpc_input_rewind(i);
-            MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
+            MPC_FAILURE();
           } else {
+            mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
             if (st < p->data.repeat.n) {
+              mpc_stack_fail_push(stk);
               MPC_CONTINUE(st+1, p->data.repeat.x);
             } else {
               mpc_input_unmark(i);
@@ -1133,15 +1684,55 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         
         if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
         
-        if (st == 0) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
+        /*
+        ** With a dispatch table states 1 to n mean a
+        ** viable alternative was just tried and states
+        ** n+1 to 2n that one of the others was. Failures
+        ** never consume input when backtracking is on so
+        ** the next character is the same each time round.
+        */
+        
+        if (p->data.or.first && i->backtrack > 0) {
+          
+          c = mpc_input_peekc(i);
+          
+          if (st == 0) {
+            mpc_stack_fail_push(stk);
+            j = mpc_or_next(p, c, 0, 1);
+            if (j < p->data.or.n) { MPC_CONTINUE(j+1, p->data.or.xs[j]); }
+            j = mpc_or_next(p, c, 0, 0);
+            MPC_CONTINUE(p->data.or.n+j+1, p->data.or.xs[j]);
+          }
+          
+          if (mpc_stack_popr(stk, &r)) {
+            mpc_stack_fail_pop(stk, MPC_FAIL_LEAK);
+            MPC_SUCCESS(r.output);
+          }
+          
+          j = (st-1) % p->data.or.n;
+          
+          if (st <= p->data.or.n) {
+            j = mpc_or_next(p, c, j+1, 1);
+            if (j < p->data.or.n) { MPC_CONTINUE(j+1, p->data.or.xs[j]); }
+            j = mpc_or_next(p, c, 0, 0);
+          } else {
+            j = mpc_or_next(p, c, j+1, 0);
+          }
+          
+          if (j < p->data.or.n) { MPC_CONTINUE(p->data.or.n+j+1, p->data.or.xs[j]); }
+          
+          mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
+          MPC_FAILURE();
+        }
+        
+        if (st == 0) { mpc_stack_fail_push(stk); MPC_CONTINUE(st+1, p->data.or.xs[st]); }
         if (st <= p->data.or.n) {
-          if (mpc_stack_peekr(stk, &r)) {
-            mpc_stack_popr(stk, &r);
-            mpc_stack_popr_err(stk, st-1);
+          if (mpc_stack_popr(stk, &r)) {
+            mpc_stack_fail_pop(stk, MPC_FAIL_LEAK);
             MPC_SUCCESS(r.output);
           }
           if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-          if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n)); }
+          if (st == p->data.or.n) { mpc_stack_fail_pop(stk, MPC_FAIL_PARENT); MPC_FAILURE(); }
         }
       
       case MPC_TYPE_AND:
@@ -1154,21 +1745,67 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             mpc_input_rewind(i);
             mpc_stack_popr(stk, &r);
             mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
-            MPC_FAILURE(r.error);
+            MPC_FAILURE();
           }
           if (st <  p->data.and.n) { MPC_CONTINUE(st+1, p->data.and.xs[st]); }
           if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p->data.and.f)); }
         }
       
+      /* Memo Parsers */
+      
+      /*
+      ** Pipes cannot be seeked forward to the end of
+      ** a cached match so for them the memo parser
+      ** just passes its result through in state 2.
+      */
+      
+      case MPC_TYPE_MEMO:
+        if (st == 0) {
+          if (i->type == MPC_INPUT_PIPE) { MPC_CONTINUE(2, p->data.memo.x); }
+          m = mpc_stack_memo_find(stk, p->data.memo.x, i->state.pos);
+          if (m) {
+            mpc_input_restore(i, m->state, m->last);
+            mpc_stack_memo_replay(stk, m);
+            if (m->success) {
+              MPC_SUCCESS(p->data.memo.ref(m->result.output));
+            } else {
+              MPC_FAILURE();
+            }
+          }
+          mpc_stack_memo_start(stk, i->state.pos);
+          mpc_stack_fail_push(stk);
+          MPC_CONTINUE(1, p->data.memo.x);
+        }
+        if (st == 1) {
+          pos = mpc_stack_memo_end(stk);
+          if (mpc_stack_popr(stk, &r)) {
+            mpc_stack_memo_store(stk, p->data.memo.x, pos, i, 1, mpc_result_out(p->data.memo.ref(r.output)), p->data.memo.dx);
+            mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
+            MPC_SUCCESS(r.output);
+          } else {
+            mpc_stack_memo_store(stk, p->data.memo.x, pos, i, 0, mpc_result_err(NULL), p->data.memo.dx);
+            mpc_stack_fail_pop(stk, MPC_FAIL_PARENT);
+            MPC_FAILURE();
+          }
+        }
+        if (st == 2) {
+          if (mpc_stack_popr(stk, &r)) {
+            MPC_SUCCESS(r.output);
+          } else {
+            MPC_FAILURE();
+          }
+        }
+      
       /* End */
       
       default:
         
-        MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
+        mpc_stack_fail_failure(stk, i->state, "Unknown Parser Type Id!");
+        MPC_FAILURE();
     }
   }
   
-  return mpc_stack_terminate(stk, final);
+  return mpc_stack_terminate(stk, i->filename, final);
   
 }
 
@@ -1177,6 +1814,28 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  int x;
+  mpc_stack_t stk;
+  mpc_ast_arena_t *prev = mpc_ast_arena_current;
+  mpc_ast_arena_current = NULL;
+  mpc_stack_init(&stk);
+  x = mpc_parse_run(i, &stk, init, final);
+  mpc_stack_free(&stk);
+  mpc_ast_arena_current = prev;
+  return x;
+}
+
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_ast_arena_t *prev = mpc_ast_arena_current;
+  mpc_ast_arena_current = c->arena;
+  mpc_input_reset_string(&c->input, filename, string);
+  x = mpc_parse_run(&c->input, &c->stack, p, r);
+  mpc_ast_arena_current = prev;
+  return x;
+}
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_string(filename, string);
@@ -1230,6 +1889,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.first);
   
 }
 
@@ -1261,6 +1921,15 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    
+    case MPC_TYPE_DFA:
+      free(p->data.dfa.d->re);
+      free(p->data.dfa.d->expected);
+      free(p->data.dfa.d->next);
+      free(p->data.dfa.d->accept);
+      free(p->data.dfa.d);
+      break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1574,6 +2243,15 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t ref, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.ref = ref;
+  p->data.memo.dx = da;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -1635,6 +2313,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -1941,70 +2620,470 @@ static const char *mpc_re_range_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  for (i = comp; i < strlen(s); i++){
+    
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];      
+      }
+      i++;
+    }
+    
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = j;
+        }        
+      }
+    }
+    
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+  
+  }
+  
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  
+  free(x);
+  free(range);
+  
+  return out;
+}
+
+/*
+** Regular Expression Compiler
+*/
+
+/*
+** Most regular expressions given to `mpc_re`
+** are simple tokens such as numbers or symbols.
+** Rather than running these through a tree of
+** combinators one character at a time they are
+** compiled into a DFA which runs as a single
+** primitive.
+**
+** The expression is parsed into a small syntax
+** tree and turned into a DFA via the followpos
+** construction. Anything the compiler does not
+** understand - anchors, the negated escapes,
+** malformed expressions, or an automaton that
+** grows too large - makes it give up and
+** `mpc_re` falls back to the combinator version.
+**
+** Note the DFA matches leftmost-longest where
+** the combinators are greedy without backtracking
+** into a repetition. For token-like expressions
+** these are the same.
+*/
+
+enum {
+  MPC_RE_SET   = 0,
+  MPC_RE_CAT   = 1,
+  MPC_RE_ALT   = 2,
+  MPC_RE_STAR  = 3,
+  MPC_RE_PLUS  = 4,
+  MPC_RE_MAYBE = 5,
+  MPC_RE_EMPTY = 6
+};
+
+enum {
+  MPC_RE_MAX_POSITIONS = 255,
+  MPC_RE_MAX_STATES    = 256
+};
+
+typedef struct { unsigned char b[32]; } mpc_re_bits_t;
+
+#define MPC_RE_BIT_SET(x, i) ((x).b[(i) >> 3] |= (unsigned char)(1 << ((i) & 7)))
+#define MPC_RE_BIT_GET(x, i) (((x).b[(i) >> 3] >> ((i) & 7)) & 1)
+
+typedef struct mpc_re_node_t {
+  int type;
+  int pos;
+  mpc_re_bits_t chars;
+  struct mpc_re_node_t *a;
+  struct mpc_re_node_t *b;
+  int nullable;
+  mpc_re_bits_t first;
+  mpc_re_bits_t last;
+} mpc_re_node_t;
+
+typedef struct {
+  const char *s;
+  int ok;
+  int nodes_num;
+  mpc_re_node_t **nodes;
+  int positions_num;
+  mpc_re_bits_t chars[MPC_RE_MAX_POSITIONS];
+  mpc_re_bits_t follow[MPC_RE_MAX_POSITIONS];
+} mpc_re_compiler_t;
+
+static void mpc_re_bits_or(mpc_re_bits_t *x, const mpc_re_bits_t *y) {
+  int i;
+  for (i = 0; i < 32; i++) { x->b[i] |= y->b[i]; }
+}
+
+static int mpc_re_bits_empty(const mpc_re_bits_t *x) {
+  int i;
+  for (i = 0; i < 32; i++) { if (x->b[i]) { return 0; } }
+  return 1;
+}
+
+static void mpc_re_bits_str(mpc_re_bits_t *x, const char *s) {
+  while (*s) { MPC_RE_BIT_SET(*x, (unsigned char)*s); s++; }
+}
+
+static mpc_re_node_t *mpc_re_node(mpc_re_compiler_t *c, int type, mpc_re_node_t *a, mpc_re_node_t *b) {
+  mpc_re_node_t *n = calloc(1, sizeof(mpc_re_node_t));
+  n->type = type;
+  n->a = a;
+  n->b = b;
+  c->nodes_num++;
+  c->nodes = realloc(c->nodes, sizeof(mpc_re_node_t*) * c->nodes_num);
+  c->nodes[c->nodes_num-1] = n;
+  return n;
+}
+
+static mpc_re_node_t *mpc_re_node_copy(mpc_re_compiler_t *c, mpc_re_node_t *x) {
+  mpc_re_node_t *n;
+  if (x == NULL) { return NULL; }
+  n = mpc_re_node(c, x->type, mpc_re_node_copy(c, x->a), mpc_re_node_copy(c, x->b));
+  n->chars = x->chars;
+  return n;
+}
+
+static mpc_re_node_t *mpc_re_fail(mpc_re_compiler_t *c) {
+  c->ok = 0;
+  return mpc_re_node(c, MPC_RE_EMPTY, NULL, NULL);
+}
+
+/* Mirrors `mpcf_re_range` */
+static mpc_re_node_t *mpc_re_compile_range(mpc_re_compiler_t *c, const char *s, size_t n) {
+  
+  size_t i, j;
+  const char *tmp;
+  int comp = s[0] == '^' ? 1 : 0;
+  mpc_re_node_t *x = mpc_re_node(c, MPC_RE_SET, NULL, NULL);
+  mpc_re_bits_t range;
+  
+  memset(&range, 0, sizeof(range));
+  
+  if (n == 0 || (comp && n == 1)) { return mpc_re_fail(c); }
+  
+  for (i = comp; i < n; i++) {
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) { mpc_re_bits_str(&range, tmp); }
+      else { MPC_RE_BIT_SET(range, (unsigned char)s[i+1]); }
+      i++;
+    } else if (s[i] == '-') {
+      if (i + 1 == n || i == 0) {
+        MPC_RE_BIT_SET(range, '-');
+      } else {
+        for (j = (size_t)s[i-1]+1; j + 1 <= (size_t)s[i+1]; j++) {
+          MPC_RE_BIT_SET(range, j & 0xFF);
+        }
+      }
+    } else {
+      MPC_RE_BIT_SET(range, (unsigned char)s[i]);
+    }
+  }
+  
+  for (i = 0; i < 32; i++) {
+    x->chars.b[i] = comp ? (unsigned char)~range.b[i] : range.b[i];
+  }
+  x->chars.b[0] &= 0xFE;
+  
+  return x;
+}
+
+static mpc_re_node_t *mpc_re_compile_regex(mpc_re_compiler_t *c);
+
+static mpc_re_node_t *mpc_re_compile_base(mpc_re_compiler_t *c) {
+  
+  const char *start;
+  mpc_re_node_t *x;
+  
+  if (*c->s == '(') {
+    c->s++;
+    x = mpc_re_compile_regex(c);
+    if (*c->s != ')') { return mpc_re_fail(c); }
+    c->s++;
+    return x;
+  }
+  
+  if (*c->s == '[') {
+    start = ++c->s;
+    while (*c->s && *c->s != ']') {
+      if (*c->s == '\\') {
+        c->s++;
+        if (*c->s == '\0') { return mpc_re_fail(c); }
+      }
+      c->s++;
+    }
+    if (*c->s != ']') { return mpc_re_fail(c); }
+    x = mpc_re_compile_range(c, start, c->s - start);
+    c->s++;
+    return x;
+  }
+  
+  x = mpc_re_node(c, MPC_RE_SET, NULL, NULL);
+  
+  if (*c->s == '\\') {
+    c->s++;
+    switch (*c->s) {
+      case 'a': MPC_RE_BIT_SET(x->chars, '\a'); break;
+      case 'f': MPC_RE_BIT_SET(x->chars, '\f'); break;
+      case 'n': MPC_RE_BIT_SET(x->chars, '\n'); break;
+      case 'r': MPC_RE_BIT_SET(x->chars, '\r'); break;
+      case 't': MPC_RE_BIT_SET(x->chars, '\t'); break;
+      case 'v': MPC_RE_BIT_SET(x->chars, '\v'); break;
+      case 'd': mpc_re_bits_str(&x->chars, "0123456789"); break;
+      case 's': mpc_re_bits_str(&x->chars, " \f\n\r\t\v"); break;
+      case 'w': mpc_re_bits_str(&x->chars, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_"); break;
+      case '\0':
+      case 'b': case 'B': case 'A': case 'Z':
+      case 'D': case 'S': case 'W':
+        return mpc_re_fail(c);
+      default: MPC_RE_BIT_SET(x->chars, (unsigned char)*c->s); break;
+    }
+    c->s++;
+    return x;
+  }
+  
+  switch (*c->s) {
+    case '.': memset(&x->chars, 0xFF, sizeof(x->chars)); x->chars.b[0] &= 0xFE; break;
+    case '^': case '$':
+    case '*': case '+': case '?': case '{':
+      return mpc_re_fail(c);
+    default: MPC_RE_BIT_SET(x->chars, (unsigned char)*c->s); break;
+  }
+  
+  c->s++;
+  return x;
+}
+
+static mpc_re_node_t *mpc_re_compile_factor(mpc_re_compiler_t *c) {
+  
+  int i, n;
+  mpc_re_node_t *x = mpc_re_compile_base(c);
+  mpc_re_node_t *r;
+  
+  switch (*c->s) {
+    case '*': c->s++; return mpc_re_node(c, MPC_RE_STAR, x, NULL);
+    case '+': c->s++; return mpc_re_node(c, MPC_RE_PLUS, x, NULL);
+    case '?': c->s++; return mpc_re_node(c, MPC_RE_MAYBE, x, NULL);
+    case '{':
+      c->s++;
+      if (!isdigit((unsigned char)*c->s)) { return mpc_re_fail(c); }
+      n = (int)strtol(c->s, (char**)&c->s, 10);
+      if (*c->s != '}' || n > MPC_RE_MAX_POSITIONS) { return mpc_re_fail(c); }
+      c->s++;
+      r = mpc_re_node(c, MPC_RE_EMPTY, NULL, NULL);
+      for (i = 0; i < n; i++) {
+        r = mpc_re_node(c, MPC_RE_CAT, r, i == 0 ? x : mpc_re_node_copy(c, x));
+      }
+      return r;
+    default: return x;
+  }
+}
+
+static mpc_re_node_t *mpc_re_compile_term(mpc_re_compiler_t *c) {
+  mpc_re_node_t *x = mpc_re_node(c, MPC_RE_EMPTY, NULL, NULL);
+  while (c->ok && *c->s && *c->s != ')' && *c->s != '|') {
+    x = mpc_re_node(c, MPC_RE_CAT, x, mpc_re_compile_factor(c));
+  }
+  return x;
+}
+
+static mpc_re_node_t *mpc_re_compile_regex(mpc_re_compiler_t *c) {
+  mpc_re_node_t *x = mpc_re_compile_term(c);
+  if (c->ok && *c->s == '|') {
+    c->s++;
+    x = mpc_re_node(c, MPC_RE_ALT, x, mpc_re_compile_regex(c));
+  }
+  return x;
+}
+
+static void mpc_re_positions(mpc_re_compiler_t *c, mpc_re_node_t *x) {
+  
+  int i;
+  
+  if (!c->ok) { return; }
+  
+  if (x->a) { mpc_re_positions(c, x->a); }
+  if (x->b) { mpc_re_positions(c, x->b); }
+  
+  switch (x->type) {
+    
+    case MPC_RE_SET:
+      if (c->positions_num == MPC_RE_MAX_POSITIONS) { c->ok = 0; return; }
+      x->pos = c->positions_num++;
+      c->chars[x->pos] = x->chars;
+      x->nullable = 0;
+      MPC_RE_BIT_SET(x->first, x->pos);
+      MPC_RE_BIT_SET(x->last, x->pos);
+      break;
+    
+    case MPC_RE_EMPTY:
+      x->nullable = 1;
+      break;
+    
+    case MPC_RE_CAT:
+      x->nullable = x->a->nullable && x->b->nullable;
+      x->first = x->a->first;
+      if (x->a->nullable) { mpc_re_bits_or(&x->first, &x->b->first); }
+      x->last = x->b->last;
+      if (x->b->nullable) { mpc_re_bits_or(&x->last, &x->a->last); }
+      for (i = 0; i < c->positions_num; i++) {
+        if (MPC_RE_BIT_GET(x->a->last, i)) { mpc_re_bits_or(&c->follow[i], &x->b->first); }
+      }
+      break;
+    
+    case MPC_RE_ALT:
+      x->nullable = x->a->nullable || x->b->nullable;
+      x->first = x->a->first;
+      mpc_re_bits_or(&x->first, &x->b->first);
+      x->last = x->a->last;
+      mpc_re_bits_or(&x->last, &x->b->last);
+      break;
+    
+    case MPC_RE_STAR:
+    case MPC_RE_PLUS:
+    case MPC_RE_MAYBE:
+      x->nullable = x->type == MPC_RE_PLUS ? x->a->nullable : 1;
+      x->first = x->a->first;
+      x->last = x->a->last;
+      if (x->type != MPC_RE_MAYBE) {
+        for (i = 0; i < c->positions_num; i++) {
+          if (MPC_RE_BIT_GET(x->a->last, i)) { mpc_re_bits_or(&c->follow[i], &x->a->first); }
+        }
+      }
+      break;
+  }
+}
+
+static mpc_dfa_t *mpc_re_dfa(const char *re) {
   
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  int i, j, k, ch, end;
+  int states_num = 0;
+  mpc_re_bits_t *states = NULL;
+  mpc_re_bits_t next;
+  mpc_re_node_t *root;
+  mpc_dfa_t *d = NULL;
+  mpc_re_compiler_t *c = calloc(1, sizeof(mpc_re_compiler_t));
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  c->s = re;
+  c->ok = 1;
+  root = mpc_re_compile_regex(c);
+  if (*c->s != '\0') { c->ok = 0; }
   
-  for (i = comp; i < strlen(s); i++){
+  mpc_re_positions(c, root);
+  
+  if (c->ok) {
     
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
-      }
-      i++;
+    /* The position after the last is the end marker */
+    end = c->positions_num;
+    for (i = 0; i < end; i++) {
+      if (MPC_RE_BIT_GET(root->last, i)) { MPC_RE_BIT_SET(c->follow[i], end); }
     }
     
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = j;
-        }        
-      }
-    }
+    states = malloc(sizeof(mpc_re_bits_t) * MPC_RE_MAX_STATES);
+    states[0] = root->first;
+    if (root->nullable) { MPC_RE_BIT_SET(states[0], end); }
+    states_num = 1;
     
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+    d = malloc(sizeof(mpc_dfa_t));
+    d->next = malloc(sizeof(int) * 256 * MPC_RE_MAX_STATES);
+    d->accept = malloc(MPC_RE_MAX_STATES);
+    
+    for (i = 0; i < states_num && c->ok; i++) {
+      
+      d->accept[i] = (char)MPC_RE_BIT_GET(states[i], end);
+      d->next[i * 256] = -1;
+      
+      for (ch = 1; ch < 256; ch++) {
+        
+        memset(&next, 0, sizeof(next));
+        for (j = 0; j < end; j++) {
+          if (MPC_RE_BIT_GET(states[i], j) && MPC_RE_BIT_GET(c->chars[j], ch)) {
+            mpc_re_bits_or(&next, &c->follow[j]);
+          }
+        }
+        
+        if (mpc_re_bits_empty(&next)) { d->next[i * 256 + ch] = -1; continue; }
+        
+        for (k = 0; k < states_num; k++) {
+          if (memcmp(&states[k], &next, sizeof(next)) == 0) { break; }
+        }
+        
+        if (k == states_num) {
+          if (states_num == MPC_RE_MAX_STATES) { c->ok = 0; break; }
+          states[states_num++] = next;
+        }
+        
+        d->next[i * 256 + ch] = k;
+      }
     }
-  
   }
   
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  if (d && c->ok) {
+    d->states_num = states_num;
+    d->next = realloc(d->next, sizeof(int) * 256 * states_num);
+    d->accept = realloc(d->accept, states_num);
+    d->re = malloc(strlen(re) + 1);
+    strcpy(d->re, re);
+    d->expected = malloc(strlen(re) + 3);
+    sprintf(d->expected, "/%s/", re);
+  } else if (d) {
+    free(d->next);
+    free(d->accept);
+    free(d);
+    d = NULL;
+  }
   
-  free(x);
-  free(range);
+  for (i = 0; i < c->nodes_num; i++) { free(c->nodes[i]); }
+  free(c->nodes);
+  free(states);
+  free(c);
   
-  return out;
+  return d;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
+/* The combinator version, for what the DFA compiler gives up on */
+static mpc_parser_t *mpc_re_combinators(const char *re) {
   
   char *err_msg;
   mpc_parser_t *err_out;
@@ -2063,6 +3142,259 @@ mpc_parser_t *mpc_re(const char *re) {
   
 }
 
+mpc_parser_t *mpc_re(const char *re) {
+  
+  mpc_parser_t *Regex;
+  mpc_dfa_t *d = mpc_re_dfa(re);
+  
+  /* The DFA says what it expected itself, where it failed */
+  if (d) {
+    Regex = mpc_undefined();
+    Regex->type = MPC_TYPE_DFA;
+    Regex->data.dfa.d = d;
+    return Regex;
+  }
+  
+  return mpc_re_combinators(re);
+}
+
+/*
+** Optimiser
+*/
+
+/*
+** `mpc_optimise` walks a parser and gives every
+** `or` it finds a table from the next character
+** to the alternatives which could match it.
+**
+** The FIRST sets used to build the tables are
+** conservative. Anything that cannot be looked
+** into - `satisfy`, undefined parsers, or a rule
+** which is still being computed further up the
+** recursion - is taken to match any character or
+** none at all. An alternative is only skipped if
+** it definitely cannot succeed, so the results
+** of parsing are unchanged.
+*/
+
+typedef struct {
+  mpc_re_bits_t chars;
+  int nullable;
+} mpc_first_t;
+
+typedef struct {
+  int parsers_num;
+  mpc_parser_t **parsers;
+  mpc_first_t *firsts;
+  int active_num;
+  mpc_parser_t **active;
+  int visited_num;
+  mpc_parser_t **visited;
+} mpc_optimiser_t;
+
+static void mpc_first_all(mpc_first_t *f) {
+  memset(&f->chars, 0xFF, sizeof(f->chars));
+  f->nullable = 1;
+}
+
+static void mpc_first_or(mpc_first_t *f, const mpc_first_t *g) {
+  mpc_re_bits_or(&f->chars, &g->chars);
+  f->nullable = f->nullable || g->nullable;
+}
+
+static int mpc_optimiser_contains(mpc_parser_t **ps, int n, mpc_parser_t *p) {
+  int i;
+  for (i = 0; i < n; i++) { if (ps[i] == p) { return i; } }
+  return -1;
+}
+
+static void mpc_optimiser_first(mpc_optimiser_t *o, mpc_parser_t *p, mpc_first_t *f) {
+  
+  int i, j;
+  mpc_first_t g;
+  
+  memset(f, 0, sizeof(mpc_first_t));
+  
+  j = mpc_optimiser_contains(o->parsers, o->parsers_num, p);
+  if (j >= 0) { *f = o->firsts[j]; return; }
+  
+  if (mpc_optimiser_contains(o->active, o->active_num, p) >= 0) { mpc_first_all(f); return; }
+  
+  o->active_num++;
+  o->active = realloc(o->active, sizeof(mpc_parser_t*) * o->active_num);
+  o->active[o->active_num-1] = p;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_SATISFY:
+      mpc_first_all(f);
+    break;
+    
+    case MPC_TYPE_FAIL: break;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_NOT:
+      f->nullable = 1;
+    break;
+    
+    case MPC_TYPE_ANY:
+      memset(&f->chars, 0xFF, sizeof(f->chars));
+    break;
+    
+    case MPC_TYPE_SINGLE:
+      MPC_RE_BIT_SET(f->chars, (unsigned char)p->data.single.x);
+    break;
+    
+    case MPC_TYPE_RANGE:
+      for (i = 0; i < 256; i++) {
+        if ((char)i >= p->data.range.x && (char)i <= p->data.range.y) { MPC_RE_BIT_SET(f->chars, i); }
+      }
+    break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (i = 1; i < 256; i++) {
+        if ((strchr(p->data.string.x, (char)i) != 0) == (p->type == MPC_TYPE_ONEOF)) {
+          MPC_RE_BIT_SET(f->chars, i);
+        }
+      }
+    break;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { f->nullable = 1; }
+      else { MPC_RE_BIT_SET(f->chars, (unsigned char)p->data.string.x[0]); }
+    break;
+    
+    case MPC_TYPE_DFA:
+      for (i = 0; i < 256; i++) {
+        if (p->data.dfa.d->next[i] >= 0) { MPC_RE_BIT_SET(f->chars, i); }
+      }
+      f->nullable = p->data.dfa.d->accept[0];
+    break;
+    
+    case MPC_TYPE_EXPECT:   mpc_optimiser_first(o, p->data.expect.x, f);   break;
+    case MPC_TYPE_APPLY:    mpc_optimiser_first(o, p->data.apply.x, f);    break;
+    case MPC_TYPE_APPLY_TO: mpc_optimiser_first(o, p->data.apply_to.x, f); break;
+    case MPC_TYPE_PREDICT:  mpc_optimiser_first(o, p->data.predict.x, f);  break;
+    case MPC_TYPE_MEMO:     mpc_optimiser_first(o, p->data.memo.x, f);     break;
+    
+    case MPC_TYPE_MAYBE:
+      mpc_optimiser_first(o, p->data.not.x, f);
+      f->nullable = 1;
+    break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_optimiser_first(o, p->data.repeat.x, f);
+      if (p->type == MPC_TYPE_MANY) { f->nullable = 1; }
+      if (p->type == MPC_TYPE_COUNT && p->data.repeat.n == 0) { f->nullable = 1; }
+    break;
+    
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) {
+        mpc_optimiser_first(o, p->data.or.xs[i], &g);
+        mpc_first_or(f, &g);
+      }
+      if (p->data.or.n == 0) { f->nullable = 1; }
+    break;
+    
+    case MPC_TYPE_AND:
+      f->nullable = 1;
+      for (i = 0; i < p->data.and.n && f->nullable; i++) {
+        mpc_optimiser_first(o, p->data.and.xs[i], &g);
+        mpc_re_bits_or(&f->chars, &g.chars);
+        f->nullable = g.nullable;
+      }
+    break;
+    
+    default:
+      mpc_first_all(f);
+    break;
+  }
+  
+  o->active_num--;
+  
+  o->parsers_num++;
+  o->parsers = realloc(o->parsers, sizeof(mpc_parser_t*) * o->parsers_num);
+  o->firsts = realloc(o->firsts, sizeof(mpc_first_t) * o->parsers_num);
+  o->parsers[o->parsers_num-1] = p;
+  o->firsts[o->parsers_num-1] = *f;
+}
+
+static void mpc_optimiser_or(mpc_optimiser_t *o, mpc_parser_t *p) {
+  
+  int c, j, n = p->data.or.n, skips = 0;
+  mpc_first_t f;
+  char *first = malloc(256 * n);
+  
+  for (j = 0; j < n; j++) {
+    mpc_optimiser_first(o, p->data.or.xs[j], &f);
+    for (c = 0; c < 256; c++) {
+      first[c * n + j] = (char)(c == 0 || f.nullable || MPC_RE_BIT_GET(f.chars, c));
+      skips += !first[c * n + j];
+    }
+  }
+  
+  free(p->data.or.first);
+  p->data.or.first = NULL;
+  
+  if (skips) { p->data.or.first = first; }
+  else { free(first); }
+}
+
+static void mpc_optimise_unretained(mpc_optimiser_t *o, mpc_parser_t *p) {
+  
+  int i;
+  
+  if (mpc_optimiser_contains(o->visited, o->visited_num, p) >= 0) { return; }
+  
+  o->visited_num++;
+  o->visited = realloc(o->visited, sizeof(mpc_parser_t*) * o->visited_num);
+  o->visited[o->visited_num-1] = p;
+  
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   mpc_optimise_unretained(o, p->data.expect.x);   break;
+    case MPC_TYPE_APPLY:    mpc_optimise_unretained(o, p->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: mpc_optimise_unretained(o, p->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  mpc_optimise_unretained(o, p->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     mpc_optimise_unretained(o, p->data.memo.x);     break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    mpc_optimise_unretained(o, p->data.not.x);      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    mpc_optimise_unretained(o, p->data.repeat.x);   break;
+    
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) { mpc_optimise_unretained(o, p->data.or.xs[i]); }
+      if (p->data.or.n > 1) { mpc_optimiser_or(o, p); }
+    break;
+    
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) { mpc_optimise_unretained(o, p->data.and.xs[i]); }
+    break;
+    
+    default: break;
+  }
+}
+
+void mpc_optimise(mpc_parser_t *p) {
+  mpc_optimiser_t o;
+  memset(&o, 0, sizeof(mpc_optimiser_t));
+  mpc_optimise_unretained(&o, p);
+  free(o.parsers);
+  free(o.firsts);
+  free(o.active);
+  free(o.visited);
+}
+
 /*
 ** Common Fold Functions
 */
@@ -2337,6 +3669,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   }
   
   if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+  if (p->type == MPC_TYPE_DFA) { printf("/%s/", p->data.dfa.d->re); }
   if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
 
   if (p->type == MPC_TYPE_SINGLE) {
@@ -2395,6 +3728,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2500,11 +3834,70 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+typedef struct {
+  int id;
+  char *name;
+} mpc_tag_t;
+
+static mpc_tag_t mpc_tags_builtin[MPC_TAG_USER] = {
+  { MPC_TAG_NONE,   ""       },
+  { MPC_TAG_ROOT,   ">"      },
+  { MPC_TAG_STRING, "string" },
+  { MPC_TAG_CHAR,   "char"   },
+  { MPC_TAG_REGEX,  "regex"  }
+};
+
+static int mpc_tags_num = 0;
+static mpc_tag_t **mpc_tags = NULL;
+
+/*
+** Tags are interned when a parser is built rather than at parse time, and
+** records are never moved or freed, so nodes can hold on to them.
+*/
+
+static mpc_tag_t *mpc_tag_intern(const char *t) {
+  
+  int i;
+  mpc_tag_t *g;
+  
+  for (i = 0; i < MPC_TAG_USER; i++) {
+    if (strcmp(mpc_tags_builtin[i].name, t) == 0) { return &mpc_tags_builtin[i]; }
+  }
+  
+  for (i = 0; i < mpc_tags_num; i++) {
+    if (strcmp(mpc_tags[i]->name, t) == 0) { return mpc_tags[i]; }
+  }
+  
+  g = malloc(sizeof(mpc_tag_t));
+  g->id = MPC_TAG_USER + mpc_tags_num;
+  g->name = malloc(strlen(t) + 1);
+  strcpy(g->name, t);
+  
+  mpc_tags_num++;
+  mpc_tags = realloc(mpc_tags, sizeof(mpc_tag_t*) * mpc_tags_num);
+  mpc_tags[mpc_tags_num-1] = g;
+  return g;
+  
+}
+
+int mpc_tag_id(const char *t) {
+  return mpc_tag_intern(t)->id;
+}
+
+const char *mpc_tag_name(int id) {
+  if (id < 0) { return NULL; }
+  if (id < MPC_TAG_USER) { return mpc_tags_builtin[id].name; }
+  if (id < MPC_TAG_USER + mpc_tags_num) { return mpc_tags[id - MPC_TAG_USER]->name; }
+  return NULL;
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
   
   int i;
   
-  if (a == NULL) { return; }
+  /* Arena nodes are released with the arena */
+  if (a == NULL || mpc_ast_arena_current) { return; }
+  if (a->refs > 1) { a->refs--; return; }
   
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
@@ -2518,28 +3911,103 @@ void mpc_ast_delete(mpc_ast_t *a) {
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  if (a->refs > 1) { a->refs--; return; }
+  mpc_ast_free(a->children);
+  mpc_ast_free(a->tag);
+  mpc_ast_free(a->contents);
+  mpc_ast_free(a);
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+/*
+** Children arrays grow in powers of two, so the
+** capacity never needs storing in the node.
+*/
+
+static int mpc_ast_children_slots(int n) {
+  int slots = 1;
+  if (n == 0) { return 0; }
+  while (slots < n) { slots *= 2; }
+  return slots;
+}
+
+static mpc_ast_t *mpc_ast_new_tag(mpc_tag_t *t, const char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_t *a = mpc_ast_malloc(sizeof(mpc_ast_t));
   
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  a->tag = mpc_ast_malloc(strlen(t->name) + 1);
+  strcpy(a->tag, t->name);
+  a->tag_id = t->id;
   
-  a->contents = malloc(strlen(contents) + 1);
+  a->contents = mpc_ast_malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
   
   a->state = mpc_state_new();
   
   a->children_num = 0;
   a->children = NULL;
+  a->refs = 1;
+  return a;
+  
+}
+
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  return mpc_ast_new_tag(mpc_tag_intern(tag), contents);
+}
+
+static mpc_ast_t *mpc_ast_ref(mpc_ast_t *a) {
+  if (a) { a->refs++; }
   return a;
+}
+
+/*
+** Gives the caller a node of its own to change. A
+** shared node is copied one level deep, with its
+** children shared between the two copies.
+*/
+
+static mpc_ast_t *mpc_ast_unshare(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *r;
+  
+  if (a->refs <= 1) { return a; }
+  
+  r = mpc_ast_new_tag(&mpc_tags_builtin[MPC_TAG_NONE], a->contents);
+  r->tag = mpc_ast_realloc(r->tag, 1, strlen(a->tag) + 1);
+  strcpy(r->tag, a->tag);
+  r->tag_id = a->tag_id;
+  r->state = a->state;
+  r->children_num = a->children_num;
+  r->children = mpc_ast_malloc(sizeof(mpc_ast_t*) * mpc_ast_children_slots(a->children_num));
+  
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = mpc_ast_ref(a->children[i]);
+  }
+  
+  a->refs--;
+  return r;
+}
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *r;
   
+  if (a == NULL) { return a; }
+  
+  r = mpc_ast_new_tag(&mpc_tags_builtin[MPC_TAG_NONE], a->contents);
+  r->tag = mpc_ast_realloc(r->tag, 1, strlen(a->tag) + 1);
+  strcpy(r->tag, a->tag);
+  r->tag_id = a->tag_id;
+  r->state = a->state;
+  r->children_num = a->children_num;
+  r->children = mpc_ast_malloc(sizeof(mpc_ast_t*) * mpc_ast_children_slots(a->children_num));
+  
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  
+  return r;
 }
 
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
@@ -2568,7 +4036,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_tag(&mpc_tags_builtin[MPC_TAG_ROOT], "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2589,15 +4057,22 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  int slots;
+  r = mpc_ast_unshare(r);
+  slots = mpc_ast_children_slots(r->children_num);
+  if (r->children_num == slots) {
+    r->children = mpc_ast_realloc(r->children,
+      sizeof(mpc_ast_t*) * slots, sizeof(mpc_ast_t*) * (slots ? slots * 2 : 1));
+  }
   r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  a = mpc_ast_unshare(a);
+  a->tag = mpc_ast_realloc(a->tag, strlen(a->tag) + 1, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
   memmove(a->tag + strlen(t), "|", 1);
@@ -2605,13 +4080,31 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
+  a = mpc_ast_unshare(a);
+  a->tag = mpc_ast_realloc(a->tag, strlen(a->tag) + 1, strlen(t) + 1);
   strcpy(a->tag, t);
+  a->tag_id = mpc_tag_id(t);
+  return a;
+}
+
+static mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, mpc_tag_t *t) {
+  if (a == NULL) { return a; }
+  a = mpc_ast_add_tag(a, t->name);
+  if (a->tag_id < MPC_TAG_USER) { a->tag_id = t->id; }
+  return a;
+}
+
+static mpc_ast_t *mpc_ast_tag_id(mpc_ast_t *a, mpc_tag_t *t) {
+  a = mpc_ast_unshare(a);
+  a->tag = mpc_ast_realloc(a->tag, strlen(a->tag) + 1, strlen(t->name) + 1);
+  strcpy(a->tag, t->name);
+  a->tag_id = t->id;
   return a;
 }
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_unshare(a);
   a->state = s;
   return a;
 }
@@ -2661,7 +4154,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
   
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_tag(&mpc_tags_builtin[MPC_TAG_ROOT], "");
   
   for (i = 0; i < n; i++) {
     
@@ -2670,7 +4163,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if (as[i] && as[i]->children_num > 0) {
       
       for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
+        mpc_ast_add_child(r, as[i]->refs > 1 ? mpc_ast_ref(as[i]->children[j]) : as[i]->children[j]);
       }
       
       mpc_ast_delete_no_children(as[i]);
@@ -2689,7 +4182,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
 }
 
 mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_ast_new_tag(&mpc_tags_builtin[MPC_TAG_NONE], c);
   free(c);
   return a;
 }
@@ -2708,17 +4201,19 @@ mpc_parser_t *mpca_state(mpc_parser_t *a) {
 }
 
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag_id, mpc_tag_intern(t));
 }
 
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag_id, mpc_tag_intern(t));
 }
 
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
   return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
 }
 
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_apply_t)mpc_ast_ref, (mpc_dtor_t)mpc_ast_delete); }
+
 mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
 mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
 mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
@@ -2735,6 +4230,7 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -2936,12 +4432,13 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   
   mpca_grammar_st_t *st = s;
   mpc_parser_t *p = mpca_grammar_find_parser(x, st);
+  mpc_parser_t *q = (st->flags & MPCA_LANG_PACKRAT) ? mpca_memo(p) : p;
   free(x);
 
   if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+    return mpca_state(mpca_root(mpca_add_tag(q, p->name)));
   } else {
-    return mpca_state(mpca_root(p));
+    return mpca_state(mpca_root(q));
   }
 }
 
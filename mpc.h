@@ -65,6 +65,41 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Parsing Context
+**
+** Keeps the parse stacks alive between calls so
+** that repeated parses avoid setup and reallocation.
+** A context must not be shared between threads.
+*/
+
+struct mpc_context_t;
+typedef struct mpc_context_t mpc_context_t;
+
+mpc_context_t *mpc_context_new(void);
+void mpc_context_delete(mpc_context_t *c);
+
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+
+/*
+** AST Arena
+**
+** When a context is given an arena, every AST node
+** built by its parses is allocated from the arena.
+** Such trees must not be modified or passed to
+** `mpc_ast_delete`; they are released all at once
+** by `mpc_ast_arena_clear`.
+*/
+
+struct mpc_ast_arena_t;
+typedef struct mpc_ast_arena_t mpc_ast_arena_t;
+
+mpc_ast_arena_t *mpc_ast_arena_new(void);
+void mpc_ast_arena_clear(mpc_ast_arena_t *a);
+void mpc_ast_arena_delete(mpc_ast_arena_t *a);
+
+void mpc_context_arena(mpc_context_t *c, mpc_ast_arena_t *a);
+
 /*
 ** Function Types
 */
@@ -87,6 +122,8 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p);
 void mpc_delete(mpc_parser_t *p);
 void mpc_cleanup(int n, ...);
 
+void mpc_optimise(mpc_parser_t *p);
+
 /*
 ** Basic Parsers
 */
@@ -133,6 +170,7 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t ref, mpc_dtor_t da);
 
 /*
 ** Common Parsers
@@ -255,15 +293,41 @@ mpc_parser_t *mpc_re(const char *re);
 ** AST
 */
 
+/*
+** Tags are interned and given an integer id, handed out in order of first
+** use after the builtin ones below. A node's `tag_id` is its most specific
+** tag: the innermost grammar rule that built it, or a builtin tag when no
+** rule applies. The full `tag` string is kept for printing.
+**
+** Nodes cached by a memoized parser are shared, with `refs` counting
+** their owners. The functions below that change a node copy it first if
+** it is shared, so always carry on with the node they return.
+*/
+
+enum {
+  MPC_TAG_NONE   = 0,
+  MPC_TAG_ROOT   = 1,
+  MPC_TAG_STRING = 2,
+  MPC_TAG_CHAR   = 3,
+  MPC_TAG_REGEX  = 4,
+  MPC_TAG_USER   = 5
+};
+
+int mpc_tag_id(const char *t);
+const char *mpc_tag_name(int id);
+
 typedef struct mpc_ast_t {
   char *tag;
+  int tag_id;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  int refs;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
@@ -290,6 +354,7 @@ mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
 
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
 
@@ -303,7 +368,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
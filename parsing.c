@@ -1,13 +1,34 @@
 #pragma clang diagnostic ignored "-Wgnu-zero-variadic-macro-arguments"
+#define _POSIX_C_SOURCE 200809L
+// for MAP_ANONYMOUS, which fiber stacks are mapped with
+#define _DEFAULT_SOURCE
 #include "mpc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include <editline/readline.h>
 
 
+#if defined(__GNUC__)
+#define LTHREAD_LOCAL __thread
+#else
+#define LTHREAD_LOCAL
+#endif
+
 // possible lval types
 enum {
     LVAL_INTEGER, // 0
@@ -18,7 +39,22 @@ enum {
     LVAL_QEXPRESSION, // 5
     LVAL_FUNCTION, // 5
     LVAL_BOOLEAN, // 6
-    LVAL_STRING // 7
+    LVAL_STRING, // 7
+    LVAL_FUTURE,
+    LVAL_CHANNEL,
+    LVAL_ATOM
+};
+
+// grammar rule tags, see lval_read_tags
+enum {
+    TAG_DECIMAL = MPC_TAG_USER,
+    TAG_INTEGER,
+    TAG_NUMBER,
+    TAG_SYMBOL,
+    TAG_SEXPR,
+    TAG_QEXPR,
+    TAG_EXPR,
+    TAG_LISPY
 };
 
 
@@ -38,6 +74,9 @@ enum {
 #define L_ERROR(lval)    (lval)->val.error
 #define L_SYMBOL(lval)   (lval)->val.symbol
 #define L_STRING(lval)   (lval)->val.string
+#define L_FUTURE(lval)   (lval)->val.future
+#define L_CHANNEL(lval)  (lval)->val.channel
+#define L_ATOM(lval)     (lval)->val.atom
 #define L_CELL_N(lval, n) (lval)->cell[(n)]
 #define L_COUNT_N(lval, n) L_CELL_N(lval, n)->count
 #define L_TYPE_N(lval, n) L_CELL_N(lval, n)->type
@@ -48,6 +87,10 @@ enum {
 
 // accessors for lenv
 #define E_PARENT(lenv) (lenv)->parent
+#define E_SHARED(lenv) (lenv)->shared
+#define E_BOUNDARY(lenv) (lenv)->boundary
+#define E_INTERP(lenv) (lenv)->interp
+#define E_SYNC(lenv) (lenv)->sync
 #define E_COUNT(lenv) (lenv)->count
 #define E_NAMES(lenv) (lenv)->names
 #define E_VALUES(lenv) (lenv)->values
@@ -99,8 +142,11 @@ enum {
 // forward declarations
 struct lval;
 struct lenv;
+struct linterp;
+struct lfuture;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct linterp linterp;
 
 typedef lval *(*lbuiltin)(lenv*, lval*);
 struct lval {
@@ -112,6 +158,9 @@ struct lval {
         char *symbol;
         char *string;
         lbuiltin builtin;
+        struct lfuture *future;
+        struct lchan *channel;
+        struct latom *atom;
     } val;
     lenv *env;
     lval *formals;
@@ -119,14 +168,429 @@ struct lval {
     int count;
     struct lval** cell;
 };
+// readers of a synced env count themselves in one of these, picked per
+// thread, so that they do not all write to the same line
+#define LENV_READERS 64
+
+typedef struct lenv_reader {
+    long active;
+    struct lenv_sync *sync;
+    char pad[64 - sizeof(long) - sizeof(void*)];
+} lenv_reader;
+
+// an array or a value a writer replaced, freed once no reader can be on it
+typedef struct lenv_retired {
+    void *array;
+    lval *value;
+    struct lenv_retired *next;
+} lenv_retired;
+
+// makes an env safe to read from any thread while writers take turns on
+// `lock`: a writer never changes anything a reader may be on, it appends
+// past `count` or swaps in new arrays and values, and whatever it replaced
+// waits in `retired`; readers count themselves under the current `phase`,
+// so when it changes, what was retired before moves to `waiting` and is
+// freed as soon as the readers under the old phase have all left, however
+// many new ones came in since
+typedef struct lenv_sync {
+    pthread_mutex_t lock;
+    int slots;
+    int phase;
+    lenv_reader readers[2][LENV_READERS];
+    lenv_retired *retired;
+    lenv_retired *waiting;
+} lenv_sync;
+
 struct lenv {
     lenv *parent;
+    // `def` from a child stops below a shared env instead of writing to it
+    int shared;
+    // `def` from a child stops in this env, which is private to one thread,
+    // without marking the env above it
+    int boundary;
+    // the interpreter this env is evaluated in, set on the root and passed
+    // down when an env is linked below another
+    linterp *interp;
+    // set on the root, which every thread of the interpreter reads
+    lenv_sync *sync;
 
     int count;
     char **names;
     lval **values;
 };
 
+// reads forms straight from a buffer, which is refilled from `file` in
+// chunks when there is one, instead of building an mpc_ast_t first
+#define LREADER_CHUNK 4096
+
+// with `--load-chunks`, files at least this large are loaded by lload_file
+// in chunks of about LLOAD_CHUNK bytes, a few per pool thread at a time
+#define LLOAD_PARALLEL (1 << 20)
+#define LLOAD_CHUNK (1 << 20)
+
+// a run of whole top level forms of a file, and where it starts in it
+typedef struct lload_chunk {
+    char *start;
+    long length;
+    int row;
+    int col;
+    lval **forms;
+    long forms_num;
+    long forms_slots;
+    char error[128];
+} lload_chunk;
+
+// how long the server waits on a client that stops writing its request or
+// reading the reply before it drops it, in milliseconds
+#define LSERVER_TIMEOUT 1000
+
+typedef struct lreader {
+    FILE *file;
+    char *buffer;
+    long length;
+    long pos;
+    long slots;
+    int row;
+    int col;
+    char error[128];
+} lreader;
+
+// the mpc parsers for `grammar`, built in C so that nothing is read or
+// compiled at startup
+typedef struct lgrammar {
+    mpc_parser_t *number;
+    mpc_parser_t *decimal;
+    mpc_parser_t *integer;
+    mpc_parser_t *symbol;
+    mpc_parser_t *sexpr;
+    mpc_parser_t *qexpr;
+    mpc_parser_t *expr;
+    mpc_parser_t *lispy;
+} lgrammar;
+
+// packed values hold no pointers: every symbol is stored once in a table
+// at the start and referred to by index, builtins are stored by name, and
+// an expression that was packed before is replaced by a back reference
+#define LPACK_MAGIC "LPK1"
+#define LPACK_MAGIC_LENGTH 4
+// type byte of a back reference, next to the LVAL_* ones
+#define LPACK_REFERENCE 0x7f
+
+typedef struct lpack_node_t {
+    lval *value;
+    unsigned long hash;
+} lpack_node_t;
+
+typedef struct lpack {
+    char *data;
+    long length;
+    long slots;
+    // symbols and nodes are borrowed from the values being packed
+    char **symbols;
+    int symbols_num;
+    long symbols_length;
+    int *symbols_buckets;
+    int symbols_buckets_num;
+    lpack_node_t *nodes;
+    int nodes_num;
+    int nodes_slots;
+    int *nodes_buckets;
+    int nodes_buckets_num;
+    lenv *builtins;
+} lpack;
+
+typedef struct lunpack {
+    unsigned char *data;
+    long length;
+    long pos;
+    // symbols point straight into data
+    char **symbols;
+    long symbols_num;
+    lval **nodes;
+    long nodes_num;
+    long nodes_slots;
+    lenv *builtins;
+    int broken;
+} lunpack;
+
+// images are a packed global env, so they can be mapped and decoded in
+// one pass at startup
+#define LIMAGE_MAGIC "LLIM"
+#define LIMAGE_VERSION 2
+
+// printed values are written into a buffer that grows as needed and is
+// emptied after each use, so printing allocates only while it grows; nested
+// expressions are walked with an explicit stack of frames kept alongside
+typedef struct lprint_frame {
+    lval *value;
+    int next;
+} lprint_frame;
+
+typedef struct lbuffer {
+    char *data;
+    long length;
+    long slots;
+    lprint_frame *frames;
+    int frames_num;
+    int frames_slots;
+} lbuffer;
+
+// a future is shared by every copy of its value and freed with the last
+// one; `expr` is evaluated once, by a pool thread or by the first deref
+// that finds it still pending, against a copy of the locals of the env the
+// future was made in, on top of the root
+enum { LFUTURE_PENDING, LFUTURE_RUNNING, LFUTURE_DONE };
+
+typedef struct lfuture {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int refs;
+    int state;
+    lenv *env;
+    lval *expr;
+    lval *result;
+    // set for futures that run as fibers, see lfuture_wait
+    struct lpool *pool;
+} lfuture;
+
+// a future evaluated on a stack of its own, so that it can be suspended by
+// `yield` and `sleep` and resumed later, by any thread of the pool
+#define LFIBER_STACK (1024 * 1024)
+
+typedef struct lfiber {
+    ucontext_t context;
+    // where to switch back to, set by whoever resumes the fiber
+    ucontext_t *back;
+    char *stack;
+    lfuture *future;
+    struct lpool *pool;
+    int finished;
+    // set by `sleep`, the fiber is not run again before `wake`
+    int sleeping;
+    struct timespec wake;
+    // set while the fiber waits on channels, see lchan_wait
+    struct lchan_waiter *waiter;
+    // in the ready queue, or the list of parked fibers
+    struct lfiber *next;
+    struct lfiber *prev;
+} lfiber;
+
+// a queue of values shared by every copy of its value; values are moved
+// through it, not copied. Senders and receivers claim positions with a CAS
+// on `head` and `tail`. A bounded channel is a ring of `mask + 1` cells,
+// each cell's `seq` telling whose turn it is (Vyukov's MPMC queue). An
+// unbounded one is a list of blocks of LCHAN_BLOCK slots, from `tail_block`
+// to `head_block`: positions go LCHAN_BLOCK + 1 to a block, the last one
+// standing for the sender or receiver moving on to the next block, and a
+// block is freed by whichever receiver reads the last of its slots
+#define LCHAN_MAX_CAPACITY (1L << 24)
+#define LCHAN_BLOCK 31
+
+typedef struct lchan_cell {
+    unsigned long seq;
+    lval *value;
+} lchan_cell;
+
+// states of an unbounded slot, or-ed together
+enum { LCHAN_WRITTEN = 1, LCHAN_READ = 2, LCHAN_DESTROY = 4 };
+
+typedef struct lchan_slot {
+    lval *value;
+    int state;
+} lchan_slot;
+
+typedef struct lchan_block {
+    struct lchan_block *next;
+    lchan_slot slots[LCHAN_BLOCK];
+} lchan_block;
+
+// a fiber or thread waiting on channels is on the `waiters` list of each of
+// them through one of its `links`; whoever changes a channel with waiters
+// wakes all of them, and they try again. A fiber is only queued again by
+// whoever moves `state` from LCHAN_PARKED, which it is set to once the
+// fiber has been switched away from, so it cannot be run twice at once
+enum { LCHAN_WAITING, LCHAN_PARKED, LCHAN_WOKEN };
+
+// what a wait is for: a value, room for one, or a value or being the only
+// one left with the channel
+enum { LCHAN_RECV, LCHAN_SEND, LCHAN_ALONE };
+
+struct lchan;
+
+typedef struct lchan_link {
+    struct lchan *channel;
+    struct lchan_waiter *waiter;
+    struct lchan_link *next;
+    struct lchan_link *prev;
+} lchan_link;
+
+typedef struct lchan_waiter {
+    int state;
+    lfiber *fiber;
+    // a thread waits on the pool's `wake` if it has one, else on its own
+    struct lpool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t woken;
+    lchan_link *links;
+    int links_num;
+} lchan_waiter;
+
+typedef struct lchan {
+    int refs;
+    int bounded;
+    unsigned long mask;
+    lchan_cell *cells;
+    // kept on lines of their own, senders and receivers write them
+    char pad0[64];
+    unsigned long head;
+    lchan_block *head_block;
+    char pad1[64];
+    unsigned long tail;
+    lchan_block *tail_block;
+    char pad2[64];
+    // `waiting` is read after every change, the list only when it is not 0
+    int waiting;
+    pthread_mutex_t lock;
+    lchan_link *waiters;
+} lchan;
+
+// a reference to a value that is replaced as a whole with a CAS on `cell`,
+// shared by every copy of its value. A cell is never changed once it is
+// in, only copied by readers, so a replaced one cannot be freed while a
+// reader may still be copying it: every reader is counted in `readers`,
+// and replaced cells wait in `retired` until they are taken at a time no
+// reader was left
+typedef struct latom_cell {
+    lval *value;
+    // one more than the cell it replaced, so a cell seen earlier is told
+    // apart from one reusing its address
+    long version;
+    struct latom_cell *next;
+} latom_cell;
+
+typedef struct latom {
+    int refs;
+    int readers;
+    latom_cell *cell;
+    latom_cell *retired;
+} latom;
+
+// a fixed set of threads that run one job at a time: the job is split into
+// ranges spread over one deque per thread, and each thread takes ranges from
+// the bottom of its own deque and steals from the top of the others once it
+// runs dry; the thread that runs the job works as thread 0
+// how long lpool_delete waits for the threads of a pool, in milliseconds
+#define LPOOL_SHUTDOWN 1000
+
+typedef struct lpool_range {
+    long start;
+    long end;
+} lpool_range;
+
+typedef struct lpool_deque {
+    pthread_mutex_t lock;
+    lpool_range *ranges;
+    int top;
+    int bottom;
+    int slots;
+} lpool_deque;
+
+typedef void (*lpool_job)(void *arg, long start, long end);
+
+struct lpool;
+
+typedef struct lpool_worker {
+    struct lpool *pool;
+    int id;
+} lpool_worker;
+
+typedef struct lpool {
+    int threads_num;
+    pthread_t *threads;
+    lpool_worker *workers;
+    lpool_deque *deques;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    // the job being run, `remaining` counts the items not finished yet
+    lpool_job job;
+    void *arg;
+    long generation;
+    long remaining;
+    // futures waiting for a thread, oldest first
+    lfuture **tasks;
+    long tasks_head;
+    long tasks_num;
+    long tasks_slots;
+    // fibers ready to run, oldest first, sleeping ones in a heap with the
+    // earliest `wake` first, and ones parked on channels
+    lfiber *fibers_head;
+    lfiber *fibers_tail;
+    lfiber **sleeping;
+    int sleeping_num;
+    int sleeping_slots;
+    lfiber *parked;
+    // set once by lpool_delete, channel waits give up when they see it;
+    // `running` counts the pool's own threads that have not seen it yet
+    int stop;
+    int running;
+} lpool;
+
+// a pmap or pfor-each call, results are stored by index to keep their order
+typedef struct lpmap {
+    lenv *env;
+    lval *func;
+    lval *items;
+    lval **results;
+} lpmap;
+
+// a preduce call: each chunk of `items` is reduced into one of `partials`,
+// which are then combined in pairs `width` apart, doubling it each round;
+// numbers of one type reduced by + * min or max skip lval_call
+enum { LPREDUCE_CALL, LPREDUCE_ADD, LPREDUCE_MUL, LPREDUCE_MIN, LPREDUCE_MAX };
+
+typedef struct lpreduce {
+    lenv *env;
+    lval *func;
+    lval *items;
+    int kernel;
+    long chunk;
+    lval **partials;
+    long partials_num;
+    long width;
+} lpreduce;
+
+// all the state of one interpreter; builtins reach it through the env they
+// are called with, so several interpreters can run in one process, one per
+// thread, without sharing anything mutable
+struct linterp {
+    lenv *root;
+    // mpc parsers and parse state, only built once a line needs mpc
+    lgrammar *grammar;
+    mpc_context_t *context;
+    mpc_ast_arena_t *arena;
+    // where lval_print writes before handing the text to stdout
+    lbuffer *print;
+    // set by `--image`, where `save-image` writes
+    char *image;
+    // number of lval_call, for profiling
+    long calls;
+    // threads for pmap and pfor-each, started on first use
+    lpool *pool;
+    // set by `--load-chunks`, see lload_file
+    int load_chunks;
+};
+
+// collects REPL lines until every opened bracket is closed; only the new
+// line is scanned each time, so a long paste costs linear time overall
+typedef struct linput {
+    char *buffer;
+    long length;
+    long slots;
+    int depth;
+    int broken;
+} linput;
+
 // forward declarations
 char *ltype_name(int t);
 lenv *lenv_new(void);
@@ -137,6 +601,14 @@ void lenv_delete(lenv *env);
 lval *lval_copy(lval *a);
 lval *lval_error(char *format, ...);
 lval *lenv_get(lenv *env, lval *key);
+void lenv_sync_start(lenv *env);
+lenv_reader *lenv_enter(lenv *env);
+void lenv_leave(lenv_reader *r);
+void lenv_retire(lenv_sync *s, void *array, lval *value);
+void lenv_reclaim(lenv_sync *s);
+void lenv_retired_free(lenv_retired *x);
+lval *lenv_sync_get(lenv *env, char *name);
+void lenv_sync_put(lenv *env, lval *key, lval *value);
 void lenv_def(lenv *env, lval *key, lval *value);
 void lenv_put(lenv *env, lval *key, lval *value);
 lval *lval_lambda(lval *formals, lval *body);
@@ -145,13 +617,156 @@ lval *lval_qexpression(void);
 lval *lval_integer(long x);
 lval *lval_decimal(double x);
 lval *lval_symbol(char *m);
+lval *lval_bytes(char *s, long n);
 lval *lval_sexpression(void);
 lval *lval_read_number(mpc_ast_t *t);
 lval *lval_add(lval *v, lval *x);
 lval *lval_read(mpc_ast_t *t);
-void lval_expr_print(lenv *env, lval *v, char open, char close);
+int lval_read_tags(void);
+lval *lval_read_string(char *s, int decimal);
+lreader *lreader_new(FILE *file, char *string);
+void lreader_delete(lreader *r);
+int lreader_peek(lreader *r, long k);
+void lreader_next(lreader *r);
+void lreader_skip(lreader *r);
+int lreader_is_symbol(int c);
+lval *lreader_token(lreader *r);
+lval *lreader_expr(lreader *r);
+lval *lreader_read(lreader *r);
+lval *lreader_read_all(lreader *r);
+int lreader_eval_all(lreader *r, lenv *env, char *name, FILE *errors);
+void lload_parse(void *arg, long start, long end);
+int lload_file(linterp *in, lenv *env, FILE *f, char *name, FILE *errors);
+void lserver_request(linterp *in, int conn);
+int lserver_run(linterp *in, char *path);
+unsigned long lhash(char *s);
+lpack *lpack_new(void);
+void lpack_delete(lpack *m);
+void lpack_put(lpack *m, void *p, long n);
+void lpack_put_byte(lpack *m, int c);
+void lpack_put_varint(lpack *m, unsigned long long x);
+void lpack_put_bytes(lpack *m, char *s, long n);
+long lpack_symbol(lpack *m, char *s);
+int lpack_same(lval *x, lval *y);
+long lpack_node(lpack *m, lval *v, unsigned long hash);
+int lpack_lval(lpack *m, lval *v, unsigned long *hash);
+int lpack_lenv(lpack *m, lenv *env);
+char *lpack_finish(lpack *m, char *magic, long *length);
+char *lval_pack(lval *v, char *magic, long *length);
+void lunpack_init(lunpack *r, char *data, long length, char *magic);
+void lunpack_clear(lunpack *r);
+unsigned long long lunpack_varint(lunpack *r);
+char *lunpack_symbol(lunpack *r);
+lval *lunpack_lval(lunpack *r);
+lenv *lunpack_lenv(lunpack *r);
+lval *lval_unpack(char *data, long length);
+int limage_save(lenv *env, char *path);
+int limage_load(lenv **env, char *path);
+lval *builtin_save_image(lenv *env, lval *a);
+lval *builtin_serialize(lenv *env, lval *a);
+lval *builtin_deserialize(lenv *env, lval *a);
+mpc_parser_t *lgrammar_regex(char *re);
+mpc_parser_t *lgrammar_char(char c);
+mpc_parser_t *lgrammar_rule(mpc_parser_t *p, char *name);
+lgrammar *lgrammar_new(void);
+void lgrammar_delete(lgrammar *g);
+linput *linput_new(void);
+void linput_delete(linput *in);
+void linput_clear(linput *in);
+int linput_add(linput *in, char *line);
+linterp *linterp_new(lenv *root, char *image);
+void linterp_delete(linterp *in);
+lval *linterp_read(linterp *in, char *input, int use_mpc);
+lpool *lpool_new(int threads_num);
+int lpool_delete(lpool *pool);
+void lpool_push(lpool_deque *d, long start, long end);
+int lpool_pop(lpool_deque *d, lpool_range *range);
+int lpool_steal(lpool_deque *d, lpool_range *range);
+void lpool_work(lpool *pool, int id);
+void *lpool_thread(void *arg);
+void lpool_run(lpool *pool, lpool_job job, void *arg, long count);
+void lpmap_run(void *arg, long start, long end);
+lval *builtin_parallel(lenv *env, lval *a, char *func, int keep);
+lval *builtin_pmap(lenv *env, lval *a);
+lval *builtin_pfor_each(lenv *env, lval *a);
+lval *lpreduce_apply(lpreduce *m, lenv *env, lval *x, lval *y);
+void lpreduce_chunks(void *arg, long start, long end);
+void lpreduce_pairs(void *arg, long start, long end);
+lval *builtin_preduce(lenv *env, lval *a);
+lpool *linterp_pool(linterp *in);
+lfuture *lfuture_new(lenv *env, lval *expr);
+void lfuture_retain(lfuture *f);
+void lfuture_release(lfuture *f);
+void lfuture_run(lfuture *f);
+lval *lfuture_wait(lfuture *f);
+void lpool_submit(lpool *pool, lfuture *f);
+lenv *lenv_flatten(lenv *env);
+lfiber *lfiber_new(lpool *pool, lfuture *future);
+void lfiber_delete(lfiber *fb);
+void lfiber_main(void);
+void lfiber_suspend(lfiber *fb);
+void lfiber_resume(lfiber *fb);
+void lpool_schedule(lpool *pool, lfiber *fb);
+void lpool_resume(lpool *pool, lfiber *fb);
+void lpool_unpark(lpool *pool, lfiber *fb);
+int ltimespec_before(struct timespec *a, struct timespec *b);
+void lpool_sleeping_push(lpool *pool, lfiber *fb);
+lfiber *lpool_sleeping_pop(lpool *pool);
+void lpool_help(lpool *pool);
+lfiber *lpool_next_fiber(lpool *pool, struct timespec *wait);
+lval *builtin_spawn(lenv *env, lval *a);
+lval *builtin_yield(lenv *env, lval *a);
+lval *builtin_sleep(lenv *env, lval *a);
+lval *builtin_future(lenv *env, lval *a);
+lval *builtin_deref(lenv *env, lval *a);
+lval *builtin_realized(lenv *env, lval *a);
+lchan *lchan_new(long capacity);
+void lchan_retain(lchan *c);
+void lchan_release(lchan *c);
+int lchan_try_send(lchan *c, lval *v);
+lval *lchan_try_recv(lchan *c);
+void lchan_push(lchan *c, lval *v);
+lval *lchan_pop(lchan *c);
+void lchan_block_free(lchan_block *block, int start);
+int lchan_ready(lchan *c, int mode);
+void lchan_notify(lchan *c);
+void lchan_wake(lchan_waiter *w);
+void lchan_unwait(lchan_waiter *w);
+int lchan_wait(lpool *pool, lchan **cs, int n, int mode, int *spins);
+lpool *lchan_pool(lenv *env);
+lval *lval_channel(lchan *c);
+lval *builtin_chan(lenv *env, lval *a);
+lval *builtin_send(lenv *env, lval *a);
+lval *builtin_recv(lenv *env, lval *a);
+lval *builtin_try_recv(lenv *env, lval *a);
+lval *builtin_select(lenv *env, lval *a);
+lval *lactor_run(lenv *env, lval *a);
+lval *builtin_spawn_actor(lenv *env, lval *a);
+latom *latom_new(lval *v);
+void latom_retain(latom *t);
+void latom_release(latom *t);
+latom_cell *latom_enter(latom *t);
+void latom_leave(latom *t);
+void latom_retire(latom *t, latom_cell *cell);
+int latom_replace(latom *t, latom_cell *old, lval *v);
+lval *lval_atom(latom *t);
+lval *builtin_atom(lenv *env, lval *a);
+lval *builtin_reset(lenv *env, lval *a);
+lval *builtin_swap(lenv *env, lval *a);
+lval *builtin_cas(lenv *env, lval *a);
+lbuffer *lbuffer_new(void);
+void lbuffer_delete(lbuffer *b);
+void lbuffer_reserve(lbuffer *b, long n);
+void lbuffer_put(lbuffer *b, char *s, long n);
+void lbuffer_putc(lbuffer *b, char c);
+void lbuffer_puts(lbuffer *b, char *s);
+void lval_write_string(lbuffer *b, lval *v);
+void lval_write_builtin(lenv *env, lbuffer *b, lval *v);
+int lval_write_atom(lenv *env, lbuffer *b, lval *v);
+void lval_write(lenv *env, lbuffer *b, lval *v);
 void lval_print(lenv *env, lval *v);
 void lval_println(lenv *env, lval *v);
+lval *builtin_to_string(lenv *env, lval *a);
 lval *lval_pop(lval *v, int i);
 lval *lval_take(lval *v, int i);
 lval *lval_join(lval *x, lval *y);
@@ -216,6 +831,12 @@ char* ltype_name(int t) {
             return "Function";
         case LVAL_BOOLEAN:
             return "Boolean";
+        case LVAL_FUTURE:
+            return "Future";
+        case LVAL_CHANNEL:
+            return "Channel";
+        case LVAL_ATOM:
+            return "Atom";
         default:
             return "Unknown";
     }
@@ -224,6 +845,10 @@ char* ltype_name(int t) {
 lenv *lenv_new(void) {
     lenv *env = malloc(sizeof(lenv));
     E_PARENT(env) = NULL;
+    E_SHARED(env) = 0;
+    E_BOUNDARY(env) = 0;
+    E_INTERP(env) = NULL;
+    E_SYNC(env) = NULL;
     E_COUNT(env) = 0;
     E_NAMES(env) = NULL;
     E_VALUES(env) = NULL;
@@ -231,21 +856,31 @@ lenv *lenv_new(void) {
 }
 
 lenv *lenv_copy(lenv *env) {
+    lenv_reader *r = lenv_enter(env);
     lenv *new_env = malloc(sizeof(lenv));
     E_PARENT(new_env) = E_PARENT(env);
+    E_SHARED(new_env) = 0;
+    E_BOUNDARY(new_env) = 0;
+    E_INTERP(new_env) = E_INTERP(env);
+    E_SYNC(new_env) = NULL;
     E_COUNT(new_env) = E_COUNT(env);
     E_VALUES(new_env) = malloc(sizeof(lval*) * E_COUNT(new_env));
     E_NAMES(new_env) = malloc(sizeof(char*) * E_COUNT(new_env));
-    E_FOREACH(i, env) {
+    E_FOREACH(i, new_env) {
         E_NAMES_N(new_env, i) = malloc(strlen(E_NAMES_N(env, i)) + 1);
         strcpy(E_NAMES_N(new_env, i), E_NAMES_N(env, i));
         E_VALUES_N(new_env, i) = lval_copy(E_VALUES_N(env, i));
     }
+    lenv_leave(r);
 
     return new_env;
 }
 
 lval* lval_call(lenv *env, lval *func, lval *a) {
+    if (E_INTERP(env)) {
+        E_INTERP(env)->calls++;
+    }
+
     // apply immediately if builtin
     if (L_BUILTIN(func) != NULL) {
         return L_BUILTIN(func)(env, a);
@@ -312,6 +947,7 @@ lval* lval_call(lenv *env, lval *func, lval *a) {
     if (L_FORMALS_COUNT(func) == 0) {
         // if all formal have been bound => evaluate
         E_PARENT(L_ENV(func)) = env;
+        E_INTERP(L_ENV(func)) = E_INTERP(env);
         return builtin_eval(
                             L_ENV(func),
                             lval_add(lval_sexpression(), lval_copy(L_BODY(func)))
@@ -339,6 +975,18 @@ void lval_delete(lval* v) {
             free(L_SYMBOL(v));
             break;
 
+        case LVAL_FUTURE:
+            lfuture_release(L_FUTURE(v));
+            break;
+
+        case LVAL_CHANNEL:
+            lchan_release(L_CHANNEL(v));
+            break;
+
+        case LVAL_ATOM:
+            latom_release(L_ATOM(v));
+            break;
+
         case LVAL_QEXPRESSION:
         case LVAL_SEXPRESSION:
             // free memory for all elements inside
@@ -368,6 +1016,12 @@ void lenv_delete(lenv *env) {
     }
     free(E_NAMES(env));
     free(E_VALUES(env));
+    if (E_SYNC(env)) {
+        // nobody is left to be reading it
+        lenv_reclaim(E_SYNC(env));
+        pthread_mutex_destroy(&E_SYNC(env)->lock);
+        free(E_SYNC(env));
+    }
     free(env);
 }
 
@@ -377,8 +1031,10 @@ lval* lval_copy(lval *a) {
 
     switch (L_TYPE(a)) {
         case LVAL_STRING:
-            L_STRING(x) = malloc(strlen(L_STRING(v)) + 1);
-            strcpy(L_STRING(x), L_STRING(y))
+            L_COUNT(x) = L_COUNT(a);
+            L_STRING(x) = malloc(L_COUNT(a) + 1);
+            memcpy(L_STRING(x), L_STRING(a), L_COUNT(a) + 1);
+            break;
         case LVAL_FUNCTION:
             if (L_BUILTIN(a)) {
                 L_BUILTIN(x) = L_BUILTIN(a);
@@ -404,6 +1060,19 @@ lval* lval_copy(lval *a) {
             L_SYMBOL(x) = malloc(strlen(L_SYMBOL(a)) + 1);
             strcpy(L_SYMBOL(x), L_SYMBOL(a));
             break;
+        case LVAL_FUTURE:
+            // copies share the future
+            L_FUTURE(x) = L_FUTURE(a);
+            lfuture_retain(L_FUTURE(x));
+            break;
+        case LVAL_CHANNEL:
+            L_CHANNEL(x) = L_CHANNEL(a);
+            lchan_retain(L_CHANNEL(x));
+            break;
+        case LVAL_ATOM:
+            L_ATOM(x) = L_ATOM(a);
+            latom_retain(L_ATOM(x));
+            break;
         case LVAL_SEXPRESSION:
         case LVAL_QEXPRESSION:
             L_COUNT(x) = L_COUNT(a);
@@ -443,9 +1112,16 @@ lval* lval_error(char* format, ...) {
 }
 
 lval* lenv_get(lenv* env, lval *key) {
-    E_FOREACH(i, env) {
-        if (STR_EQ(E_NAMES_N(env, i), L_SYMBOL(key))) {
-            return lval_copy(E_VALUES_N(env, i));
+    if (E_SYNC(env)) {
+        lval *v = lenv_sync_get(env, L_SYMBOL(key));
+        if (v) {
+            return v;
+        }
+    } else {
+        E_FOREACH(i, env) {
+            if (STR_EQ(E_NAMES_N(env, i), L_SYMBOL(key))) {
+                return lval_copy(E_VALUES_N(env, i));
+            }
         }
     }
 
@@ -457,11 +1133,18 @@ lval* lenv_get(lenv* env, lval *key) {
 }
 
 void lenv_def(lenv *env, lval *key, lval *value) {
-    while (E_PARENT(env) != NULL) { env = E_PARENT(env); }
+    while (E_PARENT(env) != NULL && !E_SHARED(E_PARENT(env)) && !E_BOUNDARY(env)) {
+        env = E_PARENT(env);
+    }
     lenv_put(env, key, value);
 }
 
 void lenv_put(lenv *env, lval *key, lval *value) {
+    if (E_SYNC(env)) {
+        lenv_sync_put(env, key, value);
+        return;
+    }
+
     // replace existing variables
     E_FOREACH(i, env) {
         if (STR_EQ(E_NAMES_N(env, i), L_SYMBOL(key))) {
@@ -480,6 +1163,170 @@ void lenv_put(lenv *env, lval *key, lval *value) {
     strcpy(E_NAMES_N(env, E_COUNT(env) - 1), L_SYMBOL(key));
 }
 
+// lets any thread read `env` from now on, see lenv_sync
+void lenv_sync_start(lenv *env) {
+    lenv_sync *s = malloc(sizeof(lenv_sync));
+    pthread_mutex_init(&s->lock, NULL);
+    s->slots = E_COUNT(env);
+    s->phase = 0;
+    for (int p = 0; p < 2; p++) {
+        for (int i = 0; i < LENV_READERS; i++) {
+            s->readers[p][i].active = 0;
+            s->readers[p][i].sync = s;
+        }
+    }
+    s->retired = NULL;
+    s->waiting = NULL;
+    E_SYNC(env) = s;
+}
+
+static LTHREAD_LOCAL int lenv_reader_id = -1;
+static int lenv_readers_seen = 0;
+
+// nothing `env` holds is freed before the matching lenv_leave; NULL and
+// free for an env that is not synced
+lenv_reader *lenv_enter(lenv *env) {
+    lenv_sync *s = E_SYNC(env);
+    if (!s) {
+        return NULL;
+    }
+    if (lenv_reader_id < 0) {
+        lenv_reader_id = __atomic_fetch_add(&lenv_readers_seen, 1, __ATOMIC_RELAXED)
+            % LENV_READERS;
+    }
+    while (1) {
+        int phase = __atomic_load_n(&s->phase, __ATOMIC_SEQ_CST);
+        lenv_reader *r = &s->readers[phase][lenv_reader_id];
+        __atomic_add_fetch(&r->active, 1, __ATOMIC_SEQ_CST);
+        // a writer that changed the phase before seeing this count may be
+        // freeing what the old one covered
+        if (__atomic_load_n(&s->phase, __ATOMIC_SEQ_CST) == phase) {
+            return r;
+        }
+        __atomic_sub_fetch(&r->active, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// the last reader out frees what is waiting on it, unless a writer has the
+// lock and will do it
+void lenv_leave(lenv_reader *r) {
+    if (!r) {
+        return;
+    }
+    __atomic_sub_fetch(&r->active, 1, __ATOMIC_SEQ_CST);
+    lenv_sync *s = r->sync;
+    if (__atomic_load_n(&s->waiting, __ATOMIC_RELAXED)
+        && pthread_mutex_trylock(&s->lock) == 0) {
+        lenv_reclaim(s);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// under the lock, like the change that replaced `array` or `value`
+void lenv_retire(lenv_sync *s, void *array, lval *value) {
+    lenv_retired *x = malloc(sizeof(lenv_retired));
+    x->array = array;
+    x->value = value;
+    x->next = s->retired;
+    s->retired = x;
+}
+
+void lenv_retired_free(lenv_retired *x) {
+    while (x) {
+        lenv_retired *next = x->next;
+        free(x->array);
+        if (x->value) {
+            lval_delete(x->value);
+        }
+        free(x);
+        x = next;
+    }
+}
+
+// under the lock: frees `waiting` once no reader is counted under the old
+// phase, then, if nothing is left waiting, changes the phase for what was
+// retired since and tries again; a reader under the new phase came in
+// after it changed, when everything waiting was already replaced
+void lenv_reclaim(lenv_sync *s) {
+    for (int round = 0; round < 2; round++) {
+        if (s->waiting) {
+            lenv_reader *old = s->readers[s->phase ^ 1];
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            for (int i = 0; i < LENV_READERS; i++) {
+                if (__atomic_load_n(&old[i].active, __ATOMIC_SEQ_CST)) {
+                    return;
+                }
+            }
+            lenv_retired_free(s->waiting);
+            __atomic_store_n(&s->waiting, NULL, __ATOMIC_RELAXED);
+        }
+        if (!s->retired) {
+            return;
+        }
+        __atomic_store_n(&s->waiting, s->retired, __ATOMIC_RELAXED);
+        s->retired = NULL;
+        __atomic_store_n(&s->phase, s->phase ^ 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// lenv_get without the parents, NULL if `name` is not in `env`; `count` is
+// stored after the arrays it covers, and any arrays seen with it hold the
+// same first `count` names
+lval *lenv_sync_get(lenv *env, char *name) {
+    lenv_reader *r = lenv_enter(env);
+    int count = __atomic_load_n(&E_COUNT(env), __ATOMIC_ACQUIRE);
+    char **names = __atomic_load_n(&E_NAMES(env), __ATOMIC_ACQUIRE);
+    lval **values = __atomic_load_n(&E_VALUES(env), __ATOMIC_ACQUIRE);
+    lval *v = NULL;
+    for (int i = 0; i < count; i++) {
+        if (STR_EQ(names[i], name)) {
+            v = lval_copy(__atomic_load_n(&values[i], __ATOMIC_ACQUIRE));
+            break;
+        }
+    }
+    lenv_leave(r);
+    return v;
+}
+
+void lenv_sync_put(lenv *env, lval *key, lval *value) {
+    lenv_sync *s = E_SYNC(env);
+    lval *v = lval_copy(value);
+    pthread_mutex_lock(&s->lock);
+
+    E_FOREACH(i, env) {
+        if (STR_EQ(E_NAMES_N(env, i), L_SYMBOL(key))) {
+            lenv_retire(s, NULL, E_VALUES_N(env, i));
+            __atomic_store_n(&E_VALUES_N(env, i), v, __ATOMIC_RELEASE);
+            lenv_reclaim(s);
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+    }
+
+    int count = E_COUNT(env);
+    if (count == s->slots) {
+        s->slots = s->slots ? s->slots * 2 : 16;
+        char **names = malloc(sizeof(char*) * s->slots);
+        lval **values = malloc(sizeof(lval*) * s->slots);
+        // a new env has no arrays yet to copy from
+        if (count) {
+            memcpy(names, E_NAMES(env), sizeof(char*) * count);
+            memcpy(values, E_VALUES(env), sizeof(lval*) * count);
+        }
+        lenv_retire(s, E_NAMES(env), NULL);
+        lenv_retire(s, E_VALUES(env), NULL);
+        __atomic_store_n(&E_NAMES(env), names, __ATOMIC_RELEASE);
+        __atomic_store_n(&E_VALUES(env), values, __ATOMIC_RELEASE);
+    }
+    E_NAMES_N(env, count) = malloc(strlen(L_SYMBOL(key)) + 1);
+    strcpy(E_NAMES_N(env, count), L_SYMBOL(key));
+    E_VALUES_N(env, count) = v;
+    __atomic_store_n(&E_COUNT(env), count + 1, __ATOMIC_RELEASE);
+
+    lenv_reclaim(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
 lval* lval_lambda(lval *formals, lval *body) {
     lval *v = malloc(sizeof(lval));
     L_TYPE(v) = LVAL_FUNCTION;
@@ -499,10 +1346,17 @@ lval* lval_function(lbuiltin fn) {
 }
 
 lval *lval_string(char *str) {
+    return lval_bytes(str, strlen(str));
+}
+
+// strings keep their length in count, so they can hold any bytes
+lval *lval_bytes(char *s, long n) {
     lval* v = malloc(sizeof(lval));
     L_TYPE(v) = LVAL_STRING;
-    L_STRING(v) = malloc(strlen(str) + 1);
-    strcpy(L_STRING(v), str)
+    L_COUNT(v) = n;
+    L_STRING(v) = malloc(n + 1);
+    memcpy(L_STRING(v), s, n);
+    L_STRING(v)[n] = '\0';
     return v;
 }
 
@@ -546,20 +1400,27 @@ lval* lval_sexpression(void) {
 
 
 lval* lval_read_number(mpc_ast_t* t) {
+    switch (t->tag_id) {
+        case TAG_INTEGER:
+            return lval_read_string(t->contents, 0);
+        case TAG_DECIMAL:
+            return lval_read_string(t->contents, 1);
+    }
+    return lval_error("Unknown number type");
+}
+
+lval* lval_read_string(char* s, int decimal) {
     errno = 0;
-    if (STR_CONTAIN(t->tag, "integer")) {
-        long x = strtol(t->contents, NULL, 10);
+    if (!decimal) {
+        long x = strtol(s, NULL, 10);
         return errno != ERANGE
             ? lval_integer(x)
             : lval_error("Invalid integer");
     }
-    if (STR_CONTAIN(t->tag, "decimal")) {
-        double x = strtod(t->contents, NULL);
-        return errno != ERANGE
-            ? lval_decimal(x)
-            : lval_error("Invalid decimal");
-    }
-    return lval_error("Unknown number type");
+    double x = strtod(s, NULL);
+    return errno != ERANGE
+        ? lval_decimal(x)
+        : lval_error("Invalid decimal");
 }
 
 lval* lval_add(lval* v, lval* x) {
@@ -570,34 +1431,29 @@ lval* lval_add(lval* v, lval* x) {
 }
 
 lval* lval_read(mpc_ast_t* t) {
-    if (STR_CONTAIN(t->tag, "number")) {
-        return lval_read_number(t);
-    }
-    if (STR_CONTAIN(t->tag, "symbol")) {
-        return lval_symbol(t->contents);
-    }
-
-    // if root or sexpr then create empty list
     lval* x = NULL;
-    if (STR_EQ(t->tag, ">")) {
-        x = lval_sexpression();
-    }
-
-    if (STR_CONTAIN(t->tag, "sexpr")) {
-        x = lval_sexpression();
-    }
-
-    if (STR_CONTAIN(t->tag, "qexpr")) {
-        x = lval_qexpression();
+    switch (t->tag_id) {
+        case TAG_INTEGER:
+        case TAG_DECIMAL:
+            return lval_read_number(t);
+        case TAG_SYMBOL:
+            return lval_symbol(t->contents);
+        // if root or sexpr then create empty list
+        case MPC_TAG_ROOT:
+        case TAG_LISPY:
+        case TAG_SEXPR:
+            x = lval_sexpression();
+            break;
+        case TAG_QEXPR:
+            x = lval_qexpression();
+            break;
     }
 
-    // fill the list with any valid expression contained within
+    // fill the list with any valid expression contained within, brackets
+    // are the only char literals in the grammar
     for (int i = 0; i < t->children_num; i++) {
-        if (STR_EQ(t->children[i]->contents, "(")) { continue; }
-        if (STR_EQ(t->children[i]->contents, ")")) { continue; }
-        if (STR_EQ(t->children[i]->contents, "{")) { continue; }
-        if (STR_EQ(t->children[i]->contents, "}")) { continue; }
-        if (STR_EQ(t->children[i]->tag, "regex")) { continue; }
+        int tag = t->children[i]->tag_id;
+        if (tag == MPC_TAG_CHAR || tag == MPC_TAG_REGEX) { continue; }
 
         x = lval_add(x, lval_read(t->children[i]));
     }
@@ -605,729 +1461,4096 @@ lval* lval_read(mpc_ast_t* t) {
     return x;
 }
 
+// mpc hands out tag ids in order of first use, so interning the rule names
+// before the grammar is built pins them to the TAG_* values
+int lval_read_tags(void) {
+    char* names[] = {
+        "decimal", "integer", "number", "symbol",
+        "sexpr", "qexpr", "expr", "lispy"
+    };
+    for (int i = 0; i < 8; i++) {
+        if (mpc_tag_id(names[i]) != TAG_DECIMAL + i) { return 0; }
+    }
+    return 1;
+}
 
-void lval_expr_print(lenv *env, lval *v, char open, char close) {
-    putchar(open);
-    L_FOREACH(i, v) {
-        // print value contained within
-        lval_print(env, L_CELL_N(v, i));
+lreader* lreader_new(FILE* file, char* string) {
+    lreader* r = malloc(sizeof(lreader));
+    r->file = file;
+    r->buffer = string;
+    r->length = string ? strlen(string) : 0;
+    r->pos = 0;
+    r->slots = 0;
+    r->row = 0;
+    r->col = 0;
+    r->error[0] = '\0';
+    return r;
+}
 
-        // don't print trailing space if last element
-        if (i != (L_COUNT(v) - 1)) {
-            putchar(' ');
-        }
+void lreader_delete(lreader* r) {
+    // strings are borrowed, only buffers filled from a file are owned
+    if (r->slots) {
+        free(r->buffer);
     }
-    putchar(close);
+    free(r);
 }
 
-void lval_print_string(lval *v) {
-    char *escaped = malloc(strlen(L_STRING(v)) + 1);
-    strcpy(escaped, L_STRING(v));
-    escaped = mpcf_escape(escaped);
-    printf("\"%s\"", escaped);
-    free(escaped);
+// character `k` places ahead, or EOF
+int lreader_peek(lreader* r, long k) {
+    while (r->pos + k >= r->length) {
+        if (r->file == NULL) {
+            return EOF;
+        }
+
+        if (r->length + LREADER_CHUNK > r->slots) {
+            r->slots = r->slots ? r->slots * 2 : LREADER_CHUNK;
+            r->buffer = realloc(r->buffer, r->slots);
+        }
+
+        size_t n = fread(r->buffer + r->length, 1, LREADER_CHUNK, r->file);
+        if (n == 0) {
+            r->file = NULL;
+        }
+        r->length += n;
+    }
+    return (unsigned char) r->buffer[r->pos + k];
 }
 
-void lval_print(lenv *env, lval *v) {
-    switch (L_TYPE(v)) {
-        case LVAL_STRING:
-            lval_print_string(v);
-            break;
-        case LVAL_BOOLEAN:
-            printf(L_INTEGER(v) == 0 ? "false" : "true");
-            break;
-        case LVAL_INTEGER:
-            printf("%li", L_INTEGER(v));
-            break;
-        case LVAL_DECIMAL:
-            printf("%f", L_DECIMAL(v));
-            break;
-        case LVAL_SYMBOL:
-            printf("%s", L_SYMBOL(v));
-            break;
-        case LVAL_SEXPRESSION:
-            lval_expr_print(env, v, '(', ')');
-            break;
-        case LVAL_QEXPRESSION:
-            lval_expr_print(env, v, '{', '}');
-            break;
-        case LVAL_ERROR:
-            printf("Error: %s", L_ERROR(v));
-            break;
-        case LVAL_FUNCTION:
-            if (L_BUILTIN(v)) {
-                E_FOREACH(i, env) {
-                    if (L_BUILTIN(E_VALUES_N(env, i)) == L_BUILTIN(v)) {
-                        printf("<builtin function '%s'>", E_NAMES_N(env, i));
-                    }
-                }
-            } else {
-                printf("(\\ ");
-                lval_print(env, L_FORMALS(v));
-                putchar(' ');
-                lval_print(env, L_BODY(v));
-                putchar(')');
-            }
+void lreader_next(lreader* r) {
+    if (r->buffer[r->pos] == '\n') {
+        r->row++;
+        r->col = 0;
+    } else {
+        r->col++;
+    }
+    r->pos++;
+}
 
-            break;
-        default:
-            printf("Error: Unknown value type %d", L_TYPE(v));
-            break;
+void lreader_skip(lreader* r) {
+    int c = lreader_peek(r, 0);
+    while (c != EOF && strchr(" \f\n\r\t\v", c) && c != '\0') {
+        lreader_next(r);
+        c = lreader_peek(r, 0);
     }
 }
 
-void lval_println(lenv *env, lval *v) {
-    lval_print(env, v);
-    putchar('\n');
+int lreader_is_symbol(int c) {
+    return (c >= 'a' && c <= 'z')
+        || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9')
+        || (c != EOF && c != '\0' && strchr("_+-*/\\=<>!&%^|?", c));
 }
 
-lval* lval_pop(lval* v, int i) {
-    lval* x = L_CELL_N(v, i);
+// matches a single token the same way `grammar` does: a decimal, then
+// an integer, then a symbol, each taking as many characters as it can
+lval* lreader_token(lreader* r) {
+    long k = 0;
+    int number = 0;
+    int decimal = 0;
 
-    // shift memory after the item at 'i' over the top and reallocate memory used
-    memmove(&L_CELL_N(v, i), &v->cell[i + 1], sizeof(lval*) * (L_COUNT(v) - i - 1));
-    L_COUNT(v)--;
-    L_CELL(v) = realloc(L_CELL(v), sizeof(lval*) * L_COUNT(v));
+    if (lreader_peek(r, k) == '-') {
+        k++;
+    }
+    long digits = k;
+    while (isdigit(lreader_peek(r, k))) {
+        k++;
+    }
+
+    if (k > digits) {
+        number = 1;
+        if (lreader_peek(r, k) == '.' && isdigit(lreader_peek(r, k + 1))) {
+            decimal = 1;
+            k += 2;
+            while (isdigit(lreader_peek(r, k))) {
+                k++;
+            }
+        }
+    } else {
+        k = 0;
+        while (lreader_is_symbol(lreader_peek(r, k))) {
+            k++;
+        }
+        if (k == 0) {
+            return NULL;
+        }
+    }
+
+    char* token = malloc(k + 1);
+    memcpy(token, r->buffer + r->pos, k);
+    token[k] = '\0';
 
+    lval* x = number ? lval_read_string(token, decimal) : lval_symbol(token);
+
+    free(token);
+    for (long i = 0; i < k; i++) {
+        lreader_next(r);
+    }
     return x;
 }
 
-lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
-    lval_delete(v);
-    return x;
+lval* lreader_expr(lreader* r) {
+    int c = lreader_peek(r, 0);
+
+    if (c != '(' && c != '{') {
+        lval* x = lreader_token(r);
+        if (x == NULL) {
+            snprintf(r->error, sizeof(r->error),
+                     "%i:%i: unexpected %s",
+                     r->row + 1, r->col + 1, c == EOF ? "end of input" : "character");
+        }
+        return x;
+    }
+
+    int close = c == '(' ? ')' : '}';
+    lval* x = c == '(' ? lval_sexpression() : lval_qexpression();
+    lreader_next(r);
+
+    while (1) {
+        lreader_skip(r);
+        c = lreader_peek(r, 0);
+
+        if (c == close) {
+            lreader_next(r);
+            return x;
+        }
+
+        lval* y = c == EOF ? NULL : lreader_expr(r);
+        if (y == NULL) {
+            if (c == EOF || c == ')' || c == '}') {
+                snprintf(r->error, sizeof(r->error),
+                         "%i:%i: expected '%c'", r->row + 1, r->col + 1, close);
+            }
+            lval_delete(x);
+            return NULL;
+        }
+        x = lval_add(x, y);
+    }
 }
 
-lval* lval_join(lval* x, lval* y) {
-    while (L_COUNT(y)) {
-        x = lval_add(x, lval_pop(y, 0));
+// next top level form, or NULL at the end of input or on a syntax error
+lval* lreader_read(lreader* r) {
+    // forms never refer back to earlier input so it can be dropped
+    if (r->slots && r->pos > 0) {
+        memmove(r->buffer, r->buffer + r->pos, r->length - r->pos);
+        r->length -= r->pos;
+        r->pos = 0;
+    }
+
+    lreader_skip(r);
+    if (lreader_peek(r, 0) == EOF) {
+        return NULL;
+    }
+    return lreader_expr(r);
+}
+
+// all remaining forms as one s-expression like the `lispy` rule
+lval* lreader_read_all(lreader* r) {
+    lval* x = lval_sexpression();
+    lval* y;
+    while ((y = lreader_read(r))) {
+        x = lval_add(x, y);
+    }
+    if (r->error[0]) {
+        lval_delete(x);
+        return NULL;
     }
-    lval_delete(y);
     return x;
 }
 
-int lval_eq(lval *x, lval *y) {
-    // different types are always unequal
-    if (L_TYPE(x) != L_TYPE(y)) {
+// evaluates and prints each remaining form as soon as it is read, so only
+// one form is held at a time; returns 0 after a syntax error
+int lreader_eval_all(lreader* r, lenv* env, char* name, FILE* errors) {
+    lval* x;
+    while ((x = lreader_read(r))) {
+        x = lval_eval(env, x);
+        lval_println(env, x);
+        lval_delete(x);
+    }
+    if (r->error[0]) {
+        fprintf(errors, "%s:%s\n", name, r->error);
         return 0;
     }
+    return 1;
+}
 
-    // compare based upon type
-    switch (x->type) {
-        case LVAL_STRING:
-            return STR_EQ(L_STRING(x), L_STRING(v));
-        case LVAL_BOOLEAN:
-        case LVAL_INTEGER:
-            return (L_INTEGER(x) == L_INTEGER(y));
-        case LVAL_DECIMAL:
-            return (L_DECIMAL(x) == L_DECIMAL(y));
-        case LVAL_ERROR:
-            return STR_EQ(L_ERROR(x), L_ERROR(y));
-        case LVAL_SYMBOL:
-            return STR_EQ(L_SYMBOL(x), L_SYMBOL(y));
-        case LVAL_FUNCTION:
-            if (L_BUILTIN(x) || L_BUILTIN(y)) {
-                return L_BUILTIN(x) == L_BUILTIN(y);
-            } else {
-                return lval_eq(L_FORMALS(x), L_FORMALS(y))
-                    && lval_eq(L_BODY(x), L_BODY(y));
+// reads chunks `start` to `end` of the array `arg` into their forms
+void lload_parse(void* arg, long start, long end) {
+    lload_chunk* chunks = arg;
+    for (long k = start; k < end; k++) {
+        lload_chunk* c = &chunks[k];
+        lreader* r = lreader_new(NULL, NULL);
+        r->buffer = c->start;
+        r->length = c->length;
+        r->row = c->row;
+        r->col = c->col;
+
+        c->forms = NULL;
+        c->forms_num = 0;
+        c->forms_slots = 0;
+        lval* x;
+        while ((x = lreader_read(r))) {
+            if (c->forms_num == c->forms_slots) {
+                c->forms_slots = c->forms_slots ? c->forms_slots * 2 : 256;
+                c->forms = realloc(c->forms, sizeof(lval*) * c->forms_slots);
             }
-        case LVAL_QEXPRESSION:
-        case LVAL_SEXPRESSION:
-            if (L_COUNT(x) != L_COUNT(y)) {
-                return 0;
+            c->forms[c->forms_num++] = x;
+        }
+        memcpy(c->error, r->error, sizeof(c->error));
+        lreader_delete(r);
+    }
+}
+
+// lreader_eval_all for a file; with `load_chunks` set, a large file is
+// mapped and split at top level forms so that the pool reads the next few
+// chunks in parallel before they are evaluated in order, which prints the
+// same and stops at the same error; it is off by default, as holding a few
+// chunks of forms at a time was measured to cost more than reading and
+// freeing them one by one; small files and pipes are always streamed
+int lload_file(linterp* in, lenv* env, FILE* f, char* name, FILE* errors) {
+    struct stat st;
+    char* data = NULL;
+    if (in->load_chunks && fstat(fileno(f), &st) == 0
+        && S_ISREG(st.st_mode) && st.st_size >= LLOAD_PARALLEL) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    }
+    if (!data || data == MAP_FAILED) {
+        lreader* reader = lreader_new(f, NULL);
+        int ok = lreader_eval_all(reader, env, name, errors);
+        lreader_delete(reader);
+        return ok;
+    }
+
+    lpool* pool = linterp_pool(in);
+    int chunks_num = pool->threads_num * 4;
+    lload_chunk* chunks = malloc(sizeof(lload_chunk) * chunks_num);
+    long size = st.st_size;
+    long pos = 0;
+    int row = 0;
+    int col = 0;
+    int ok = 1;
+
+    while (ok && pos < size) {
+        // a chunk ends at the first blank outside of any brackets past
+        // its size; there are no strings or comments to look out for
+        int n = 0;
+        while (n < chunks_num && pos < size) {
+            lload_chunk* c = &chunks[n++];
+            c->start = data + pos;
+            c->row = row;
+            c->col = col;
+            long target = pos + LLOAD_CHUNK;
+            int depth = 0;
+            for (; pos < size; pos++) {
+                switch (data[pos]) {
+                    case '(':
+                    case '{':
+                        depth++;
+                        break;
+                    case ')':
+                    case '}':
+                        depth -= depth > 0;
+                        break;
+                    case ' ': case '\f': case '\n': case '\r': case '\t': case '\v':
+                        if (depth == 0 && pos >= target) {
+                            goto boundary;
+                        }
+                        break;
+                }
+                if (data[pos] == '\n') {
+                    row++;
+                    col = 0;
+                } else {
+                    col++;
+                }
             }
-            L_FOREACH(i, x) {
-                if (!lval_eq(L_CELL_N(x, i), L_CELL_N(y, i))) {
-                    return 0;
+        boundary:
+            c->length = data + pos - c->start;
+        }
+
+        lpool_run(pool, lload_parse, chunks, n);
+
+        for (int k = 0; k < n; k++) {
+            for (long i = 0; i < chunks[k].forms_num; i++) {
+                lval* x = lval_eval(env, chunks[k].forms[i]);
+                lval_println(env, x);
+                lval_delete(x);
+            }
+            free(chunks[k].forms);
+
+            if (ok && chunks[k].error[0]) {
+                fprintf(errors, "%s:%s\n", name, chunks[k].error);
+                ok = 0;
+            }
+            // later chunks are only read, not evaluated
+            if (!ok) {
+                for (int j = k + 1; j < n; j++) {
+                    for (long i = 0; i < chunks[j].forms_num; i++) {
+                        lval_delete(chunks[j].forms[i]);
+                    }
+                    free(chunks[j].forms);
                 }
+                break;
             }
-            return 1;
+        }
     }
 
-    return 0;
+    free(chunks);
+    munmap(data, size);
+    return ok;
 }
 
-BUILTIN(and) {
-    int result;
-    LASSERT_ARGUMENT_NUMBER(a, 2, "&&");
-    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_BOOLEAN, "&&");
-    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_BOOLEAN, "&&");
+// one request per connection: the client writes its forms and shuts down
+// its side, then reads back what evaluating them printed; requests are
+// served one at a time, so a client that stalls is dropped after
+// LSERVER_TIMEOUT rather than holding up the others
+void lserver_request(linterp* in, int conn) {
+    struct timeval timeout = { LSERVER_TIMEOUT / 1000, (LSERVER_TIMEOUT % 1000) * 1000 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    FILE* f = fdopen(dup(conn), "rb");
+    if (!f) {
+        close(conn);
+        return;
+    }
 
-    result = L_INTEGER_N(a, 0) && L_INTEGER_N(a, 1);
-    lval_delete(a);
+    // requests see the root env through their own env and never change it
+    lenv* env = lenv_new();
+    E_PARENT(env) = in->root;
+    E_INTERP(env) = in;
 
-    return lval_boolean(result);
-}
+    // results are printed through stdout, which points at the client meanwhile
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(conn, STDOUT_FILENO);
 
-BUILTIN(or) {
-    int result;
-    LASSERT_ARGUMENT_NUMBER(a, 2, "||");
-    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_BOOLEAN, "||");
-    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_BOOLEAN, "||");
+    lreader* reader = lreader_new(f, NULL);
+    lreader_eval_all(reader, env, "<request>", stdout);
+    lreader_delete(reader);
 
-    result = L_INTEGER_N(a, 0) || L_INTEGER_N(a, 1);
-    lval_delete(a);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
 
-    return lval_boolean(result);
+    fclose(f);
+    close(conn);
+    lenv_delete(env);
 }
 
-BUILTIN(not) {
-    int result;
-    LASSERT_ARGUMENT_NUMBER(a, 1, "!");
+// serves requests one after another against a root env that was set up
+// once, so builtins and preloaded files are not rebuilt per request
+int lserver_run(linterp* in, char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long '%s'\n", path);
+        return 0;
+    }
+    strcpy(addr.sun_path, path);
 
-    switch (L_TYPE_N(a, 0)) {
-        case LVAL_INTEGER:
-            if (L_INTEGER_N(a, 0) != 0) {
-                result = 0;
-            } else {
-                result = 1;
-            }
-            break;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 0;
+    }
 
-        case LVAL_DECIMAL:
-            if (L_DECIMAL_N(a, 0) != 0.0) {
-                result = 0;
-            } else {
-                result = 1;
-            }
-            break;
+    // only a socket left by an earlier server is replaced
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Not a socket '%s'\n", path);
+            close(fd);
+            return 0;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        perror(path);
+        close(fd);
+        return 0;
+    }
 
-        case LVAL_SEXPRESSION:
-        case LVAL_QEXPRESSION:
-            if (L_COUNT_N(a, 0) > 0) {
-                result = 0;
-            } else {
-                result = 1;
-            }
-            break;
+    // a client that goes away early must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
 
-        default:
-            lval_delete(a);
-            return lval_error("Can only operate on %s, %s, %s, and %s.",
-                              ltype_name(LVAL_INTEGER),
-                              ltype_name(LVAL_DECIMAL),
-                              ltype_name(LVAL_SEXPRESSION),
-                              ltype_name(LVAL_QEXPRESSION));
+    E_SHARED(in->root) = 1;
+
+    while (1) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) { continue; }
+            perror("accept");
+            break;
+        }
+        lserver_request(in, conn);
     }
 
-    lval_delete(a);
-    return lval_boolean(result);
+    close(fd);
+    unlink(path);
+    return 0;
 }
 
-BUILTIN(eq) {
-    return builtin_cmp(env, a, "==");
+// FNV-1a
+unsigned long lhash(char* s) {
+    unsigned long h = 2166136261UL;
+    while (*s) {
+        h = ((h ^ (unsigned char) *s++) * 16777619UL) & 0xffffffffUL;
+    }
+    return h;
 }
 
-BUILTIN(ne) {
-    return builtin_cmp(env, a, "!=");
+lpack* lpack_new(void) {
+    lpack* m = malloc(sizeof(lpack));
+    m->slots = 4096;
+    m->data = malloc(m->slots);
+    m->length = 0;
+    m->symbols = NULL;
+    m->symbols_num = 0;
+    m->symbols_length = 0;
+    m->symbols_buckets_num = 64;
+    m->symbols_buckets = calloc(m->symbols_buckets_num, sizeof(int));
+    m->nodes = NULL;
+    m->nodes_num = 0;
+    m->nodes_slots = 0;
+    m->nodes_buckets_num = 64;
+    m->nodes_buckets = calloc(m->nodes_buckets_num, sizeof(int));
+    m->builtins = NULL;
+    return m;
 }
 
-lval *builtin_cmp(lenv *env, lval *a, char *operator) {
-    LASSERT_ARGUMENT_NUMBER(a, 2, operator);
-    int result;
-
-    if (STR_EQ(operator, "==")) {
-        result = lval_eq(L_CELL_N(a, 0), L_CELL_N(a, 1));
+void lpack_delete(lpack* m) {
+    free(m->data);
+    free(m->symbols);
+    free(m->symbols_buckets);
+    free(m->nodes);
+    free(m->nodes_buckets);
+    if (m->builtins) {
+        lenv_delete(m->builtins);
     }
+    free(m);
+}
 
-    if (STR_EQ(operator, "!=")) {
-        result = !lval_eq(L_CELL_N(a, 0), L_CELL_N(a, 1));
+void lpack_put(lpack* m, void* p, long n) {
+    if (m->length + n > m->slots) {
+        while (m->length + n > m->slots) {
+            m->slots *= 2;
+        }
+        m->data = realloc(m->data, m->slots);
     }
-
-    lval_delete(a);
-    return lval_boolean(result);
+    memcpy(m->data + m->length, p, n);
+    m->length += n;
 }
 
-BUILTIN(gt) {
-    return builtin_ord(env, a, ">");
+void lpack_put_byte(lpack* m, int c) {
+    unsigned char b = c;
+    lpack_put(m, &b, 1);
 }
 
-BUILTIN(lt) {
-    return builtin_ord(env, a, "<");
+// seven bits per byte, the high bit set on all but the last one
+void lpack_put_varint(lpack* m, unsigned long long x) {
+    unsigned char b[10];
+    int n = 0;
+    while (x >= 0x80) {
+        b[n++] = (x & 0x7f) | 0x80;
+        x >>= 7;
+    }
+    b[n++] = x;
+    lpack_put(m, b, n);
 }
 
-BUILTIN(ge) {
-    return builtin_ord(env, a, ">=");
+void lpack_put_bytes(lpack* m, char* s, long n) {
+    lpack_put_varint(m, n);
+    lpack_put(m, s, n);
 }
 
-BUILTIN(le) {
-    return builtin_ord(env, a, "<=");
+// index of `s` in the symbol table, adding it the first time it is seen
+long lpack_symbol(lpack* m, char* s) {
+    int mask = m->symbols_buckets_num - 1;
+    int i = lhash(s) & mask;
+    while (m->symbols_buckets[i]) {
+        if (STR_EQ(m->symbols[m->symbols_buckets[i] - 1], s)) {
+            return m->symbols_buckets[i] - 1;
+        }
+        i = (i + 1) & mask;
+    }
+
+    m->symbols_num++;
+    m->symbols = realloc(m->symbols, sizeof(char*) * m->symbols_num);
+    m->symbols[m->symbols_num - 1] = s;
+    m->symbols_length += strlen(s);
+    m->symbols_buckets[i] = m->symbols_num;
+
+    // keep the table at most half full
+    if (m->symbols_num * 2 > m->symbols_buckets_num) {
+        free(m->symbols_buckets);
+        m->symbols_buckets_num *= 2;
+        m->symbols_buckets = calloc(m->symbols_buckets_num, sizeof(int));
+        mask = m->symbols_buckets_num - 1;
+        for (int j = 0; j < m->symbols_num; j++) {
+            i = lhash(m->symbols[j]) & mask;
+            while (m->symbols_buckets[i]) {
+                i = (i + 1) & mask;
+            }
+            m->symbols_buckets[i] = j + 1;
+        }
+    }
+    return m->symbols_num - 1;
 }
 
-lval *builtin_ord(lenv *env, lval *a, char *operator) {
-    LASSERT_ARGUMENT_NUMBER(a, 2, operator);
-    LASSERT(a,
-            L_TYPE_N(a, 0) == LVAL_INTEGER || L_TYPE_N(a, 0) == LVAL_DECIMAL,
-            "Incorrect type of argument #%d for '%s'. Got %s, expected %s or %s.",
-            0,
-            operator,
-            ltype_name(L_TYPE_N(a, 0)),
-            ltype_name(LVAL_INTEGER),
-            ltype_name(LVAL_DECIMAL)
-            );
-    LASSERT(a,
-            L_TYPE_N(a, 1) == LVAL_INTEGER || L_TYPE_N(a, 1) == LVAL_DECIMAL,
-            "Incorrect type of argument #%d for '%s'. Got %s, expected %s or %s.",
-            1,
-            operator,
-            ltype_name(L_TYPE_N(a, 1)),
-            ltype_name(LVAL_INTEGER),
-            ltype_name(LVAL_DECIMAL)
-            );
-    LASSERT(a,
-            L_TYPE_N(a, 0) == L_TYPE_N(a, 1),
-            "Argument #2 for '%s' should be of the same type as argument #1.\n"
-            "Got %s and %s, expected %s and %s.",
-            operator,
-            ltype_name(L_TYPE_N(a, 0)),
-            ltype_name(L_TYPE_N(a, 1)),
-            ltype_name(L_TYPE_N(a, 0)),
-            ltype_name(L_TYPE_N(a, 0))
-            );
+// like lval_eq, but 0.0 and -0.0 differ, strings are compared by length
+// and lambdas only match themselves
+int lpack_same(lval* x, lval* y) {
+    if (L_TYPE(x) != L_TYPE(y)) {
+        return 0;
+    }
+    switch (L_TYPE(x)) {
+        case LVAL_DECIMAL:
+            return memcmp(&L_DECIMAL(x), &L_DECIMAL(y), sizeof(double)) == 0;
+        case LVAL_STRING:
+            return L_COUNT(x) == L_COUNT(y)
+                && memcmp(L_STRING(x), L_STRING(y), L_COUNT(x)) == 0;
+        case LVAL_FUNCTION:
+            // lambdas with different envs are not the same
+            return L_BUILTIN(x) && L_BUILTIN(x) == L_BUILTIN(y);
+        case LVAL_QEXPRESSION:
+        case LVAL_SEXPRESSION:
+            if (L_COUNT(x) != L_COUNT(y)) {
+                return 0;
+            }
+            L_FOREACH(i, x) {
+                if (!lpack_same(L_CELL_N(x, i), L_CELL_N(y, i))) {
+                    return 0;
+                }
+            }
+            return 1;
+    }
+    return lval_eq(x, y);
+}
 
-    int result;
-    if (STR_EQ(operator, ">")) {
-        if (L_TYPE_N(a, 0) == LVAL_INTEGER) {
-            result = (L_INTEGER(L_CELL_N(a, 0)) > L_INTEGER_N(a, 1));
-        } else {
-            result = (L_DECIMAL(L_CELL_N(a, 0)) > L_DECIMAL_N(a, 1));
+// back reference to an expression written before that is the same as `v`,
+// or -1 after remembering `v` for later ones
+long lpack_node(lpack* m, lval* v, unsigned long hash) {
+    int mask = m->nodes_buckets_num - 1;
+    int i = hash & mask;
+    while (m->nodes_buckets[i]) {
+        lpack_node_t* n = &m->nodes[m->nodes_buckets[i] - 1];
+        if (n->hash == hash && lpack_same(n->value, v)) {
+            return m->nodes_buckets[i] - 1;
         }
+        i = (i + 1) & mask;
     }
-    if (STR_EQ(operator, "<")) {
-        if (L_TYPE_N(a, 0) == LVAL_INTEGER) {
-            result = (L_INTEGER(L_CELL_N(a, 0)) < L_INTEGER_N(a, 1));
-        } else {
-            result = (L_DECIMAL(L_CELL_N(a, 0)) < L_DECIMAL_N(a, 1));
-        }
+
+    if (m->nodes_num == m->nodes_slots) {
+        m->nodes_slots = m->nodes_slots ? m->nodes_slots * 2 : 64;
+        m->nodes = realloc(m->nodes, sizeof(lpack_node_t) * m->nodes_slots);
     }
-    if (STR_EQ(operator, ">=")) {
-        if (L_TYPE_N(a, 0) == LVAL_INTEGER) {
-            result = (L_INTEGER(L_CELL_N(a, 0)) >= L_INTEGER_N(a, 1));
-        } else {
-            result = (L_DECIMAL(L_CELL_N(a, 0)) >= L_DECIMAL_N(a, 1));
+    m->nodes[m->nodes_num].value = v;
+    m->nodes[m->nodes_num].hash = hash;
+    m->nodes_num++;
+    m->nodes_buckets[i] = m->nodes_num;
+
+    if (m->nodes_num * 2 > m->nodes_buckets_num) {
+        free(m->nodes_buckets);
+        m->nodes_buckets_num *= 2;
+        m->nodes_buckets = calloc(m->nodes_buckets_num, sizeof(int));
+        mask = m->nodes_buckets_num - 1;
+        for (int j = 0; j < m->nodes_num; j++) {
+            i = m->nodes[j].hash & mask;
+            while (m->nodes_buckets[i]) {
+                i = (i + 1) & mask;
+            }
+            m->nodes_buckets[i] = j + 1;
         }
     }
-    if (STR_EQ(operator, "<=")) {
-        if (L_TYPE_N(a, 0) == LVAL_INTEGER) {
-            result = (L_INTEGER(L_CELL_N(a, 0)) <= L_INTEGER_N(a, 1));
-        } else {
-            result = (L_DECIMAL(L_CELL_N(a, 0)) <= L_DECIMAL_N(a, 1));
+    return -1;
+}
+
+// a type byte followed by the value, `hash` is set to a hash of it for the
+// enclosing expression; returns 0 for builtins that have no name and for
+// futures
+int lpack_lval(lpack* m, lval* v, unsigned long* hash) {
+    long start = m->length;
+    unsigned long h = L_TYPE(v) * 16777619UL;
+    lpack_put_byte(m, L_TYPE(v));
+
+    switch (L_TYPE(v)) {
+        case LVAL_INTEGER:
+        case LVAL_BOOLEAN: {
+            // zigzag, so that small negative numbers stay short
+            unsigned long long x = L_INTEGER(v);
+            lpack_put_varint(m, (x << 1) ^ (L_INTEGER(v) < 0 ? ~0ULL : 0));
+            h ^= x;
+            break;
+        }
+        case LVAL_DECIMAL: {
+            unsigned long long bits;
+            unsigned char b[8];
+            memcpy(&bits, &L_DECIMAL(v), sizeof(bits));
+            for (int i = 0; i < 8; i++) {
+                b[i] = (bits >> (8 * i)) & 0xff;
+            }
+            lpack_put(m, b, 8);
+            h ^= bits;
+            break;
+        }
+        case LVAL_ERROR:
+            lpack_put_bytes(m, L_ERROR(v), strlen(L_ERROR(v)));
+            h ^= lhash(L_ERROR(v));
+            break;
+        case LVAL_STRING:
+            lpack_put_bytes(m, L_STRING(v), L_COUNT(v));
+            h ^= L_COUNT(v);
+            break;
+        case LVAL_SYMBOL:
+            lpack_put_varint(m, lpack_symbol(m, L_SYMBOL(v)));
+            h ^= lhash(L_SYMBOL(v));
+            break;
+        case LVAL_SEXPRESSION:
+        case LVAL_QEXPRESSION: {
+            lpack_put_varint(m, L_COUNT(v));
+            L_FOREACH(i, v) {
+                unsigned long x;
+                if (!lpack_lval(m, L_CELL_N(v, i), &x)) {
+                    return 0;
+                }
+                h = (h * 31 + x) & 0xffffffffUL;
+            }
+            // an expression that was written before, so all of its children
+            // were back references already, is replaced by one as a whole
+            long node = L_COUNT(v) ? lpack_node(m, v, h) : -1;
+            if (node >= 0) {
+                m->length = start;
+                lpack_put_byte(m, LPACK_REFERENCE);
+                lpack_put_varint(m, node);
+            }
+            break;
         }
+        case LVAL_FUNCTION:
+            lpack_put_byte(m, L_BUILTIN(v) != NULL);
+            if (L_BUILTIN(v)) {
+                // builtins are matched by pointer against a fresh set, so
+                // that values redefined by the user cannot get in the way
+                if (!m->builtins) {
+                    m->builtins = lenv_new();
+                    lenv_add_builtins(m->builtins);
+                }
+                int found = 0;
+                E_FOREACH(i, m->builtins) {
+                    if (L_BUILTIN(E_VALUES_N(m->builtins, i)) == L_BUILTIN(v)) {
+                        lpack_put_varint(m, lpack_symbol(m, E_NAMES_N(m->builtins, i)));
+                        h ^= lhash(E_NAMES_N(m->builtins, i));
+                        found = 1;
+                        break;
+                    }
+                }
+                if (!found) {
+                    return 0;
+                }
+                break;
+            }
+            unsigned long x, y;
+            if (!lpack_lenv(m, L_ENV(v))
+                || !lpack_lval(m, L_FORMALS(v), &x)
+                || !lpack_lval(m, L_BODY(v), &y)) {
+                return 0;
+            }
+            h ^= x * 31 + y;
+            break;
+        case LVAL_FUTURE:
+        case LVAL_CHANNEL:
+        case LVAL_ATOM:
+            return 0;
     }
 
-    lval_delete(a);
-    return lval_boolean(result);
+    if (hash) {
+        *hash = h;
+    }
+    return 1;
 }
 
-BUILTIN(lambda) {
-    LASSERT_ARGUMENT_NUMBER(a, 2, "\\");
-    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "\\");
-    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_QEXPRESSION, "\\");
+int lpack_lenv(lpack* m, lenv* env) {
+    lenv_reader* r = lenv_enter(env);
+    int count = E_COUNT(env);
+    lpack_put_varint(m, count);
+    for (int i = 0; i < count; i++) {
+        lpack_put_varint(m, lpack_symbol(m, E_NAMES_N(env, i)));
+        if (!lpack_lval(m, E_VALUES_N(env, i), NULL)) {
+            lenv_leave(r);
+            return 0;
+        }
+    }
+    lenv_leave(r);
+    return 1;
+}
 
-    // First Q-Expression should contain only symbols
-    L_FOREACH(i, a) {
-        LASSERT(a, L_TYPE_N(L_CELL_N(a, 0), i) == LVAL_SYMBOL,
-                "Cannot define non-symbol. Got %s, expected %s.",
-                ltype_name(L_TYPE_N(L_CELL_N(a, 0), i)), ltype_name(LVAL_SYMBOL));
+// `magic` followed by the symbol table and then everything written so far;
+// symbols are stored with their terminator so a reader can use them in place
+char* lpack_finish(lpack* m, char* magic, long* length) {
+    lpack* out = lpack_new();
+    free(out->data);
+    out->slots = m->length + m->symbols_length + 10 * m->symbols_num + 16;
+    out->data = malloc(out->slots);
+
+    lpack_put(out, magic, LPACK_MAGIC_LENGTH);
+    lpack_put_varint(out, m->symbols_num);
+    for (int i = 0; i < m->symbols_num; i++) {
+        lpack_put_bytes(out, m->symbols[i], strlen(m->symbols[i]));
+        lpack_put_byte(out, '\0');
     }
+    lpack_put(out, m->data, m->length);
 
-    lval *formals = lval_pop(a, 0);
-    lval *body = lval_pop(a, 0);
-    lval_delete(a);
+    char* data = out->data;
+    *length = out->length;
+    out->data = NULL;
+    lpack_delete(out);
+    return data;
+}
 
-    return lval_lambda(formals, body);
+// serialized values start with LPACK_MAGIC, images with LIMAGE_MAGIC;
+// returns NULL for builtins that have no name
+char* lval_pack(lval* v, char* magic, long* length) {
+    lpack* m = lpack_new();
+    char* data = lpack_lval(m, v, NULL) ? lpack_finish(m, magic, length) : NULL;
+    lpack_delete(m);
+    return data;
 }
 
-lval* builtin_op(char *operator, lenv *env, lval *a) {
-    L_FOREACH(i, a) {
-        if (L_TYPE_N(a, i) != LVAL_INTEGER && L_TYPE_N(a, i) != LVAL_DECIMAL) {
-            lval_delete(a);
-            return lval_error("Cannot operate on non-number");
+// `data` has to outlive the reader, its symbols are used in place
+void lunpack_init(lunpack* r, char* data, long length, char* magic) {
+    r->data = (unsigned char*) data;
+    r->length = length;
+    r->pos = LPACK_MAGIC_LENGTH;
+    r->symbols = NULL;
+    r->symbols_num = 0;
+    r->nodes = NULL;
+    r->nodes_num = 0;
+    r->nodes_slots = 0;
+    r->builtins = NULL;
+    r->broken = length < LPACK_MAGIC_LENGTH
+        || memcmp(data, magic, LPACK_MAGIC_LENGTH) != 0;
+
+    unsigned long long n = lunpack_varint(r);
+    // every symbol takes at least two bytes, anything more is corrupt
+    if (r->broken || n > (unsigned long long) (r->length - r->pos) / 2) {
+        r->broken = 1;
+        return;
+    }
+    r->symbols = malloc(sizeof(char*) * (n ? n : 1));
+    for (unsigned long long i = 0; i < n; i++) {
+        unsigned long long k = lunpack_varint(r);
+        if (r->broken || k >= (unsigned long long) (r->length - r->pos)
+            || r->data[r->pos + k] != '\0') {
+            r->broken = 1;
+            return;
         }
+        r->symbols[r->symbols_num++] = (char*) r->data + r->pos;
+        r->pos += k + 1;
     }
+}
 
-    lval* x = lval_pop(a, 0);
+void lunpack_clear(lunpack* r) {
+    free(r->symbols);
+    free(r->nodes);
+    if (r->builtins) {
+        lenv_delete(r->builtins);
+    }
+}
 
-    // unary negation
-    if (STR_EQ(operator, "-") && L_COUNT(a) == 0) {
-        switch(L_TYPE(x)) {
-            case LVAL_INTEGER:
-                L_INTEGER(x) = -L_INTEGER(x);
-                break;
-            case LVAL_DECIMAL:
-                L_DECIMAL(x) = -L_DECIMAL(x);
-                break;
+unsigned long long lunpack_varint(lunpack* r) {
+    unsigned long long x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->pos >= r->length) {
+            break;
+        }
+        int b = r->data[r->pos++];
+        x |= (unsigned long long) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return x;
         }
     }
+    r->broken = 1;
+    return 0;
+}
 
-    while (L_COUNT(a) > 0) {
-        lval* y = lval_pop(a, 0);
+char* lunpack_symbol(lunpack* r) {
+    unsigned long long i = lunpack_varint(r);
+    if (i >= (unsigned long long) r->symbols_num) {
+        r->broken = 1;
+        return NULL;
+    }
+    return r->symbols[i];
+}
 
-        if (STR_EQ(operator, "+") || STR_EQ(operator, "add")) {
-            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-                L_DECIMAL(x) += L_DECIMAL(y);
-            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-                L_DECIMAL(x) += L_INTEGER(y);
-            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-                L_INTEGER(x) += (int)L_DECIMAL(y);
-            } else {
-                L_INTEGER(x) += L_INTEGER(y);
-            }
-        }
+// NULL once anything in the data does not add up
+lval* lunpack_lval(lunpack* r) {
+    if (r->broken || r->pos >= r->length) {
+        r->broken = 1;
+        return NULL;
+    }
 
-        if (STR_EQ(operator, "-") || STR_EQ(operator, "sub")) {
-            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-                L_DECIMAL(x) -= L_DECIMAL(y);
-            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-                L_DECIMAL(x) -= L_INTEGER(y);
-            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-                L_INTEGER(x) -= (int)L_DECIMAL(y);
-            } else {
-                L_INTEGER(x) -= L_INTEGER(y);
+    int type = r->data[r->pos++];
+    lval* v = NULL;
+
+    switch (type) {
+        case LVAL_INTEGER:
+        case LVAL_BOOLEAN: {
+            unsigned long long x = lunpack_varint(r);
+            v = lval_integer((long) ((x >> 1) ^ (~(x & 1) + 1)));
+            L_TYPE(v) = type;
+            break;
+        }
+        case LVAL_DECIMAL: {
+            if (r->length - r->pos < 8) {
+                r->broken = 1;
+                break;
+            }
+            unsigned long long bits = 0;
+            for (int i = 0; i < 8; i++) {
+                bits |= (unsigned long long) r->data[r->pos + i] << (8 * i);
             }
+            r->pos += 8;
+            double x;
+            memcpy(&x, &bits, sizeof(x));
+            v = lval_decimal(x);
+            break;
         }
-
-        if (STR_EQ(operator, "*") || STR_EQ(operator, "mul")) {
-            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-                L_DECIMAL(x) *= L_DECIMAL(y);
-            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-                L_DECIMAL(x) *= L_INTEGER(y);
-            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-                L_INTEGER(x) *= (int)L_DECIMAL(y);
-            } else {
-                L_INTEGER(x) *= L_INTEGER(y);
+        case LVAL_ERROR:
+        case LVAL_STRING: {
+            unsigned long long n = lunpack_varint(r);
+            if (r->broken || n > (unsigned long long) (r->length - r->pos)) {
+                r->broken = 1;
+                break;
+            }
+            v = lval_bytes((char*) r->data + r->pos, n);
+            r->pos += n;
+            if (type == LVAL_ERROR) {
+                L_TYPE(v) = LVAL_ERROR;
+                L_ERROR(v) = L_STRING(v);
             }
+            break;
         }
-
-        if (STR_EQ(operator, "/") || STR_EQ(operator, "div")) {
-            switch (L_TYPE(y)) {
-                case LVAL_DECIMAL:
-                    if (L_DECIMAL(y) == 0.0) {
-                        lval_delete(x);
-                        lval_delete(y);
-                        lval_delete(a);
-                        return lval_error("Division by zero");
-                    }
+        case LVAL_SYMBOL: {
+            char* s = lunpack_symbol(r);
+            if (s) {
+                v = lval_symbol(s);
+            }
+            break;
+        }
+        case LVAL_SEXPRESSION:
+        case LVAL_QEXPRESSION: {
+            unsigned long long n = lunpack_varint(r);
+            // every child takes at least two bytes
+            if (r->broken || n > (unsigned long long) (r->length - r->pos) / 2) {
+                r->broken = 1;
+                break;
+            }
+            v = type == LVAL_SEXPRESSION ? lval_sexpression() : lval_qexpression();
+            for (unsigned long long i = 0; i < n && !r->broken; i++) {
+                lval* x = lunpack_lval(r);
+                if (x) {
+                    v = lval_add(v, x);
+                }
+            }
+            // numbered in the same order as lpack_node sees them
+            if (!r->broken && n) {
+                if (r->nodes_num == r->nodes_slots) {
+                    r->nodes_slots = r->nodes_slots ? r->nodes_slots * 2 : 64;
+                    r->nodes = realloc(r->nodes, sizeof(lval*) * r->nodes_slots);
+                }
+                r->nodes[r->nodes_num++] = v;
+            }
+            break;
+        }
+        case LPACK_REFERENCE: {
+            unsigned long long i = lunpack_varint(r);
+            if (r->broken || i >= (unsigned long long) r->nodes_num) {
+                r->broken = 1;
+                break;
+            }
+            v = lval_copy(r->nodes[i]);
+            break;
+        }
+        case LVAL_FUNCTION: {
+            if (r->pos >= r->length) {
+                r->broken = 1;
+                break;
+            }
+            if (r->data[r->pos++]) {
+                char* name = lunpack_symbol(r);
+                if (!name) {
+                    r->broken = 1;
                     break;
-                case LVAL_INTEGER:
-                    if (L_INTEGER(y) == 0) {
-                        lval_delete(x);
-                        lval_delete(y);
-                        lval_delete(a);
-                        return lval_error("Division by zero");
+                }
+                if (!r->builtins) {
+                    r->builtins = lenv_new();
+                    lenv_add_builtins(r->builtins);
+                }
+                E_FOREACH(i, r->builtins) {
+                    if (STR_EQ(E_NAMES_N(r->builtins, i), name)) {
+                        v = lval_copy(E_VALUES_N(r->builtins, i));
+                        break;
                     }
-                    break;
+                }
+                if (!v) {
+                    r->broken = 1;
+                }
+                break;
             }
-
-            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-                L_DECIMAL(x) /= L_DECIMAL(y);
-            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-                L_DECIMAL(x) /= L_INTEGER(y);
-            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-                L_INTEGER(x) /= L_DECIMAL(y);
-            } else {
-                L_INTEGER(x) /= L_INTEGER(y);
+            lenv* env = lunpack_lenv(r);
+            lval* formals = env ? lunpack_lval(r) : NULL;
+            lval* body = formals ? lunpack_lval(r) : NULL;
+            if (body) {
+                v = lval_lambda(formals, body);
+                lenv_delete(L_ENV(v));
+                L_ENV(v) = env;
+                break;
             }
+            if (env) { lenv_delete(env); }
+            if (formals) { lval_delete(formals); }
+            break;
         }
+        default:
+            r->broken = 1;
+    }
 
-        if (STR_EQ(operator, "%") || STR_EQ(operator, "mod")) {
-            switch (L_TYPE(y)) {
-                case LVAL_DECIMAL:
-                    if (L_DECIMAL(y) == 0.0) {
-                        lval_delete(x);
-                        lval_delete(y);
-                        lval_delete(a);
-                        return lval_error("Division by zero");
-                    }
-                    break;
-                case LVAL_INTEGER:
-                    if (L_INTEGER(y) == 0) {
-                        lval_delete(x);
-                        lval_delete(y);
-                        lval_delete(a);
-                        return lval_error("Division by zero");
-                    }
+    // nodes may point into what is deleted here, but nothing is read once
+    // the data is broken
+    if (r->broken && v) {
+        lval_delete(v);
+        v = NULL;
+    }
+    return v;
+}
+
+lenv* lunpack_lenv(lunpack* r) {
+    unsigned long long n = lunpack_varint(r);
+    // every entry takes at least three bytes
+    if (r->broken || n > (unsigned long long) (r->length - r->pos) / 3) {
+        r->broken = 1;
+        return NULL;
+    }
+
+    lenv* env = lenv_new();
+    E_NAMES(env) = malloc(sizeof(char*) * n);
+    E_VALUES(env) = malloc(sizeof(lval*) * n);
+    for (unsigned long long i = 0; i < n; i++) {
+        char* name = lunpack_symbol(r);
+        lval* x = name ? lunpack_lval(r) : NULL;
+        if (!x) {
+            lenv_delete(env);
+            return NULL;
+        }
+        // names in an env are unique already, no need for lenv_put
+        E_NAMES_N(env, i) = malloc(strlen(name) + 1);
+        strcpy(E_NAMES_N(env, i), name);
+        E_VALUES_N(env, i) = x;
+        E_COUNT(env)++;
+    }
+    return env;
+}
+
+// the value packed in `data`, or NULL if it is not one; trailing bytes
+// count as corrupt too
+lval* lval_unpack(char* data, long length) {
+    lunpack r;
+    lunpack_init(&r, data, length, LPACK_MAGIC);
+    lval* v = lunpack_lval(&r);
+    if (v && r.pos != r.length) {
+        lval_delete(v);
+        v = NULL;
+    }
+    lunpack_clear(&r);
+    return v;
+}
+
+// the image is written next to `path` and renamed over it
+int limage_save(lenv* env, char* path) {
+    lpack* m = lpack_new();
+    lpack_put_varint(m, LIMAGE_VERSION);
+
+    int ok = lpack_lenv(m, env);
+    if (ok) {
+        long length;
+        char* data = lpack_finish(m, LIMAGE_MAGIC, &length);
+        char* tmp = malloc(strlen(path) + 5);
+        sprintf(tmp, "%s.tmp", path);
+        FILE* f = fopen(tmp, "wb");
+        ok = f != NULL && fwrite(data, 1, length, f) == (size_t) length;
+        ok = f != NULL && fclose(f) == 0 && ok && rename(tmp, path) == 0;
+        if (!ok) {
+            remove(tmp);
+        }
+        free(tmp);
+        free(data);
+    }
+
+    lpack_delete(m);
+    return ok;
+}
+
+// maps the image and decodes it in one pass, then adds any builtin the
+// image does not know about; returns -1 when there is no file to load and
+// 0 when it is not a valid image
+int limage_load(lenv** env, char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+
+    lunpack r;
+    lunpack_init(&r, data, st.st_size, LIMAGE_MAGIC);
+    lenv* e = NULL;
+    if (lunpack_varint(&r) == LIMAGE_VERSION && !r.broken) {
+        e = lunpack_lenv(&r);
+    }
+    if (e && r.pos != r.length) {
+        lenv_delete(e);
+        e = NULL;
+    }
+
+    if (e) {
+        if (!r.builtins) {
+            r.builtins = lenv_new();
+            lenv_add_builtins(r.builtins);
+        }
+        E_FOREACH(i, r.builtins) {
+            int found = 0;
+            E_FOREACH(j, e) {
+                if (STR_EQ(E_NAMES_N(e, j), E_NAMES_N(r.builtins, i))) {
+                    found = 1;
                     break;
+                }
             }
-
-            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-                L_DECIMAL(x) = fmod(L_DECIMAL(x), L_DECIMAL(y));
-            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-                L_DECIMAL(x) = fmod(L_DECIMAL(x), L_INTEGER(y));
-            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-                L_INTEGER(x) = fmod(L_INTEGER(x), (int)L_DECIMAL(y));
-            } else {
-                L_INTEGER(x) = (int)fmod(L_INTEGER(x), L_INTEGER(y));
+            if (!found) {
+                lval* key = lval_symbol(E_NAMES_N(r.builtins, i));
+                lenv_put(e, key, E_VALUES_N(r.builtins, i));
+                lval_delete(key);
             }
         }
+    }
 
-        if (STR_EQ(operator, "^")) {
-            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-                L_DECIMAL(x) = pow(L_DECIMAL(x), L_DECIMAL(y));
-            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-                L_DECIMAL(x) = pow(L_DECIMAL(x), L_INTEGER(y));
-            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-                L_INTEGER(x) = (int)pow(L_INTEGER(x), L_DECIMAL(y));
-            } else {
-                L_INTEGER(x) = pow(L_INTEGER(x), L_INTEGER(y));
-            }
+    lunpack_clear(&r);
+    munmap(data, st.st_size);
+
+    if (!e) {
+        return 0;
+    }
+    *env = e;
+    return 1;
+}
+
+// terminals and rule references are wrapped the same way mpca_lang wraps
+// them, so ASTs and error messages match the ones built from `grammar`
+mpc_parser_t* lgrammar_regex(char* re) {
+    return mpca_state(mpca_tag(mpc_apply(mpc_tok(mpc_re(re)), mpcf_str_ast), "regex"));
+}
+
+mpc_parser_t* lgrammar_char(char c) {
+    return mpca_state(mpca_tag(mpc_apply(mpc_tok(mpc_char(c)), mpcf_str_ast), "char"));
+}
+
+mpc_parser_t* lgrammar_rule(mpc_parser_t* p, char* name) {
+    return mpca_state(mpca_root(mpca_add_tag(p, name)));
+}
+
+lgrammar* lgrammar_new(void) {
+    lgrammar* g = malloc(sizeof(lgrammar));
+    g->number = mpc_new("number");
+    g->decimal = mpc_new("decimal");
+    g->integer = mpc_new("integer");
+    g->symbol = mpc_new("symbol");
+    g->sexpr = mpc_new("sexpr");
+    g->qexpr = mpc_new("qexpr");
+    g->expr = mpc_new("expr");
+    g->lispy = mpc_new("lispy");
+
+    // one definition per rule of `grammar`, keep the two in sync
+    mpc_define(g->decimal, lgrammar_regex("-?[0-9]+\\.[0-9]+"));
+    mpc_define(g->integer, lgrammar_regex("-?[0-9]+"));
+    mpc_define(g->number, mpca_or(2,
+                                  lgrammar_rule(g->decimal, "decimal"),
+                                  lgrammar_rule(g->integer, "integer")));
+    mpc_define(g->symbol, lgrammar_regex("[a-zA-Z0-9_+\\-*/\\\\=<>!&%^|?]+"));
+    mpc_define(g->sexpr, mpca_and(3,
+                                  lgrammar_char('('),
+                                  mpca_many(lgrammar_rule(g->expr, "expr")),
+                                  lgrammar_char(')')));
+    mpc_define(g->qexpr, mpca_and(3,
+                                  lgrammar_char('{'),
+                                  mpca_many(lgrammar_rule(g->expr, "expr")),
+                                  lgrammar_char('}')));
+    mpc_define(g->expr, mpca_or(4,
+                                lgrammar_rule(g->number, "number"),
+                                lgrammar_rule(g->symbol, "symbol"),
+                                lgrammar_rule(g->sexpr, "sexpr"),
+                                lgrammar_rule(g->qexpr, "qexpr")));
+    mpc_define(g->lispy, mpca_and(3,
+                                  lgrammar_regex("^"),
+                                  mpca_many(lgrammar_rule(g->expr, "expr")),
+                                  lgrammar_regex("$")));
+
+    // dispatch `expr` alternatives on their first character
+    mpc_optimise(g->lispy);
+
+    return g;
+}
+
+void lgrammar_delete(lgrammar* g) {
+    if (!g) { return; }
+    mpc_cleanup(8,
+                g->number,
+                g->decimal,
+                g->integer,
+                g->symbol,
+                g->sexpr,
+                g->qexpr,
+                g->expr,
+                g->lispy);
+    free(g);
+}
+
+linput* linput_new(void) {
+    linput* in = malloc(sizeof(linput));
+    in->slots = 256;
+    in->buffer = malloc(in->slots);
+    linput_clear(in);
+    return in;
+}
+
+void linput_delete(linput* in) {
+    free(in->buffer);
+    free(in);
+}
+
+void linput_clear(linput* in) {
+    in->buffer[0] = '\0';
+    in->length = 0;
+    in->depth = 0;
+    in->broken = 0;
+}
+
+// appends a line and returns whether the buffer now holds complete forms; a
+// stray closing bracket or a character the grammar never accepts also
+// completes it, so the error is reported at once
+int linput_add(linput* in, char* line) {
+    long n = strlen(line);
+    if (in->length + n + 2 > in->slots) {
+        while (in->length + n + 2 > in->slots) {
+            in->slots *= 2;
         }
+        in->buffer = realloc(in->buffer, in->slots);
+    }
 
-        if (STR_EQ(operator, "min")) {
-            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-                L_DECIMAL(x) = L_DECIMAL(x) < L_DECIMAL(y)
-                    ? L_DECIMAL(x)
-                    : L_DECIMAL(y);
-            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-                L_DECIMAL(x) = L_DECIMAL(x) < L_INTEGER(y)
-                    ? L_DECIMAL(x)
-                    : (double)L_INTEGER(y);
-            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-                L_INTEGER(x) = L_INTEGER(x) < L_DECIMAL(y)
-                    ? L_INTEGER(x)
-                    : (int)L_DECIMAL(y);
-            } else {
-                L_INTEGER(x) = L_INTEGER(x) < L_INTEGER(y)
-                    ? L_INTEGER(x)
-                    : L_INTEGER(y);
-            }
+    for (long i = 0; i < n; i++) {
+        switch (line[i]) {
+            case '(':
+            case '{':
+                in->depth++;
+                break;
+            case ')':
+            case '}':
+                if (--in->depth < 0) { in->broken = 1; }
+                break;
+            case '.':
+                break;
+            default:
+                if (!strchr(" \f\n\r\t\v", line[i]) && !lreader_is_symbol(line[i])) {
+                    in->broken = 1;
+                }
         }
-        if (STR_EQ(operator, "max")) {
-            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-                L_DECIMAL(x) = L_DECIMAL(x) > L_DECIMAL(y)
-                    ? L_DECIMAL(x)
-                    : L_DECIMAL(y);
-            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-                L_DECIMAL(x) = L_DECIMAL(x) > L_INTEGER(y)
-                    ? L_DECIMAL(x)
-                    : (double)L_INTEGER(y);
-            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-                L_INTEGER(x) = L_INTEGER(x) > L_DECIMAL(y)
-                    ? L_INTEGER(x)
-                    : (int)L_DECIMAL(y);
-            } else {
-                L_INTEGER(x) = L_INTEGER(x) > L_INTEGER(y)
-                    ? L_INTEGER(x)
-                    : L_INTEGER(y);
-            }
+    }
+
+    // lines after the first are kept apart so rows in errors stay right
+    if (in->length) {
+        in->buffer[in->length++] = '\n';
+    }
+    memcpy(in->buffer + in->length, line, n + 1);
+    in->length += n;
+
+    return in->depth <= 0 || in->broken;
+}
+
+// `root` belongs to the interpreter from here on; the grammar tags have to
+// be interned by lval_read_tags before interpreters are made on several
+// threads, so building their parsers only reads mpc's tag table
+linterp* linterp_new(lenv* root, char* image) {
+    linterp* in = malloc(sizeof(linterp));
+    in->root = root;
+    in->grammar = NULL;
+    in->context = NULL;
+    in->arena = NULL;
+    in->print = lbuffer_new();
+    in->image = image;
+    in->calls = 0;
+    in->pool = NULL;
+    in->load_chunks = 0;
+    E_INTERP(root) = in;
+    lenv_sync_start(root);
+    return in;
+}
+
+void linterp_delete(linterp* in) {
+    // futures and fibers read the root, which stays if they could not be
+    // stopped
+    if (!in->pool || lpool_delete(in->pool)) {
+        lenv_delete(in->root);
+    }
+    if (in->grammar) {
+        lgrammar_delete(in->grammar);
+        mpc_context_delete(in->context);
+        mpc_ast_arena_delete(in->arena);
+    }
+    lbuffer_delete(in->print);
+    free(in);
+}
+
+// reads `input` with the reader, or with the mpc grammar, which is the
+// reference: it is used with `use_mpc` and to report the error when the
+// reader rejects the input; NULL after printing that error
+lval* linterp_read(linterp* in, char* input, int use_mpc) {
+    if (!use_mpc) {
+        lreader* reader = lreader_new(NULL, input);
+        lval* x = lreader_read_all(reader);
+        lreader_delete(reader);
+        if (x) {
+            return x;
         }
+    }
 
-        lval_delete(y);
+    if (!in->grammar) {
+        in->grammar = lgrammar_new();
+        // parse stacks are kept between inputs instead of rebuilt for each
+        // one, and the AST of an input only lives until it is read, so it
+        // goes into an arena that is cleared in one call
+        in->context = mpc_context_new();
+        in->arena = mpc_ast_arena_new();
+        mpc_context_arena(in->context, in->arena);
+    }
+
+    lval* x = NULL;
+    mpc_result_t r;
+    if (mpc_context_parse(in->context, "<stdin>", input, in->grammar->lispy, &r)) {
+        x = lval_read(r.output);
+    } else {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+    }
+    mpc_ast_arena_clear(in->arena);
+    return x;
+}
+
+lpool* lpool_new(int threads_num) {
+    lpool* pool = malloc(sizeof(lpool));
+    pool->threads_num = threads_num < 1 ? 1 : threads_num;
+    pool->threads = malloc(sizeof(pthread_t) * pool->threads_num);
+    pool->workers = malloc(sizeof(lpool_worker) * pool->threads_num);
+    pool->deques = malloc(sizeof(lpool_deque) * pool->threads_num);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->job = NULL;
+    pool->arg = NULL;
+    pool->generation = 0;
+    pool->remaining = 0;
+    pool->tasks = NULL;
+    pool->tasks_head = 0;
+    pool->tasks_num = 0;
+    pool->tasks_slots = 0;
+    pool->fibers_head = NULL;
+    pool->fibers_tail = NULL;
+    pool->sleeping = NULL;
+    pool->sleeping_num = 0;
+    pool->sleeping_slots = 0;
+    pool->parked = NULL;
+    pool->stop = 0;
+    pool->running = pool->threads_num - 1;
+
+    for (int i = 0; i < pool->threads_num; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].slots = 16;
+        pool->deques[i].ranges = malloc(sizeof(lpool_range) * pool->deques[i].slots);
+        pool->deques[i].top = 0;
+        pool->deques[i].bottom = 0;
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+    }
+    // thread 0 is whoever calls lpool_run
+    for (int i = 1; i < pool->threads_num; i++) {
+        pthread_create(&pool->threads[i], NULL, lpool_thread, &pool->workers[i]);
+    }
+    return pool;
+}
+
+// 0 if some thread is still busy after LPOOL_SHUTDOWN, evaluating something
+// that does not wait on a channel; the pool is left to it then, and so is
+// whatever it may be reading
+int lpool_delete(lpool* pool) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += LPOOL_SHUTDOWN / 1000;
+    deadline.tv_nsec += (LPOOL_SHUTDOWN % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    while (pool->running > 0) {
+        if (pthread_cond_timedwait(&pool->done, &pool->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int stuck = pool->running > 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->threads_num; i++) {
+        if (stuck) {
+            pthread_detach(pool->threads[i]);
+        } else {
+            pthread_join(pool->threads[i], NULL);
+        }
+    }
+    if (stuck) {
+        return 0;
+    }
+    // futures that never got a thread still run on deref
+    for (long i = pool->tasks_head; i < pool->tasks_num; i++) {
+        lfuture_release(pool->tasks[i]);
+    }
+    free(pool->tasks);
+    // fibers that were suspended lose whatever is on their stacks
+    while (pool->fibers_head) {
+        lfiber* fb = pool->fibers_head;
+        pool->fibers_head = fb->next;
+        lfiber_delete(fb);
+    }
+    for (int i = 0; i < pool->sleeping_num; i++) {
+        lfiber_delete(pool->sleeping[i]);
+    }
+    free(pool->sleeping);
+    while (pool->parked) {
+        lfiber* fb = pool->parked;
+        pool->parked = fb->next;
+        lfiber_delete(fb);
+    }
+    for (int i = 0; i < pool->threads_num; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].ranges);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->deques);
+    free(pool);
+    return 1;
+}
+
+void lpool_push(lpool_deque* d, long start, long end) {
+    pthread_mutex_lock(&d->lock);
+    if (d->top == d->bottom) {
+        d->top = d->bottom = 0;
+    }
+    if (d->bottom == d->slots) {
+        d->slots *= 2;
+        d->ranges = realloc(d->ranges, sizeof(lpool_range) * d->slots);
+    }
+    d->ranges[d->bottom].start = start;
+    d->ranges[d->bottom].end = end;
+    d->bottom++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+// the owner works from the bottom, most recently pushed first
+int lpool_pop(lpool_deque* d, lpool_range* range) {
+    pthread_mutex_lock(&d->lock);
+    int found = d->bottom > d->top;
+    if (found) {
+        *range = d->ranges[--d->bottom];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+// thieves take from the top, away from the owner
+int lpool_steal(lpool_deque* d, lpool_range* range) {
+    pthread_mutex_lock(&d->lock);
+    int found = d->bottom > d->top;
+    if (found) {
+        *range = d->ranges[d->top++];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+// runs ranges until there are none left in any deque
+void lpool_work(lpool* pool, int id) {
+    while (1) {
+        lpool_range range;
+        int found = lpool_pop(&pool->deques[id], &range);
+        for (int k = 1; !found && k < pool->threads_num; k++) {
+            found = lpool_steal(&pool->deques[(id + k) % pool->threads_num], &range);
+        }
+        if (!found) {
+            return;
+        }
+
+        // the job was set before its ranges were pushed, and taking one went
+        // through the lock of its deque
+        pool->job(pool->arg, range.start, range.end);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->remaining -= range.end - range.start;
+        if (pool->remaining == 0) {
+            pthread_cond_broadcast(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// the pool of the thread, if it is one of a pool's threads
+static LTHREAD_LOCAL lpool* lpool_current = NULL;
+
+void* lpool_thread(void* arg) {
+    lpool_worker* worker = arg;
+    lpool* pool = worker->pool;
+    long seen = 0;
+    lpool_current = pool;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        lfiber* fb = NULL;
+        while (!pool->stop && pool->generation == seen
+               && pool->tasks_head == pool->tasks_num) {
+            struct timespec wait;
+            fb = lpool_next_fiber(pool, &wait);
+            if (fb) {
+                break;
+            }
+            if (pool->sleeping_num) {
+                pthread_cond_timedwait(&pool->wake, &pool->lock, &wait);
+            } else {
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            }
+        }
+        if (pool->stop) {
+            // deleted with the pool, once nothing can be waking it any more
+            if (fb) {
+                fb->next = pool->fibers_head;
+                pool->fibers_head = fb;
+                if (!pool->fibers_tail) {
+                    pool->fibers_tail = fb;
+                }
+            }
+            pool->running--;
+            pthread_cond_broadcast(&pool->done);
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        // a job comes before futures and fibers, its caller is waiting for it
+        if (!fb && pool->generation != seen) {
+            seen = pool->generation;
+            pthread_mutex_unlock(&pool->lock);
+            lpool_work(pool, worker->id);
+            continue;
+        }
+
+        if (!fb) {
+            lfuture* f = pool->tasks[pool->tasks_head++];
+            pthread_mutex_unlock(&pool->lock);
+            lfuture_run(f);
+            lfuture_release(f);
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        lpool_resume(pool, fb);
+    }
+}
+
+// calls `job` over ranges covering 0 to `count` and returns once all of
+// them are done; only one job runs on a pool at a time
+void lpool_run(lpool* pool, lpool_job job, void* arg, long count) {
+    if (count == 0) {
+        return;
+    }
+    // a thread still in lpool_work from the previous job may take a range as
+    // soon as it is pushed, so everything it counts down is set first
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->arg = arg;
+    pool->remaining = count;
+    pthread_mutex_unlock(&pool->lock);
+
+    // a few ranges per thread, so that stealing can even out uneven items
+    long chunk = count / (pool->threads_num * 4);
+    if (chunk < 1) {
+        chunk = 1;
+    }
+    int i = 0;
+    for (long start = 0; start < count; start += chunk) {
+        long end = start + chunk < count ? start + chunk : count;
+        lpool_push(&pool->deques[i], start, end);
+        i = (i + 1) % pool->threads_num;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    lpool_work(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->remaining > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// each range gets an env of its own below the caller's, without an
+// interpreter, so that nothing in the interpreter is touched from two
+// threads and a nested pmap runs in place. `def` from the function stops
+// in it, so the caller's env is only read meanwhile
+void lpmap_run(void* arg, long start, long end) {
+    lpmap* m = arg;
+    lenv* local = lenv_new();
+    E_PARENT(local) = m->env;
+    E_BOUNDARY(local) = 1;
+
+    for (long i = start; i < end; i++) {
+        // calling a lambda binds its formals, so each call gets a copy
+        lval* f = lval_copy(m->func);
+        lval* x = lval_add(lval_sexpression(), lval_copy(L_CELL_N(m->items, i)));
+        m->results[i] = lval_call(local, f, x);
+        lval_delete(f);
+    }
+    lenv_delete(local);
+}
+
+// one thread per CPU, but at least one besides the caller's so futures and
+// fibers make progress on their own
+lpool* linterp_pool(linterp* in) {
+    if (!in->pool) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        in->pool = lpool_new(n < 2 ? 2 : n);
+    }
+    return in->pool;
+}
+
+// takes `env` and `expr`
+lfuture* lfuture_new(lenv* env, lval* expr) {
+    lfuture* f = malloc(sizeof(lfuture));
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->done, NULL);
+    f->refs = 1;
+    f->state = LFUTURE_PENDING;
+    f->env = env;
+    f->expr = expr;
+    f->result = NULL;
+    f->pool = NULL;
+    return f;
+}
+
+void lfuture_retain(lfuture* f) {
+    pthread_mutex_lock(&f->lock);
+    f->refs++;
+    pthread_mutex_unlock(&f->lock);
+}
+
+void lfuture_release(lfuture* f) {
+    pthread_mutex_lock(&f->lock);
+    int refs = --f->refs;
+    pthread_mutex_unlock(&f->lock);
+    if (refs > 0) {
+        return;
+    }
+
+    // the last reference cannot be the one of a thread running it
+    if (f->expr) {
+        lval_delete(f->expr);
+    }
+    if (f->env) {
+        lenv_delete(f->env);
+    }
+    if (f->result) {
+        lval_delete(f->result);
+    }
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->done);
+    free(f);
+}
+
+// evaluates `f` unless someone else has claimed it already
+void lfuture_run(lfuture* f) {
+    pthread_mutex_lock(&f->lock);
+    if (f->state != LFUTURE_PENDING) {
+        pthread_mutex_unlock(&f->lock);
+        return;
+    }
+    f->state = LFUTURE_RUNNING;
+    pthread_mutex_unlock(&f->lock);
+
+    lval* x = lval_eval(f->env, f->expr);
+    lenv_delete(f->env);
+
+    pthread_mutex_lock(&f->lock);
+    f->expr = NULL;
+    f->env = NULL;
+    f->result = x;
+    f->state = LFUTURE_DONE;
+    pthread_cond_broadcast(&f->done);
+    pthread_mutex_unlock(&f->lock);
+}
+
+// the fiber running on this thread, if any
+static LTHREAD_LOCAL lfiber* lfiber_current = NULL;
+
+// the result of `f`, evaluated here if no thread has started on it yet;
+// nothing waiting for a fiber may block a thread that could be running it,
+// so a fiber keeps yielding and any other thread runs fibers meanwhile
+lval* lfuture_wait(lfuture* f) {
+    lfuture_run(f);
+
+    lfiber* fb = lfiber_current;
+    pthread_mutex_lock(&f->lock);
+    while (f->state != LFUTURE_DONE) {
+        pthread_mutex_unlock(&f->lock);
+        if (fb) {
+            lfiber_suspend(fb);
+        } else if (f->pool) {
+            lpool_help(f->pool);
+        } else {
+            pthread_mutex_lock(&f->lock);
+            while (f->state != LFUTURE_DONE) {
+                pthread_cond_wait(&f->done, &f->lock);
+            }
+            pthread_mutex_unlock(&f->lock);
+        }
+        pthread_mutex_lock(&f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return f->result;
+}
+
+// a pool without threads of its own leaves `f` to deref
+void lpool_submit(lpool* pool, lfuture* f) {
+    if (pool->threads_num < 2) {
+        return;
+    }
+
+    lfuture_retain(f);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tasks_head == pool->tasks_num) {
+        pool->tasks_head = pool->tasks_num = 0;
+    }
+    if (pool->tasks_num == pool->tasks_slots) {
+        pool->tasks_slots = pool->tasks_slots ? pool->tasks_slots * 2 : 16;
+        pool->tasks = realloc(pool->tasks, sizeof(lfuture*) * pool->tasks_slots);
+    }
+    pool->tasks[pool->tasks_num++] = f;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// one env with a copy of everything visible from `env`, nearest first, so
+// that a future does not read envs that keep changing meanwhile; the copy
+// stops at the root, which is safe to read from any thread and becomes its
+// parent
+lenv* lenv_flatten(lenv* env) {
+    lenv* flat = lenv_new();
+    for (; env; env = E_PARENT(env)) {
+        if (E_SYNC(env)) {
+            E_PARENT(flat) = env;
+            break;
+        }
+        lenv_reader* r = lenv_enter(env);
+        E_FOREACH(i, env) {
+            int found = 0;
+            E_FOREACH(j, flat) {
+                if (STR_EQ(E_NAMES_N(flat, j), E_NAMES_N(env, i))) {
+                    found = 1;
+                    break;
+                }
+            }
+            if (!found) {
+                lval* key = lval_symbol(E_NAMES_N(env, i));
+                lenv_put(flat, key, E_VALUES_N(env, i));
+                lval_delete(key);
+            }
+        }
+        lenv_leave(r);
+    }
+    return flat;
+}
+
+// takes a reference to `future`; the stack is mapped with a guard page below
+// it, so running out of it faults instead of overwriting other memory
+lfiber* lfiber_new(lpool* pool, lfuture* future) {
+    long page = sysconf(_SC_PAGESIZE);
+    char* stack = mmap(NULL, LFIBER_STACK + page, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED) {
+        return NULL;
+    }
+    mprotect(stack, page, PROT_NONE);
+
+    lfiber* fb = malloc(sizeof(lfiber));
+    getcontext(&fb->context);
+    fb->context.uc_stack.ss_sp = stack + page;
+    fb->context.uc_stack.ss_size = LFIBER_STACK;
+    fb->context.uc_link = NULL;
+    makecontext(&fb->context, lfiber_main, 0);
+    fb->back = NULL;
+    fb->stack = stack;
+    fb->future = future;
+    fb->pool = pool;
+    fb->finished = 0;
+    fb->sleeping = 0;
+    fb->waiter = NULL;
+    fb->next = NULL;
+    fb->prev = NULL;
+    return fb;
+}
+
+void lfiber_delete(lfiber* fb) {
+    // still on the lists of the channels it was waiting on
+    if (fb->waiter) {
+        lchan_unwait(fb->waiter);
+    }
+    munmap(fb->stack, LFIBER_STACK + sysconf(_SC_PAGESIZE));
+    lfuture_release(fb->future);
+    free(fb);
+}
+
+// makecontext cannot pass a pointer portably, the fiber is taken from
+// lfiber_current before anything else runs on the new stack
+void lfiber_main(void) {
+    lfiber* fb = lfiber_current;
+    lfuture_run(fb->future);
+    fb->finished = 1;
+    setcontext(fb->back);
+}
+
+// back to the thread that resumed `fb`; this may return on another thread,
+// so nothing thread local is read after it
+void lfiber_suspend(lfiber* fb) {
+    swapcontext(&fb->context, fb->back);
+}
+
+void lfiber_resume(lfiber* fb) {
+    ucontext_t back;
+    fb->back = &back;
+    lfiber_current = fb;
+    swapcontext(&back, &fb->context);
+    lfiber_current = NULL;
+}
+
+// queues a fiber that was just made or has been suspended
+void lpool_schedule(lpool* pool, lfiber* fb) {
+    pthread_mutex_lock(&pool->lock);
+    if (fb->sleeping) {
+        lpool_sleeping_push(pool, fb);
+    } else {
+        fb->next = NULL;
+        if (pool->fibers_tail) {
+            pool->fibers_tail->next = fb;
+        } else {
+            pool->fibers_head = fb;
+        }
+        pool->fibers_tail = fb;
+    }
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// runs `fb` until it is suspended, and puts it wherever it goes next: a
+// fiber that has started waiting on channels is parked unless it has been
+// woken meanwhile, see lchan_wait
+void lpool_resume(lpool* pool, lfiber* fb) {
+    lfiber_resume(fb);
+    if (fb->finished) {
+        lfiber_delete(fb);
+        return;
+    }
+    if (fb->waiter) {
+        pthread_mutex_lock(&pool->lock);
+        int state = LCHAN_WAITING;
+        if (__atomic_compare_exchange_n(&fb->waiter->state, &state, LCHAN_PARKED, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            fb->prev = NULL;
+            fb->next = pool->parked;
+            if (pool->parked) {
+                pool->parked->prev = fb;
+            }
+            pool->parked = fb;
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    lpool_schedule(pool, fb);
+}
+
+// queues a parked fiber again, for whoever moved its state to LCHAN_WOKEN
+void lpool_unpark(lpool* pool, lfiber* fb) {
+    pthread_mutex_lock(&pool->lock);
+    if (fb->prev) {
+        fb->prev->next = fb->next;
+    } else {
+        pool->parked = fb->next;
+    }
+    if (fb->next) {
+        fb->next->prev = fb->prev;
+    }
+    fb->prev = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    lpool_schedule(pool, fb);
+}
+
+int ltimespec_before(struct timespec* a, struct timespec* b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// with the pool locked: adds a sleeping fiber to the heap
+void lpool_sleeping_push(lpool* pool, lfiber* fb) {
+    if (pool->sleeping_num == pool->sleeping_slots) {
+        pool->sleeping_slots = pool->sleeping_slots ? pool->sleeping_slots * 2 : 16;
+        pool->sleeping = realloc(pool->sleeping, sizeof(lfiber*) * pool->sleeping_slots);
+    }
+    int i = pool->sleeping_num++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!ltimespec_before(&fb->wake, &pool->sleeping[parent]->wake)) {
+            break;
+        }
+        pool->sleeping[i] = pool->sleeping[parent];
+        i = parent;
+    }
+    pool->sleeping[i] = fb;
+}
+
+// with the pool locked: takes the fiber that wakes first out of the heap
+lfiber* lpool_sleeping_pop(lpool* pool) {
+    lfiber* first = pool->sleeping[0];
+    lfiber* last = pool->sleeping[--pool->sleeping_num];
+    int n = pool->sleeping_num;
+    int i = 0;
+    while (2 * i + 1 < n) {
+        int child = 2 * i + 1;
+        if (child + 1 < n
+            && ltimespec_before(&pool->sleeping[child + 1]->wake, &pool->sleeping[child]->wake)) {
+            child++;
+        }
+        if (!ltimespec_before(&pool->sleeping[child]->wake, &last->wake)) {
+            break;
+        }
+        pool->sleeping[i] = pool->sleeping[child];
+        i = child;
+    }
+    if (n > 0) {
+        pool->sleeping[i] = last;
+    }
+    first->sleeping = 0;
+    return first;
+}
+
+// with the pool locked: a fiber whose sleep is over, else the oldest ready
+// one; when there is none, `wait` is set to the earliest wake up
+lfiber* lpool_next_fiber(lpool* pool, struct timespec* wait) {
+    if (pool->sleeping_num) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (!ltimespec_before(&now, &pool->sleeping[0]->wake)) {
+            return lpool_sleeping_pop(pool);
+        }
+    }
+
+    if (pool->fibers_head) {
+        lfiber* fb = pool->fibers_head;
+        pool->fibers_head = fb->next;
+        if (!pool->fibers_head) {
+            pool->fibers_tail = NULL;
+        }
+        return fb;
+    }
+    if (pool->sleeping_num) {
+        *wait = pool->sleeping[0]->wake;
+    }
+    return NULL;
+}
+
+// runs one fiber that is ready, or waits a little for one to be; the
+// caller checks again for whatever it is waiting on afterwards
+void lpool_help(lpool* pool) {
+    struct timespec wait;
+    clock_gettime(CLOCK_REALTIME, &wait);
+    wait.tv_nsec += 1000000;
+    if (wait.tv_nsec >= 1000000000) {
+        wait.tv_sec++;
+        wait.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    struct timespec wake = wait;
+    lfiber* fb = lpool_next_fiber(pool, &wake);
+    if (!fb) {
+        if (ltimespec_before(&wake, &wait)) {
+            wait = wake;
+        }
+        pthread_cond_timedwait(&pool->wake, &pool->lock, &wait);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (fb) {
+        lpool_resume(pool, fb);
+    }
+}
+
+// `capacity` is at most LCHAN_MAX_CAPACITY; NULL if the cells of a bounded
+// channel can't be allocated
+lchan* lchan_new(long capacity) {
+    lchan* c = malloc(sizeof(lchan));
+    c->refs = 1;
+    c->bounded = capacity > 0;
+    c->head = 0;
+    c->tail = 0;
+    c->cells = NULL;
+    c->mask = 0;
+    if (c->bounded) {
+        // with a single cell, a full one would look free to the next lap
+        unsigned long n = 2;
+        while (n < (unsigned long)capacity) {
+            n <<= 1;
+        }
+        c->mask = n - 1;
+        c->cells = malloc(sizeof(lchan_cell) * n);
+        if (!c->cells) {
+            free(c);
+            return NULL;
+        }
+        for (unsigned long i = 0; i < n; i++) {
+            c->cells[i].seq = i;
+            c->cells[i].value = NULL;
+        }
+    }
+    c->head_block = NULL;
+    c->tail_block = NULL;
+    if (!c->bounded) {
+        c->head_block = c->tail_block = calloc(1, sizeof(lchan_block));
+    }
+    c->waiting = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    c->waiters = NULL;
+    return c;
+}
+
+void lchan_retain(lchan* c) {
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+// values still in the channel go with it; an actor waiting to be the only
+// one left with its mailbox is woken when it is
+void lchan_release(lchan* c) {
+    int refs = __atomic_sub_fetch(&c->refs, 1, __ATOMIC_SEQ_CST);
+    if (refs == 1) {
+        lchan_notify(c);
+    }
+    if (refs > 0) {
+        return;
+    }
+
+    lval* v;
+    while ((v = lchan_try_recv(c))) {
+        lval_delete(v);
+    }
+    free(c->cells);
+    // all that is left of the list once it is empty
+    free(c->tail_block);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+// takes `v` if there is room for it
+int lchan_try_send(lchan* c, lval* v) {
+    if (!c->bounded) {
+        lchan_push(c, v);
+        lchan_notify(c);
+        return 1;
+    }
+
+    unsigned long pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+    lchan_cell* cell;
+    while (1) {
+        cell = &c->cells[pos & c->mask];
+        long turn = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (turn == 0) {
+            if (__atomic_compare_exchange_n(&c->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (turn < 0) {
+            // the cell still holds the value sent a lap ago
+            return 0;
+        } else {
+            pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+        }
+    }
+    cell->value = v;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    lchan_notify(c);
+    return 1;
+}
+
+// the oldest value in the channel, or NULL if it is empty
+lval* lchan_try_recv(lchan* c) {
+    if (!c->bounded) {
+        return lchan_pop(c);
+    }
+
+    unsigned long pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+    lchan_cell* cell;
+    while (1) {
+        cell = &c->cells[pos & c->mask];
+        long turn = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (turn == 0) {
+            if (__atomic_compare_exchange_n(&c->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (turn < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+        }
+    }
+    lval* v = cell->value;
+    __atomic_store_n(&cell->seq, pos + c->mask + 1, __ATOMIC_RELEASE);
+    // a sender may be waiting for the room
+    lchan_notify(c);
+    return v;
+}
+
+// adds `v` to an unbounded channel; the sender that takes the last slot of
+// a block links in the next one, which it has allocated beforehand
+void lchan_push(lchan* c, lval* v) {
+    lchan_block* next = NULL;
+    unsigned long pos = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    lchan_block* block = __atomic_load_n(&c->head_block, __ATOMIC_ACQUIRE);
+    while (1) {
+        unsigned long offset = pos % (LCHAN_BLOCK + 1);
+        if (offset == LCHAN_BLOCK) {
+            // the next block is being linked in
+            sched_yield();
+            pos = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+            block = __atomic_load_n(&c->head_block, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if (offset + 1 == LCHAN_BLOCK && !next) {
+            next = calloc(1, sizeof(lchan_block));
+        }
+        // `block` was read after `pos`, so it is the block of `pos` if the
+        // CAS succeeds
+        if (__atomic_compare_exchange_n(&c->head, &pos, pos + 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        block = __atomic_load_n(&c->head_block, __ATOMIC_ACQUIRE);
+    }
+
+    unsigned long offset = pos % (LCHAN_BLOCK + 1);
+    if (offset + 1 == LCHAN_BLOCK) {
+        __atomic_store_n(&c->head_block, next, __ATOMIC_RELEASE);
+        __atomic_store_n(&c->head, pos + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&block->next, next, __ATOMIC_RELEASE);
+    } else {
+        free(next);
+    }
+    lchan_slot* slot = &block->slots[offset];
+    slot->value = v;
+    __atomic_fetch_or(&slot->state, LCHAN_WRITTEN, __ATOMIC_RELEASE);
+}
+
+// the oldest value of an unbounded channel, or NULL if it is empty; a
+// position that was claimed but not written yet is waited for
+lval* lchan_pop(lchan* c) {
+    unsigned long pos = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+    lchan_block* block = __atomic_load_n(&c->tail_block, __ATOMIC_ACQUIRE);
+    while (1) {
+        unsigned long offset = pos % (LCHAN_BLOCK + 1);
+        if (offset == LCHAN_BLOCK) {
+            sched_yield();
+            pos = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+            block = __atomic_load_n(&c->tail_block, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (pos == __atomic_load_n(&c->head, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&c->tail, &pos, pos + 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        block = __atomic_load_n(&c->tail_block, __ATOMIC_ACQUIRE);
+    }
+
+    unsigned long offset = pos % (LCHAN_BLOCK + 1);
+    if (offset + 1 == LCHAN_BLOCK) {
+        lchan_block* next;
+        while (!(next = __atomic_load_n(&block->next, __ATOMIC_ACQUIRE))) {
+            sched_yield();
+        }
+        __atomic_store_n(&c->tail_block, next, __ATOMIC_RELEASE);
+        __atomic_store_n(&c->tail, pos + 2, __ATOMIC_RELEASE);
+    }
+    lchan_slot* slot = &block->slots[offset];
+    while (!(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) & LCHAN_WRITTEN)) {
+        sched_yield();
+    }
+    lval* v = slot->value;
+
+    // receivers may still be reading earlier slots, the last of them frees
+    // the block
+    if (offset + 1 == LCHAN_BLOCK) {
+        lchan_block_free(block, 0);
+    } else if (__atomic_fetch_or(&slot->state, LCHAN_READ, __ATOMIC_ACQ_REL) & LCHAN_DESTROY) {
+        lchan_block_free(block, offset + 1);
+    }
+    return v;
+}
+
+// frees `block` unless a slot from `start` on is still being read, in which
+// case it is marked so that its receiver carries on from there
+void lchan_block_free(lchan_block* block, int start) {
+    for (int i = start; i < LCHAN_BLOCK - 1; i++) {
+        lchan_slot* slot = &block->slots[i];
+        if (!(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) & LCHAN_READ)
+            && !(__atomic_fetch_or(&slot->state, LCHAN_DESTROY, __ATOMIC_ACQ_REL) & LCHAN_READ)) {
+            return;
+        }
+    }
+    free(block);
+}
+
+// whether `c` is ready for a wait of `mode`, which may already have been
+// taken by someone else; a value that is only being sent or received
+// counts as there
+int lchan_ready(lchan* c, int mode) {
+    if (mode == LCHAN_SEND) {
+        if (!c->bounded) {
+            return 1;
+        }
+        unsigned long pos = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+        unsigned long seq = __atomic_load_n(&c->cells[pos & c->mask].seq, __ATOMIC_ACQUIRE);
+        return (long)(seq - pos) >= 0;
+    }
+
+    unsigned long pos = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+    int empty;
+    if (c->bounded) {
+        unsigned long seq = __atomic_load_n(&c->cells[pos & c->mask].seq, __ATOMIC_ACQUIRE);
+        empty = (long)(seq - (pos + 1)) < 0;
+    } else {
+        empty = pos == __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    }
+    return !empty || (mode == LCHAN_ALONE && __atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) == 1);
+}
+
+// wakes everyone waiting on `c` after it was changed. A waiter counts
+// itself in `waiting` before it looks at the channel and the change is made
+// before `waiting` is read, so either the waiter sees the change or it is
+// on the list by the time that is taken
+void lchan_notify(lchan* c) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&c->waiting, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    // a waiter takes itself off the list under the lock, so none of them
+    // goes away meanwhile
+    for (lchan_link* l = c->waiters; l; l = l->next) {
+        lchan_wake(l->waiter);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void lchan_wake(lchan_waiter* w) {
+    if (!w->fiber) {
+        pthread_mutex_t* lock = w->pool ? &w->pool->lock : &w->lock;
+        pthread_cond_t* cond = w->pool ? &w->pool->wake : &w->woken;
+        pthread_mutex_lock(lock);
+        __atomic_store_n(&w->state, LCHAN_WOKEN, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(cond);
+        pthread_mutex_unlock(lock);
+        return;
+    }
+
+    // a fiber that is not parked yet is queued by lpool_resume instead
+    int state = __atomic_load_n(&w->state, __ATOMIC_ACQUIRE);
+    while (state != LCHAN_WOKEN) {
+        if (__atomic_compare_exchange_n(&w->state, &state, LCHAN_WOKEN, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (state == LCHAN_PARKED) {
+                lpool_unpark(w->fiber->pool, w->fiber);
+            }
+            return;
+        }
+    }
+}
+
+// takes the waiter off the lists of its channels
+void lchan_unwait(lchan_waiter* w) {
+    for (int i = 0; i < w->links_num; i++) {
+        lchan_link* l = &w->links[i];
+        lchan* c = l->channel;
+        pthread_mutex_lock(&c->lock);
+        if (l->prev) {
+            l->prev->next = l->next;
+        } else {
+            c->waiters = l->next;
+        }
+        if (l->next) {
+            l->next->prev = l->prev;
+        }
+        __atomic_sub_fetch(&c->waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&c->lock);
+    }
+    if (w->links_num > 1) {
+        free(w->links);
+    }
+}
+
+// one round of waiting until one of the `n` channels `cs` is ready for
+// `mode`: the first rounds only yield, then the waiter goes on the lists of
+// the channels and is woken by the next change to any of them. A fiber is
+// parked meanwhile, and a thread runs fibers of `pool`, whose threads may
+// all be waiting on the same channel. 0 once `pool` is being deleted, as
+// nothing may be left to send or receive
+int lchan_wait(lpool* pool, lchan** cs, int n, int mode, int* spins) {
+    if (pool && __atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    lfiber* fb = lfiber_current;
+    if (*spins < 100) {
+        (*spins)++;
+        if (fb) {
+            lfiber_suspend(fb);
+        } else {
+            sched_yield();
+        }
+        return 1;
+    }
+
+    lchan_link link;
+    lchan_waiter w;
+    w.state = LCHAN_WAITING;
+    w.fiber = fb;
+    w.pool = fb ? fb->pool : pool;
+    w.links = n > 1 ? malloc(sizeof(lchan_link) * n) : &link;
+    w.links_num = n;
+    if (!w.fiber && !w.pool) {
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_cond_init(&w.woken, NULL);
+    }
+    for (int i = 0; i < n; i++) {
+        lchan_link* l = &w.links[i];
+        lchan* c = cs[i];
+        l->channel = c;
+        l->waiter = &w;
+        l->prev = NULL;
+        pthread_mutex_lock(&c->lock);
+        l->next = c->waiters;
+        if (l->next) {
+            l->next->prev = l;
+        }
+        c->waiters = l;
+        __atomic_add_fetch(&c->waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&c->lock);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    int ready = 0;
+    for (int i = 0; i < n && !ready; i++) {
+        ready = lchan_ready(cs[i], mode);
+    }
+
+    lfiber* next = NULL;
+    if (!ready && fb) {
+        fb->waiter = &w;
+        lfiber_suspend(fb);
+    } else if (!ready && w.pool) {
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&w.state, __ATOMIC_ACQUIRE) != LCHAN_WOKEN && !pool->stop) {
+            struct timespec wait;
+            next = lpool_next_fiber(pool, &wait);
+            if (next) {
+                break;
+            }
+            if (pool->sleeping_num) {
+                pthread_cond_timedwait(&pool->wake, &pool->lock, &wait);
+            } else {
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+    } else if (!ready) {
+        pthread_mutex_lock(&w.lock);
+        while (__atomic_load_n(&w.state, __ATOMIC_ACQUIRE) != LCHAN_WOKEN) {
+            pthread_cond_wait(&w.woken, &w.lock);
+        }
+        pthread_mutex_unlock(&w.lock);
+    }
+
+    lchan_unwait(&w);
+    if (fb) {
+        fb->waiter = NULL;
+    }
+    if (!w.fiber && !w.pool) {
+        pthread_mutex_destroy(&w.lock);
+        pthread_cond_destroy(&w.woken);
+    }
+    if (next) {
+        lpool_resume(pool, next);
+    }
+    return 1;
+}
+
+// the pool whose fibers may be the ones to unblock a wait in `env`
+lpool* lchan_pool(lenv* env) {
+    if (lfiber_current) {
+        return lfiber_current->pool;
+    }
+    if (E_INTERP(env) && E_INTERP(env)->pool) {
+        return E_INTERP(env)->pool;
+    }
+    return lpool_current;
+}
+
+// takes `v`
+latom* latom_new(lval* v) {
+    latom* t = malloc(sizeof(latom));
+    t->refs = 1;
+    t->readers = 0;
+    t->cell = malloc(sizeof(latom_cell));
+    t->cell->value = v;
+    t->cell->version = 0;
+    t->cell->next = NULL;
+    t->retired = NULL;
+    return t;
+}
+
+void latom_retain(latom* t) {
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+}
+
+void latom_release(latom* t) {
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    // nobody is left to be reading it
+    latom_retire(t, t->cell);
+    latom_cell* cell = t->retired;
+    while (cell) {
+        latom_cell* next = cell->next;
+        lval_delete(cell->value);
+        free(cell);
+        cell = next;
+    }
+    free(t);
+}
+
+// the current cell, which stays valid until latom_leave
+latom_cell* latom_enter(latom* t) {
+    __atomic_add_fetch(&t->readers, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&t->cell, __ATOMIC_SEQ_CST);
+}
+
+// frees the retired cells if no reader is left that could still be on one;
+// the list is taken before the readers are counted, and a reader coming in
+// later can only find a cell that is not on it
+void latom_leave(latom* t) {
+    if (__atomic_sub_fetch(&t->readers, 1, __ATOMIC_SEQ_CST) > 0
+        || !__atomic_load_n(&t->retired, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    latom_cell* cell = __atomic_exchange_n(&t->retired, NULL, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&t->readers, __ATOMIC_SEQ_CST) > 0) {
+        // somebody else frees them later
+        while (cell) {
+            latom_cell* next = cell->next;
+            latom_retire(t, cell);
+            cell = next;
+        }
+        return;
+    }
+    while (cell) {
+        latom_cell* next = cell->next;
+        lval_delete(cell->value);
+        free(cell);
+        cell = next;
+    }
+}
+
+void latom_retire(latom* t, latom_cell* cell) {
+    cell->next = __atomic_load_n(&t->retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&t->retired, &cell->next, cell, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    }
+}
+
+// takes `v`, and puts it in place of `old` unless that was replaced first;
+// the caller is in between latom_enter and latom_leave, so `old` cannot
+// have been freed and its address used again
+int latom_replace(latom* t, latom_cell* old, lval* v) {
+    latom_cell* cell = malloc(sizeof(latom_cell));
+    cell->value = v;
+    cell->version = old->version + 1;
+    cell->next = NULL;
+    if (!__atomic_compare_exchange_n(&t->cell, &old, cell, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        lval_delete(v);
+        free(cell);
+        return 0;
+    }
+    latom_retire(t, old);
+    return 1;
+}
+
+
+lbuffer* lbuffer_new(void) {
+    lbuffer* b = malloc(sizeof(lbuffer));
+    b->slots = 4096;
+    b->data = malloc(b->slots);
+    b->length = 0;
+    b->frames_slots = 64;
+    b->frames = malloc(sizeof(lprint_frame) * b->frames_slots);
+    b->frames_num = 0;
+    return b;
+}
+
+void lbuffer_delete(lbuffer* b) {
+    free(b->data);
+    free(b->frames);
+    free(b);
+}
+
+// room for `n` more bytes
+void lbuffer_reserve(lbuffer* b, long n) {
+    if (b->length + n > b->slots) {
+        while (b->length + n > b->slots) {
+            b->slots *= 2;
+        }
+        b->data = realloc(b->data, b->slots);
+    }
+}
+
+void lbuffer_put(lbuffer* b, char* s, long n) {
+    lbuffer_reserve(b, n);
+    memcpy(b->data + b->length, s, n);
+    b->length += n;
+}
+
+void lbuffer_putc(lbuffer* b, char c) {
+    if (b->length == b->slots) {
+        lbuffer_reserve(b, 1);
+    }
+    b->data[b->length++] = c;
+}
+
+void lbuffer_puts(lbuffer* b, char* s) {
+    lbuffer_put(b, s, strlen(s));
+}
+
+// quoted, with the escapes mpcf_escape uses
+void lval_write_string(lbuffer* b, lval* v) {
+    static const char input[] = "\a\b\f\n\r\t\v\\\'\"";
+    static const char output[] = "abfnrtv\\\'\"";
+
+    lbuffer_putc(b, '"');
+    for (long i = 0; i < L_COUNT(v); i++) {
+        char c = L_STRING(v)[i];
+        char* e = c ? strchr(input, c) : NULL;
+        if (c == '\0' || e) {
+            lbuffer_putc(b, '\\');
+            lbuffer_putc(b, c ? output[e - input] : '0');
+        } else {
+            lbuffer_putc(b, c);
+        }
+    }
+    lbuffer_putc(b, '"');
+}
+
+// builtins are printed by the names they have in the nearest env that
+// has them
+void lval_write_builtin(lenv* env, lbuffer* b, lval* v) {
+    for (; env; env = E_PARENT(env)) {
+        int found = 0;
+        lenv_reader* r = lenv_enter(env);
+        E_FOREACH(i, env) {
+            if (L_BUILTIN(E_VALUES_N(env, i)) == L_BUILTIN(v)) {
+                lbuffer_puts(b, "<builtin function '");
+                lbuffer_puts(b, E_NAMES_N(env, i));
+                lbuffer_puts(b, "'>");
+                found = 1;
+            }
+        }
+        lenv_leave(r);
+        if (found) {
+            return;
+        }
+    }
+}
+
+// returns 0 for values with children, which lval_write walks itself
+int lval_write_atom(lenv* env, lbuffer* b, lval* v) {
+    switch (L_TYPE(v)) {
+        case LVAL_STRING:
+            lval_write_string(b, v);
+            return 1;
+        case LVAL_BOOLEAN:
+            lbuffer_puts(b, L_INTEGER(v) == 0 ? "false" : "true");
+            return 1;
+        case LVAL_INTEGER: {
+            // digits are produced backwards, which is cheaper than sprintf
+            char digits[24];
+            int n = sizeof(digits);
+            unsigned long x = L_INTEGER(v) < 0 ? -(unsigned long) L_INTEGER(v) : L_INTEGER(v);
+            do {
+                digits[--n] = '0' + x % 10;
+                x /= 10;
+            } while (x);
+            if (L_INTEGER(v) < 0) {
+                digits[--n] = '-';
+            }
+            lbuffer_put(b, digits + n, sizeof(digits) - n);
+            return 1;
+        }
+        case LVAL_DECIMAL: {
+            // %f of a large number can be long
+            int n = snprintf(NULL, 0, "%f", L_DECIMAL(v));
+            lbuffer_reserve(b, n + 1);
+            b->length += sprintf(b->data + b->length, "%f", L_DECIMAL(v));
+            return 1;
+        }
+        case LVAL_SYMBOL:
+            lbuffer_puts(b, L_SYMBOL(v));
+            return 1;
+        case LVAL_FUTURE:
+            lbuffer_puts(b, "<future>");
+            return 1;
+        case LVAL_CHANNEL:
+            lbuffer_puts(b, "<channel>");
+            return 1;
+        case LVAL_ATOM:
+            lbuffer_puts(b, "<atom>");
+            return 1;
+        case LVAL_ERROR:
+            lbuffer_puts(b, "Error: ");
+            lbuffer_puts(b, L_ERROR(v));
+            return 1;
+        case LVAL_FUNCTION:
+            if (L_BUILTIN(v)) {
+                lval_write_builtin(env, b, v);
+                return 1;
+            }
+            return 0;
+        case LVAL_SEXPRESSION:
+        case LVAL_QEXPRESSION:
+            return 0;
+        default:
+            lbuffer_reserve(b, 64);
+            b->length += sprintf(b->data + b->length, "Error: Unknown value type %d", L_TYPE(v));
+            return 1;
+    }
+}
+
+// appends `v` to `b` without recursing, so deeply nested values cannot
+// run out of C stack
+void lval_write(lenv* env, lbuffer* b, lval* v) {
+    int base = b->frames_num;
+
+    while (1) {
+        if (v && !lval_write_atom(env, b, v)) {
+            if (b->frames_num == b->frames_slots) {
+                b->frames_slots *= 2;
+                b->frames = realloc(b->frames, sizeof(lprint_frame) * b->frames_slots);
+            }
+            b->frames[b->frames_num].value = v;
+            b->frames[b->frames_num].next = 0;
+            b->frames_num++;
+
+            switch (L_TYPE(v)) {
+                case LVAL_SEXPRESSION:
+                    lbuffer_putc(b, '(');
+                    break;
+                case LVAL_QEXPRESSION:
+                    lbuffer_putc(b, '{');
+                    break;
+                default:
+                    lbuffer_puts(b, "(\\ ");
+            }
+        }
+        if (b->frames_num == base) {
+            return;
+        }
+
+        // the next child of the innermost expression, if it has one left
+        lprint_frame* f = &b->frames[b->frames_num - 1];
+        lval* parent = f->value;
+        v = NULL;
+
+        if (L_TYPE(parent) == LVAL_FUNCTION) {
+            if (f->next < 2) {
+                if (f->next == 1) {
+                    lbuffer_putc(b, ' ');
+                }
+                v = f->next == 0 ? L_FORMALS(parent) : L_BODY(parent);
+                f->next++;
+            } else {
+                lbuffer_putc(b, ')');
+                b->frames_num--;
+            }
+        } else if (f->next < L_COUNT(parent)) {
+            if (f->next > 0) {
+                lbuffer_putc(b, ' ');
+            }
+            v = L_CELL_N(parent, f->next);
+            f->next++;
+        } else {
+            lbuffer_putc(b, L_TYPE(parent) == LVAL_SEXPRESSION ? ')' : '}');
+            b->frames_num--;
+        }
+    }
+}
+
+// both write to stdout in one go, through the buffer of the interpreter or
+// a temporary one for an env that has none
+void lval_print(lenv *env, lval *v) {
+    lbuffer* b = E_INTERP(env) ? E_INTERP(env)->print : lbuffer_new();
+    lval_write(env, b, v);
+    fwrite(b->data, 1, b->length, stdout);
+    b->length = 0;
+    if (!E_INTERP(env)) {
+        lbuffer_delete(b);
+    }
+}
+
+void lval_println(lenv *env, lval *v) {
+    lbuffer* b = E_INTERP(env) ? E_INTERP(env)->print : lbuffer_new();
+    lval_write(env, b, v);
+    lbuffer_putc(b, '\n');
+    fwrite(b->data, 1, b->length, stdout);
+    b->length = 0;
+    if (!E_INTERP(env)) {
+        lbuffer_delete(b);
+    }
+}
+
+lval* lval_pop(lval* v, int i) {
+    lval* x = L_CELL_N(v, i);
+
+    // shift memory after the item at 'i' over the top and reallocate memory used
+    memmove(&L_CELL_N(v, i), &v->cell[i + 1], sizeof(lval*) * (L_COUNT(v) - i - 1));
+    L_COUNT(v)--;
+    L_CELL(v) = realloc(L_CELL(v), sizeof(lval*) * L_COUNT(v));
+
+    return x;
+}
+
+lval* lval_take(lval* v, int i) {
+    lval* x = lval_pop(v, i);
+    lval_delete(v);
+    return x;
+}
+
+lval* lval_join(lval* x, lval* y) {
+    while (L_COUNT(y)) {
+        x = lval_add(x, lval_pop(y, 0));
+    }
+    lval_delete(y);
+    return x;
+}
+
+int lval_eq(lval *x, lval *y) {
+    // different types are always unequal
+    if (L_TYPE(x) != L_TYPE(y)) {
+        return 0;
+    }
+
+    // compare based upon type
+    switch (x->type) {
+        case LVAL_STRING:
+            return L_COUNT(x) == L_COUNT(y)
+                && memcmp(L_STRING(x), L_STRING(y), L_COUNT(x)) == 0;
+        case LVAL_BOOLEAN:
+        case LVAL_INTEGER:
+            return (L_INTEGER(x) == L_INTEGER(y));
+        case LVAL_DECIMAL:
+            return (L_DECIMAL(x) == L_DECIMAL(y));
+        case LVAL_ERROR:
+            return STR_EQ(L_ERROR(x), L_ERROR(y));
+        case LVAL_SYMBOL:
+            return STR_EQ(L_SYMBOL(x), L_SYMBOL(y));
+        case LVAL_FUTURE:
+            return L_FUTURE(x) == L_FUTURE(y);
+        case LVAL_CHANNEL:
+            return L_CHANNEL(x) == L_CHANNEL(y);
+        case LVAL_ATOM:
+            return L_ATOM(x) == L_ATOM(y);
+        case LVAL_FUNCTION:
+            if (L_BUILTIN(x) || L_BUILTIN(y)) {
+                return L_BUILTIN(x) == L_BUILTIN(y);
+            } else {
+                return lval_eq(L_FORMALS(x), L_FORMALS(y))
+                    && lval_eq(L_BODY(x), L_BODY(y));
+            }
+        case LVAL_QEXPRESSION:
+        case LVAL_SEXPRESSION:
+            if (L_COUNT(x) != L_COUNT(y)) {
+                return 0;
+            }
+            L_FOREACH(i, x) {
+                if (!lval_eq(L_CELL_N(x, i), L_CELL_N(y, i))) {
+                    return 0;
+                }
+            }
+            return 1;
+    }
+
+    return 0;
+}
+
+BUILTIN(and) {
+    int result;
+    LASSERT_ARGUMENT_NUMBER(a, 2, "&&");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_BOOLEAN, "&&");
+    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_BOOLEAN, "&&");
+
+    result = L_INTEGER_N(a, 0) && L_INTEGER_N(a, 1);
+    lval_delete(a);
+
+    return lval_boolean(result);
+}
+
+BUILTIN(or) {
+    int result;
+    LASSERT_ARGUMENT_NUMBER(a, 2, "||");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_BOOLEAN, "||");
+    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_BOOLEAN, "||");
+
+    result = L_INTEGER_N(a, 0) || L_INTEGER_N(a, 1);
+    lval_delete(a);
+
+    return lval_boolean(result);
+}
+
+BUILTIN(not) {
+    int result;
+    LASSERT_ARGUMENT_NUMBER(a, 1, "!");
+
+    switch (L_TYPE_N(a, 0)) {
+        case LVAL_INTEGER:
+            if (L_INTEGER_N(a, 0) != 0) {
+                result = 0;
+            } else {
+                result = 1;
+            }
+            break;
+
+        case LVAL_DECIMAL:
+            if (L_DECIMAL_N(a, 0) != 0.0) {
+                result = 0;
+            } else {
+                result = 1;
+            }
+            break;
+
+        case LVAL_SEXPRESSION:
+        case LVAL_QEXPRESSION:
+            if (L_COUNT_N(a, 0) > 0) {
+                result = 0;
+            } else {
+                result = 1;
+            }
+            break;
+
+        default:
+            lval_delete(a);
+            return lval_error("Can only operate on %s, %s, %s, and %s.",
+                              ltype_name(LVAL_INTEGER),
+                              ltype_name(LVAL_DECIMAL),
+                              ltype_name(LVAL_SEXPRESSION),
+                              ltype_name(LVAL_QEXPRESSION));
+    }
+
+    lval_delete(a);
+    return lval_boolean(result);
+}
+
+BUILTIN(eq) {
+    return builtin_cmp(env, a, "==");
+}
+
+BUILTIN(ne) {
+    return builtin_cmp(env, a, "!=");
+}
+
+lval *builtin_cmp(lenv *env, lval *a, char *operator) {
+    LASSERT_ARGUMENT_NUMBER(a, 2, operator);
+    int result;
+
+    if (STR_EQ(operator, "==")) {
+        result = lval_eq(L_CELL_N(a, 0), L_CELL_N(a, 1));
+    }
+
+    if (STR_EQ(operator, "!=")) {
+        result = !lval_eq(L_CELL_N(a, 0), L_CELL_N(a, 1));
+    }
+
+    lval_delete(a);
+    return lval_boolean(result);
+}
+
+BUILTIN(gt) {
+    return builtin_ord(env, a, ">");
+}
+
+BUILTIN(lt) {
+    return builtin_ord(env, a, "<");
+}
+
+BUILTIN(ge) {
+    return builtin_ord(env, a, ">=");
+}
+
+BUILTIN(le) {
+    return builtin_ord(env, a, "<=");
+}
+
+lval *builtin_ord(lenv *env, lval *a, char *operator) {
+    LASSERT_ARGUMENT_NUMBER(a, 2, operator);
+    LASSERT(a,
+            L_TYPE_N(a, 0) == LVAL_INTEGER || L_TYPE_N(a, 0) == LVAL_DECIMAL,
+            "Incorrect type of argument #%d for '%s'. Got %s, expected %s or %s.",
+            0,
+            operator,
+            ltype_name(L_TYPE_N(a, 0)),
+            ltype_name(LVAL_INTEGER),
+            ltype_name(LVAL_DECIMAL)
+            );
+    LASSERT(a,
+            L_TYPE_N(a, 1) == LVAL_INTEGER || L_TYPE_N(a, 1) == LVAL_DECIMAL,
+            "Incorrect type of argument #%d for '%s'. Got %s, expected %s or %s.",
+            1,
+            operator,
+            ltype_name(L_TYPE_N(a, 1)),
+            ltype_name(LVAL_INTEGER),
+            ltype_name(LVAL_DECIMAL)
+            );
+    LASSERT(a,
+            L_TYPE_N(a, 0) == L_TYPE_N(a, 1),
+            "Argument #2 for '%s' should be of the same type as argument #1.\n"
+            "Got %s and %s, expected %s and %s.",
+            operator,
+            ltype_name(L_TYPE_N(a, 0)),
+            ltype_name(L_TYPE_N(a, 1)),
+            ltype_name(L_TYPE_N(a, 0)),
+            ltype_name(L_TYPE_N(a, 0))
+            );
+
+    int result;
+    if (STR_EQ(operator, ">")) {
+        if (L_TYPE_N(a, 0) == LVAL_INTEGER) {
+            result = (L_INTEGER(L_CELL_N(a, 0)) > L_INTEGER_N(a, 1));
+        } else {
+            result = (L_DECIMAL(L_CELL_N(a, 0)) > L_DECIMAL_N(a, 1));
+        }
+    }
+    if (STR_EQ(operator, "<")) {
+        if (L_TYPE_N(a, 0) == LVAL_INTEGER) {
+            result = (L_INTEGER(L_CELL_N(a, 0)) < L_INTEGER_N(a, 1));
+        } else {
+            result = (L_DECIMAL(L_CELL_N(a, 0)) < L_DECIMAL_N(a, 1));
+        }
+    }
+    if (STR_EQ(operator, ">=")) {
+        if (L_TYPE_N(a, 0) == LVAL_INTEGER) {
+            result = (L_INTEGER(L_CELL_N(a, 0)) >= L_INTEGER_N(a, 1));
+        } else {
+            result = (L_DECIMAL(L_CELL_N(a, 0)) >= L_DECIMAL_N(a, 1));
+        }
+    }
+    if (STR_EQ(operator, "<=")) {
+        if (L_TYPE_N(a, 0) == LVAL_INTEGER) {
+            result = (L_INTEGER(L_CELL_N(a, 0)) <= L_INTEGER_N(a, 1));
+        } else {
+            result = (L_DECIMAL(L_CELL_N(a, 0)) <= L_DECIMAL_N(a, 1));
+        }
+    }
+
+    lval_delete(a);
+    return lval_boolean(result);
+}
+
+BUILTIN(lambda) {
+    LASSERT_ARGUMENT_NUMBER(a, 2, "\\");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "\\");
+    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_QEXPRESSION, "\\");
+
+    // First Q-Expression should contain only symbols
+    L_FOREACH(i, L_CELL_N(a, 0)) {
+        LASSERT(a, L_TYPE_N(L_CELL_N(a, 0), i) == LVAL_SYMBOL,
+                "Cannot define non-symbol. Got %s, expected %s.",
+                ltype_name(L_TYPE_N(L_CELL_N(a, 0), i)), ltype_name(LVAL_SYMBOL));
+    }
+
+    lval *formals = lval_pop(a, 0);
+    lval *body = lval_pop(a, 0);
+    lval_delete(a);
+
+    return lval_lambda(formals, body);
+}
+
+lval* builtin_op(char *operator, lenv *env, lval *a) {
+    L_FOREACH(i, a) {
+        if (L_TYPE_N(a, i) != LVAL_INTEGER && L_TYPE_N(a, i) != LVAL_DECIMAL) {
+            lval_delete(a);
+            return lval_error("Cannot operate on non-number");
+        }
+    }
+
+    lval* x = lval_pop(a, 0);
+
+    // unary negation
+    if (STR_EQ(operator, "-") && L_COUNT(a) == 0) {
+        switch(L_TYPE(x)) {
+            case LVAL_INTEGER:
+                L_INTEGER(x) = -L_INTEGER(x);
+                break;
+            case LVAL_DECIMAL:
+                L_DECIMAL(x) = -L_DECIMAL(x);
+                break;
+        }
+    }
+
+    while (L_COUNT(a) > 0) {
+        lval* y = lval_pop(a, 0);
+
+        if (STR_EQ(operator, "+") || STR_EQ(operator, "add")) {
+            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+                L_DECIMAL(x) += L_DECIMAL(y);
+            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+                L_DECIMAL(x) += L_INTEGER(y);
+            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+                L_INTEGER(x) += (int)L_DECIMAL(y);
+            } else {
+                L_INTEGER(x) += L_INTEGER(y);
+            }
+        }
+
+        if (STR_EQ(operator, "-") || STR_EQ(operator, "sub")) {
+            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+                L_DECIMAL(x) -= L_DECIMAL(y);
+            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+                L_DECIMAL(x) -= L_INTEGER(y);
+            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+                L_INTEGER(x) -= (int)L_DECIMAL(y);
+            } else {
+                L_INTEGER(x) -= L_INTEGER(y);
+            }
+        }
+
+        if (STR_EQ(operator, "*") || STR_EQ(operator, "mul")) {
+            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+                L_DECIMAL(x) *= L_DECIMAL(y);
+            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+                L_DECIMAL(x) *= L_INTEGER(y);
+            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+                L_INTEGER(x) *= (int)L_DECIMAL(y);
+            } else {
+                L_INTEGER(x) *= L_INTEGER(y);
+            }
+        }
+
+        if (STR_EQ(operator, "/") || STR_EQ(operator, "div")) {
+            switch (L_TYPE(y)) {
+                case LVAL_DECIMAL:
+                    if (L_DECIMAL(y) == 0.0) {
+                        lval_delete(x);
+                        lval_delete(y);
+                        lval_delete(a);
+                        return lval_error("Division by zero");
+                    }
+                    break;
+                case LVAL_INTEGER:
+                    if (L_INTEGER(y) == 0) {
+                        lval_delete(x);
+                        lval_delete(y);
+                        lval_delete(a);
+                        return lval_error("Division by zero");
+                    }
+                    break;
+            }
+
+            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+                L_DECIMAL(x) /= L_DECIMAL(y);
+            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+                L_DECIMAL(x) /= L_INTEGER(y);
+            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+                L_INTEGER(x) /= L_DECIMAL(y);
+            } else {
+                L_INTEGER(x) /= L_INTEGER(y);
+            }
+        }
+
+        if (STR_EQ(operator, "%") || STR_EQ(operator, "mod")) {
+            switch (L_TYPE(y)) {
+                case LVAL_DECIMAL:
+                    if (L_DECIMAL(y) == 0.0) {
+                        lval_delete(x);
+                        lval_delete(y);
+                        lval_delete(a);
+                        return lval_error("Division by zero");
+                    }
+                    break;
+                case LVAL_INTEGER:
+                    if (L_INTEGER(y) == 0) {
+                        lval_delete(x);
+                        lval_delete(y);
+                        lval_delete(a);
+                        return lval_error("Division by zero");
+                    }
+                    break;
+            }
+
+            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+                L_DECIMAL(x) = fmod(L_DECIMAL(x), L_DECIMAL(y));
+            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+                L_DECIMAL(x) = fmod(L_DECIMAL(x), L_INTEGER(y));
+            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+                L_INTEGER(x) = fmod(L_INTEGER(x), (int)L_DECIMAL(y));
+            } else {
+                L_INTEGER(x) = (int)fmod(L_INTEGER(x), L_INTEGER(y));
+            }
+        }
+
+        if (STR_EQ(operator, "^")) {
+            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+                L_DECIMAL(x) = pow(L_DECIMAL(x), L_DECIMAL(y));
+            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+                L_DECIMAL(x) = pow(L_DECIMAL(x), L_INTEGER(y));
+            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+                L_INTEGER(x) = (int)pow(L_INTEGER(x), L_DECIMAL(y));
+            } else {
+                L_INTEGER(x) = pow(L_INTEGER(x), L_INTEGER(y));
+            }
+        }
+
+        if (STR_EQ(operator, "min")) {
+            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+                L_DECIMAL(x) = L_DECIMAL(x) < L_DECIMAL(y)
+                    ? L_DECIMAL(x)
+                    : L_DECIMAL(y);
+            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+                L_DECIMAL(x) = L_DECIMAL(x) < L_INTEGER(y)
+                    ? L_DECIMAL(x)
+                    : (double)L_INTEGER(y);
+            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+                L_INTEGER(x) = L_INTEGER(x) < L_DECIMAL(y)
+                    ? L_INTEGER(x)
+                    : (int)L_DECIMAL(y);
+            } else {
+                L_INTEGER(x) = L_INTEGER(x) < L_INTEGER(y)
+                    ? L_INTEGER(x)
+                    : L_INTEGER(y);
+            }
+        }
+        if (STR_EQ(operator, "max")) {
+            if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+                L_DECIMAL(x) = L_DECIMAL(x) > L_DECIMAL(y)
+                    ? L_DECIMAL(x)
+                    : L_DECIMAL(y);
+            } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+                L_DECIMAL(x) = L_DECIMAL(x) > L_INTEGER(y)
+                    ? L_DECIMAL(x)
+                    : (double)L_INTEGER(y);
+            } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+                L_INTEGER(x) = L_INTEGER(x) > L_DECIMAL(y)
+                    ? L_INTEGER(x)
+                    : (int)L_DECIMAL(y);
+            } else {
+                L_INTEGER(x) = L_INTEGER(x) > L_INTEGER(y)
+                    ? L_INTEGER(x)
+                    : L_INTEGER(y);
+            }
+        }
+
+        lval_delete(y);
+    }
+
+    lval_delete(a);
+    return x;
+}
+
+BUILTIN(add) {
+    return builtin_op("+", env, a);
+}
+
+BUILTIN(sub) {
+    return builtin_op("-", env, a);
+}
+
+BUILTIN(mul) {
+    return builtin_op("*", env, a);
+}
+
+BUILTIN(div) {
+    return builtin_op("/", env, a);
+}
+
+BUILTIN(mod) {
+    return builtin_op("%", env, a);
+}
+
+BUILTIN(pow) {
+    return builtin_op("^", env, a);
+}
+
+BUILTIN(min) {
+    L_FOREACH(i, a) {
+        if (L_TYPE_N(a, i) != LVAL_INTEGER && L_TYPE_N(a, i) != LVAL_DECIMAL) {
+            lval_delete(a);
+            return lval_error("Cannot operate on non-number");
+        }
+    }
+
+    lval* x = lval_pop(a, 0);
+
+    while (L_COUNT(a) > 0) {
+        lval* y = lval_pop(a, 0);
+
+        if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+            L_DECIMAL(x) = L_DECIMAL(x) < L_DECIMAL(y)
+                ? L_DECIMAL(x)
+                : L_DECIMAL(y);
+        } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+            L_DECIMAL(x) = L_DECIMAL(x) < L_INTEGER(y)
+                ? L_DECIMAL(x)
+                : (double)L_INTEGER(y);
+        } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+            L_INTEGER(x) = L_INTEGER(x) < L_DECIMAL(y)
+                ? L_INTEGER(x)
+                : (int)L_DECIMAL(y);
+        } else {
+            L_INTEGER(x) = L_INTEGER(x) < L_INTEGER(y)
+                ? L_INTEGER(x)
+                : L_INTEGER(y);
+        }
+
+        lval_delete(y);
+    }
+
+    lval_delete(a);
+    return x;
+}
+
+BUILTIN(max) {
+    L_FOREACH(i, a) {
+        if (L_TYPE_N(a, i) != LVAL_INTEGER && L_TYPE_N(a, i) != LVAL_DECIMAL) {
+            lval_delete(a);
+            return lval_error("Cannot operate on non-number");
+        }
+    }
+
+    lval* x = lval_pop(a, 0);
+
+    while (L_COUNT(a) > 0) {
+        lval* y = lval_pop(a, 0);
+
+        if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
+            L_DECIMAL(x) = L_DECIMAL(x) > L_DECIMAL(y)
+                ? L_DECIMAL(x)
+                : L_DECIMAL(y);
+        } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
+            L_DECIMAL(x) = L_DECIMAL(x) > L_INTEGER(y)
+                ? L_DECIMAL(x)
+                : (double)L_INTEGER(y);
+        } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
+            L_INTEGER(x) = L_INTEGER(x) > L_DECIMAL(y)
+                ? L_INTEGER(x)
+                : (int)L_DECIMAL(y);
+        } else {
+            L_INTEGER(x) = L_INTEGER(x) > L_INTEGER(y)
+                ? L_INTEGER(x)
+                : L_INTEGER(y);
+        }
+
+        lval_delete(y);
+    }
+
+    lval_delete(a);
+    return x;
+}
+
+BUILTIN(cons) {
+    LASSERT_ARGUMENT_NUMBER(a, 2, "cons");
+    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_QEXPRESSION, "cons");
+
+    lval* x = lval_pop(a, 0);
+    lval* v = lval_pop(a, 0);
+    lval_delete(a);
+
+    L_COUNT(v)++;
+    // realloc and unshift memory
+    L_CELL(v) = realloc(L_CELL(v), sizeof(lval*) * L_COUNT(v));
+    memmove(&L_CELL_N(v, 1), &L_CELL_N(v, 0), sizeof(lval*) * (L_COUNT(v) - 1));
+    L_CELL_N(v, 0) = x;
+
+    return v;
+}
+
+BUILTIN(init) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "init");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "init");
+    LASSERT_NOT_EMPTY_QEXPR(a, "init");
+
+    lval* v = lval_take(a, 0);
+    // delete last element and return
+    lval_delete(lval_pop(v, (L_COUNT(v) - 1)));
+    return v;
+}
+
+BUILTIN(head) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "head");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "head");
+    LASSERT_NOT_EMPTY_QEXPR(a, "head");
+
+    lval* v = lval_take(a, 0);
+    // delete all elements that are not head and return
+    while (L_COUNT(v) > 1) {
+        lval_delete(lval_pop(v, 1));
+    }
+    return v;
+}
+
+BUILTIN(tail) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "tail");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "tail");
+    LASSERT_NOT_EMPTY_QEXPR(a, "tail");
+
+    lval* v = lval_take(a, 0);
+    // delete first element and return
+    lval_delete(lval_pop(v, 0));
+    return v;
+}
+
+BUILTIN(len) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "len");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "len");
+
+    lval* x = lval_take(a, 0);
+    int len = L_COUNT(x);
+    lval_delete(x);
+
+    return lval_integer(len);
+}
+
+BUILTIN(list) {
+    L_TYPE(a) = LVAL_QEXPRESSION;
+    return a;
+}
+
+lval* builtin_var(lenv *env, lval *a, char *func) {
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, func);
+
+    lval *symbols = L_CELL_N(a, 0);
+    L_FOREACH(i, symbols) {
+        LASSERT(a, L_TYPE_N(symbols, i) == LVAL_SYMBOL,
+                "Function '%s' cannot define non-symbol. Gor %s, expected %s.",
+                func, ltype_name(L_TYPE_N(symbols, i)), ltype_name(LVAL_SYMBOL));
+    }
+
+    LASSERT(a, L_COUNT(symbols) == L_COUNT(a) - 1,
+            "Function '%s' passed too many arguments for symbols. Got %i, expected %i.",
+            func, L_COUNT(symbols), L_COUNT(a) - 1);
+
+    L_FOREACH(i, symbols) {
+        if (STR_EQ(func, "def")) {
+            lenv_def(env, L_CELL_N(symbols, i), L_CELL_N(a, i + 1));
+        }
+
+        if (STR_EQ(func, "=")) {
+            lenv_put(env, L_CELL_N(symbols, i), L_CELL_N(a, i + 1));
+        }
+    }
+
+    lval_delete(a);
+    return lval_sexpression();
+}
+
+BUILTIN(def) {
+    return builtin_var(env, a, "def");
+}
+
+BUILTIN(put) {
+    return builtin_var(env, a, "=");
+}
+
+BUILTIN(exit) {
+    exit(0);
+}
+
+// (pmap f {a b c}) is {(f a) (f b) (f c)}, worked out on the threads of
+// the interpreter's pool; `keep` is 0 for pfor-each, which only wants the
+// first error if there is one
+lval* builtin_parallel(lenv *env, lval *a, char *func, int keep) {
+    LASSERT_ARGUMENT_NUMBER(a, 2, func);
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_FUNCTION, func);
+    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_QEXPRESSION, func);
+
+    lpmap m;
+    m.env = env;
+    m.func = L_CELL_N(a, 0);
+    m.items = L_CELL_N(a, 1);
+    m.results = malloc(sizeof(lval*) * (L_COUNT(m.items) + 1));
+
+    if (E_INTERP(env)) {
+        lpool_run(linterp_pool(E_INTERP(env)), lpmap_run, &m, L_COUNT(m.items));
+    } else {
+        lpmap_run(&m, 0, L_COUNT(m.items));
+    }
+
+    lval *error = NULL;
+    lval *v = keep ? lval_qexpression() : NULL;
+    L_FOREACH(i, m.items) {
+        lval *x = m.results[i];
+        if (!error && L_TYPE(x) == LVAL_ERROR) {
+            error = x;
+        } else if (keep && !error) {
+            v = lval_add(v, x);
+        } else {
+            lval_delete(x);
+        }
+    }
+    free(m.results);
+    lval_delete(a);
+
+    if (error) {
+        if (v) {
+            lval_delete(v);
+        }
+        return error;
+    }
+    return keep ? v : lval_sexpression();
+}
+
+BUILTIN(pmap) {
+    return builtin_parallel(env, a, "pmap", 1);
+}
+
+BUILTIN(pfor_each) {
+    return builtin_parallel(env, a, "pfor-each", 0);
+}
+
+// takes `x` and `y`, which are of one type with the kernel
+lval* lpreduce_apply(lpreduce* m, lenv* env, lval* x, lval* y) {
+    if (m->kernel == LPREDUCE_CALL) {
+        lval* f = lval_copy(m->func);
+        lval* v = lval_call(env, f, lval_add(lval_add(lval_sexpression(), x), y));
+        lval_delete(f);
+        return v;
+    }
+
+    if (L_TYPE(x) == LVAL_INTEGER) {
+        long a = L_INTEGER(x);
+        long b = L_INTEGER(y);
+        L_INTEGER(x) = m->kernel == LPREDUCE_ADD ? a + b
+            : m->kernel == LPREDUCE_MUL ? a * b
+            : m->kernel == LPREDUCE_MIN ? (a < b ? a : b)
+            : (a > b ? a : b);
+    } else {
+        double a = L_DECIMAL(x);
+        double b = L_DECIMAL(y);
+        L_DECIMAL(x) = m->kernel == LPREDUCE_ADD ? a + b
+            : m->kernel == LPREDUCE_MUL ? a * b
+            : m->kernel == LPREDUCE_MIN ? (a < b ? a : b)
+            : (a > b ? a : b);
+    }
+    lval_delete(y);
+    return x;
+}
+
+// reduces chunks `start` to `end`, in an env of their own like lpmap_run
+void lpreduce_chunks(void* arg, long start, long end) {
+    lpreduce* m = arg;
+    lval* items = m->items;
+    lenv* local = lenv_new();
+    E_PARENT(local) = m->env;
+    E_BOUNDARY(local) = 1;
+
+    for (long k = start; k < end; k++) {
+        long from = k * m->chunk;
+        long to = from + m->chunk < L_COUNT(items) ? from + m->chunk : L_COUNT(items);
+
+        if (m->kernel != LPREDUCE_CALL && L_TYPE_N(items, from) == LVAL_INTEGER) {
+            long x = L_INTEGER_N(items, from);
+            for (long i = from + 1; i < to; i++) {
+                long y = L_INTEGER_N(items, i);
+                switch (m->kernel) {
+                    case LPREDUCE_ADD: x += y; break;
+                    case LPREDUCE_MUL: x *= y; break;
+                    case LPREDUCE_MIN: x = x < y ? x : y; break;
+                    case LPREDUCE_MAX: x = x > y ? x : y; break;
+                }
+            }
+            m->partials[k] = lval_integer(x);
+            continue;
+        }
+        if (m->kernel != LPREDUCE_CALL) {
+            double x = L_DECIMAL_N(items, from);
+            for (long i = from + 1; i < to; i++) {
+                double y = L_DECIMAL_N(items, i);
+                switch (m->kernel) {
+                    case LPREDUCE_ADD: x += y; break;
+                    case LPREDUCE_MUL: x *= y; break;
+                    case LPREDUCE_MIN: x = x < y ? x : y; break;
+                    case LPREDUCE_MAX: x = x > y ? x : y; break;
+                }
+            }
+            m->partials[k] = lval_decimal(x);
+            continue;
+        }
+
+        lval* x = lval_copy(L_CELL_N(items, from));
+        for (long i = from + 1; i < to && L_TYPE(x) != LVAL_ERROR; i++) {
+            x = lpreduce_apply(m, local, x, lval_copy(L_CELL_N(items, i)));
+        }
+        m->partials[k] = x;
+    }
+    lenv_delete(local);
+}
+
+// combines pairs `start` to `end` of this round; the first error wins
+void lpreduce_pairs(void* arg, long start, long end) {
+    lpreduce* m = arg;
+    lenv* local = lenv_new();
+    E_PARENT(local) = m->env;
+    E_BOUNDARY(local) = 1;
+
+    for (long p = start; p < end; p++) {
+        long i = p * 2 * m->width;
+        long j = i + m->width;
+        if (j >= m->partials_num) {
+            continue;
+        }
+        lval* x = m->partials[i];
+        lval* y = m->partials[j];
+        m->partials[j] = NULL;
+        if (L_TYPE(x) == LVAL_ERROR) {
+            lval_delete(y);
+        } else if (L_TYPE(y) == LVAL_ERROR) {
+            lval_delete(x);
+            m->partials[i] = y;
+        } else {
+            m->partials[i] = lpreduce_apply(m, local, x, y);
+        }
+    }
+    lenv_delete(local);
+}
+
+// (preduce f init {xs}) is (f init (f x1 (f x2 ...))) for an associative f:
+// chunks of xs are reduced on the pool and their results combined as a
+// tree, so f is never called with init more than once
+BUILTIN(preduce) {
+    LASSERT_ARGUMENT_NUMBER(a, 3, "preduce");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_FUNCTION, "preduce");
+    LASSERT_ARGUMENT_TYPE(a, 2, LVAL_QEXPRESSION, "preduce");
+
+    lpreduce m;
+    m.env = env;
+    m.func = L_CELL_N(a, 0);
+    m.items = L_CELL_N(a, 2);
+    long count = L_COUNT(m.items);
+    if (count == 0) {
+        return lval_take(a, 1);
+    }
+
+    lbuiltin fn = L_BUILTIN(m.func);
+    m.kernel = fn == builtin_add ? LPREDUCE_ADD
+        : fn == builtin_mul ? LPREDUCE_MUL
+        : fn == builtin_min ? LPREDUCE_MIN
+        : fn == builtin_max ? LPREDUCE_MAX
+        : LPREDUCE_CALL;
+    // mixing integers and decimals depends on the order of the operands
+    int type = L_TYPE_N(m.items, 0);
+    for (long i = 0; m.kernel != LPREDUCE_CALL && i < count; i++) {
+        if (L_TYPE_N(m.items, i) != type
+            || (type != LVAL_INTEGER && type != LVAL_DECIMAL)) {
+            m.kernel = LPREDUCE_CALL;
+        }
+    }
+
+    lpool *pool = E_INTERP(env) ? linterp_pool(E_INTERP(env)) : NULL;
+    m.partials_num = pool ? pool->threads_num * 4 : 1;
+    if (m.partials_num > count) {
+        m.partials_num = count;
+    }
+    m.chunk = (count + m.partials_num - 1) / m.partials_num;
+    m.partials_num = (count + m.chunk - 1) / m.chunk;
+    m.partials = malloc(sizeof(lval*) * m.partials_num);
+
+    if (pool) {
+        lpool_run(pool, lpreduce_chunks, &m, m.partials_num);
+    } else {
+        lpreduce_chunks(&m, 0, m.partials_num);
+    }
+    for (m.width = 1; m.width < m.partials_num; m.width *= 2) {
+        long pairs = (m.partials_num + 2 * m.width - 1) / (2 * m.width);
+        if (pool && pairs > 1) {
+            lpool_run(pool, lpreduce_pairs, &m, pairs);
+        } else {
+            lpreduce_pairs(&m, 0, pairs);
+        }
+    }
+
+    lval *x = m.partials[0];
+    free(m.partials);
+    if (L_TYPE(x) == LVAL_ERROR) {
+        lval_delete(a);
+        return x;
+    }
+
+    // the builtins get init like any other call, with its own type
+    lval *f = lval_copy(m.func);
+    lval *args = lval_add(lval_add(lval_sexpression(), lval_pop(a, 1)), x);
+    lval *v = lval_call(env, f, args);
+    lval_delete(f);
+    lval_delete(a);
+    return v;
+}
+
+// (future {expr}) evaluates expr in the background, like eval would
+BUILTIN(future) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "future");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "future");
+
+    lval *expr = lval_take(a, 0);
+    L_TYPE(expr) = LVAL_SEXPRESSION;
+    lfuture *f = lfuture_new(lenv_flatten(env), expr);
+
+    // futures made inside pmap or another future have no interpreter, and
+    // run on deref
+    if (E_INTERP(env)) {
+        lpool_submit(linterp_pool(E_INTERP(env)), f);
+    }
+
+    lval *v = malloc(sizeof(lval));
+    L_TYPE(v) = LVAL_FUTURE;
+    L_FUTURE(v) = f;
+    return v;
+}
+
+// (spawn {expr}) is a future that runs as a fiber, so expr can `yield` and
+// `sleep` without holding up a thread; fibers spawned by fibers go to the
+// same pool
+BUILTIN(spawn) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "spawn");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "spawn");
+
+    lpool *pool = E_INTERP(env) ? linterp_pool(E_INTERP(env))
+        : lfiber_current ? lfiber_current->pool : NULL;
+
+    lval *expr = lval_take(a, 0);
+    L_TYPE(expr) = LVAL_SEXPRESSION;
+    lfuture *f = lfuture_new(lenv_flatten(env), expr);
+
+    // without a pool the future runs on deref, like one from `future`
+    if (pool) {
+        f->pool = pool;
+        lfuture_retain(f);
+        lfiber *fb = lfiber_new(pool, f);
+        if (fb) {
+            lpool_schedule(pool, fb);
+        } else {
+            lfuture_release(f);
+        }
     }
 
-    lval_delete(a);
-    return x;
+    lval *v = malloc(sizeof(lval));
+    L_TYPE(v) = LVAL_FUTURE;
+    L_FUTURE(v) = f;
+    return v;
 }
 
-BUILTIN(add) {
-    return builtin_op("+", env, a);
+// calls need an argument, so (yield x) gives x back once the fiber is
+// resumed; outside of a fiber it returns right away
+BUILTIN(yield) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "yield");
+
+    lfiber *fb = lfiber_current;
+    if (fb) {
+        lfiber_suspend(fb);
+    }
+    return lval_take(a, 0);
 }
 
-BUILTIN(sub) {
-    return builtin_op("-", env, a);
+// (sleep ms) suspends a fiber, or the thread outside of one
+BUILTIN(sleep) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "sleep");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_INTEGER, "sleep");
+
+    long ms = L_INTEGER_N(a, 0);
+    lval_delete(a);
+
+    struct timespec t;
+    t.tv_sec = ms > 0 ? ms / 1000 : 0;
+    t.tv_nsec = ms > 0 ? (ms % 1000) * 1000000 : 0;
+
+    lfiber *fb = lfiber_current;
+    if (fb) {
+        clock_gettime(CLOCK_REALTIME, &fb->wake);
+        fb->wake.tv_sec += t.tv_sec;
+        fb->wake.tv_nsec += t.tv_nsec;
+        if (fb->wake.tv_nsec >= 1000000000) {
+            fb->wake.tv_sec++;
+            fb->wake.tv_nsec -= 1000000000;
+        }
+        fb->sleeping = 1;
+        lfiber_suspend(fb);
+    } else {
+        nanosleep(&t, NULL);
+    }
+    return lval_sexpression();
 }
 
-BUILTIN(mul) {
-    return builtin_op("*", env, a);
+// the value of an atom, or that of a future once it is there
+BUILTIN(deref) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "deref");
+
+    lval *v;
+    if (L_TYPE_N(a, 0) == LVAL_ATOM) {
+        latom *t = L_ATOM(L_CELL_N(a, 0));
+        v = lval_copy(latom_enter(t)->value);
+        latom_leave(t);
+    } else {
+        LASSERT_ARGUMENT_TYPE(a, 0, LVAL_FUTURE, "deref");
+        v = lval_copy(lfuture_wait(L_FUTURE(L_CELL_N(a, 0))));
+    }
+    lval_delete(a);
+    return v;
 }
 
-BUILTIN(div) {
-    return builtin_op("/", env, a);
+BUILTIN(realized) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "realized?");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_FUTURE, "realized?");
+
+    lfuture *f = L_FUTURE(L_CELL_N(a, 0));
+    pthread_mutex_lock(&f->lock);
+    int done = f->state == LFUTURE_DONE;
+    pthread_mutex_unlock(&f->lock);
+
+    lval_delete(a);
+    return lval_boolean(done);
 }
 
-BUILTIN(mod) {
-    return builtin_op("%", env, a);
+lval* lval_channel(lchan* c) {
+    lval* v = malloc(sizeof(lval));
+    L_TYPE(v) = LVAL_CHANNEL;
+    L_CHANNEL(v) = c;
+    return v;
 }
 
-BUILTIN(pow) {
-    return builtin_op("^", env, a);
+// (chan n) holds up to n values, rounded up to a power of two no less than
+// two, and (chan 0) any number of them; n is at most LCHAN_MAX_CAPACITY
+BUILTIN(chan) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "chan");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_INTEGER, "chan");
+    LASSERT(a, L_INTEGER_N(a, 0) >= 0,
+            "Function 'chan' passed negative capacity %li.", L_INTEGER_N(a, 0));
+    LASSERT(a, L_INTEGER_N(a, 0) <= LCHAN_MAX_CAPACITY,
+            "Function 'chan' passed capacity %li, more than %li.",
+            L_INTEGER_N(a, 0), LCHAN_MAX_CAPACITY);
+
+    lchan *c = lchan_new(L_INTEGER_N(a, 0));
+    LASSERT(a, c != NULL,
+            "Function 'chan' could not allocate capacity %li.", L_INTEGER_N(a, 0));
+    lval_delete(a);
+    return lval_channel(c);
 }
 
-BUILTIN(min) {
-    L_FOREACH(i, a) {
-        if (L_TYPE_N(a, i) != LVAL_INTEGER && L_TYPE_N(a, i) != LVAL_DECIMAL) {
+// (send c x) moves x into c, waiting while c is full
+BUILTIN(send) {
+    LASSERT_ARGUMENT_NUMBER(a, 2, "send");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_CHANNEL, "send");
+
+    lchan *c = L_CHANNEL(L_CELL_N(a, 0));
+    lval *v = lval_pop(a, 1);
+    int spins = 0;
+    while (!lchan_try_send(c, v)) {
+        if (!lchan_wait(lchan_pool(env), &c, 1, LCHAN_SEND, &spins)) {
+            lval_delete(v);
             lval_delete(a);
-            return lval_error("Cannot operate on non-number");
+            return lval_error("Function 'send' stopped waiting, the interpreter is exiting.");
         }
     }
+    lval_delete(a);
+    return lval_sexpression();
+}
 
-    lval* x = lval_pop(a, 0);
-
-    while (L_COUNT(a) > 0) {
-        lval* y = lval_pop(a, 0);
+// (recv c) takes the oldest value out of c, waiting while c is empty
+BUILTIN(recv) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "recv");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_CHANNEL, "recv");
 
-        if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-            L_DECIMAL(x) = L_DECIMAL(x) < L_DECIMAL(y)
-                ? L_DECIMAL(x)
-                : L_DECIMAL(y);
-        } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-            L_DECIMAL(x) = L_DECIMAL(x) < L_INTEGER(y)
-                ? L_DECIMAL(x)
-                : (double)L_INTEGER(y);
-        } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-            L_INTEGER(x) = L_INTEGER(x) < L_DECIMAL(y)
-                ? L_INTEGER(x)
-                : (int)L_DECIMAL(y);
-        } else {
-            L_INTEGER(x) = L_INTEGER(x) < L_INTEGER(y)
-                ? L_INTEGER(x)
-                : L_INTEGER(y);
+    lchan *c = L_CHANNEL(L_CELL_N(a, 0));
+    lval *v;
+    int spins = 0;
+    while (!(v = lchan_try_recv(c))) {
+        if (!lchan_wait(lchan_pool(env), &c, 1, LCHAN_RECV, &spins)) {
+            lval_delete(a);
+            return lval_error("Function 'recv' stopped waiting, the interpreter is exiting.");
         }
-
-        lval_delete(y);
     }
+    lval_delete(a);
+    return v;
+}
 
+// (try-recv c) is {x} for a value x taken out of c, or {} if c is empty
+BUILTIN(try_recv) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "try-recv");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_CHANNEL, "try-recv");
+
+    lval *v = lchan_try_recv(L_CHANNEL(L_CELL_N(a, 0)));
     lval_delete(a);
-    return x;
+
+    lval *x = lval_qexpression();
+    return v ? lval_add(x, v) : x;
 }
 
-BUILTIN(max) {
-    L_FOREACH(i, a) {
-        if (L_TYPE_N(a, i) != LVAL_INTEGER && L_TYPE_N(a, i) != LVAL_DECIMAL) {
+// (select {c1 c2 ...}) waits for a value in any of the channels and is
+// {i x} for the value x taken out of the i-th one; the channels are tried
+// from a different one each time so that none of them is starved
+BUILTIN(select) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "select");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "select");
+    LASSERT_NOT_EMPTY_QEXPR(a, "select");
+
+    lval *cs = L_CELL_N(a, 0);
+    L_FOREACH(i, cs) {
+        LASSERT(a, L_TYPE_N(cs, i) == LVAL_CHANNEL,
+                "Function 'select' passed %s instead of a Channel.",
+                ltype_name(L_TYPE_N(cs, i)));
+    }
+
+    static LTHREAD_LOCAL unsigned int start = 0;
+    unsigned int n = L_COUNT(cs);
+    lchan **chans = malloc(sizeof(lchan*) * n);
+    for (int i = 0; i < n; i++) {
+        chans[i] = L_CHANNEL(L_CELL_N(cs, i));
+    }
+    int spins = 0;
+    while (1) {
+        start++;
+        for (int k = 0; k < n; k++) {
+            int i = (start + k) % n;
+            lval *v = lchan_try_recv(chans[i]);
+            if (v) {
+                free(chans);
+                lval_delete(a);
+                return lval_add(lval_add(lval_qexpression(), lval_integer(i)), v);
+            }
+        }
+        if (!lchan_wait(lchan_pool(env), chans, n, LCHAN_RECV, &spins)) {
+            free(chans);
             lval_delete(a);
-            return lval_error("Cannot operate on non-number");
+            return lval_error("Function 'select' stopped waiting, the interpreter is exiting.");
         }
     }
+}
 
-    lval* x = lval_pop(a, 0);
+// the body of an actor, called with its mailbox and handler: each message
+// is passed to the handler, and a function coming back replaces it, which
+// is how an actor keeps state; the actor is done once nobody else can send
+// it anything
+lval* lactor_run(lenv* env, lval* a) {
+    lchan* c = L_CHANNEL(L_CELL_N(a, 0));
+    lval* handler = lval_pop(a, 1);
 
-    while (L_COUNT(a) > 0) {
-        lval* y = lval_pop(a, 0);
+    while (1) {
+        lval* msg;
+        int spins = 0;
+        while (!(msg = lchan_try_recv(c))) {
+            // the reference in `a` is the last one, and nothing can be sent
+            // after the check; a message sent before it is still there
+            if (__atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) == 1
+                && !(msg = lchan_try_recv(c))) {
+                lval_delete(handler);
+                lval_delete(a);
+                return lval_sexpression();
+            }
+            if (msg) {
+                break;
+            }
+            if (!lchan_wait(lchan_pool(env), &c, 1, LCHAN_ALONE, &spins)) {
+                lval_delete(handler);
+                lval_delete(a);
+                return lval_sexpression();
+            }
+        }
 
-        if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_DECIMAL) {
-            L_DECIMAL(x) = L_DECIMAL(x) > L_DECIMAL(y)
-                ? L_DECIMAL(x)
-                : L_DECIMAL(y);
-        } else if (L_TYPE(x) == LVAL_DECIMAL && L_TYPE(y) == LVAL_INTEGER) {
-            L_DECIMAL(x) = L_DECIMAL(x) > L_INTEGER(y)
-                ? L_DECIMAL(x)
-                : (double)L_INTEGER(y);
-        } else if (L_TYPE(x) == LVAL_INTEGER && L_TYPE(y) == LVAL_DECIMAL) {
-            L_INTEGER(x) = L_INTEGER(x) > L_DECIMAL(y)
-                ? L_INTEGER(x)
-                : (int)L_DECIMAL(y);
+        lval* f = lval_copy(handler);
+        lval* x = lval_call(env, f, lval_add(lval_sexpression(), msg));
+        lval_delete(f);
+        if (L_TYPE(x) == LVAL_FUNCTION) {
+            lval_delete(handler);
+            handler = x;
         } else {
-            L_INTEGER(x) = L_INTEGER(x) > L_INTEGER(y)
-                ? L_INTEGER(x)
-                : L_INTEGER(y);
+            lval_delete(x);
         }
-
-        lval_delete(y);
     }
-
-    lval_delete(a);
-    return x;
 }
 
-BUILTIN(cons) {
-    LASSERT_ARGUMENT_NUMBER(a, 2, "cons");
-    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_QEXPRESSION, "cons");
-
-    lval* x = lval_pop(a, 0);
-    lval* v = lval_pop(a, 0);
+// (spawn-actor handler) runs handler as a fiber of its own over a snapshot
+// of the env it is spawned in, and is the channel to send it messages with;
+// messages are moved into the actor, so it shares nothing with its senders.
+// Like a future, it reads globals from the root, but its `def`s stay in its
+// own env
+BUILTIN(spawn_actor) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "spawn-actor");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_FUNCTION, "spawn-actor");
+
+    lpool *pool = E_INTERP(env) ? linterp_pool(E_INTERP(env)) : lchan_pool(env);
+    LASSERT(a, pool != NULL, "Function '%s' cannot run inside of pmap.", "spawn-actor");
+
+    lchan *c = lchan_new(0);
+    lval *expr = lval_sexpression();
+    lval_add(expr, lval_function(lactor_run));
+    lval_add(expr, lval_channel(c));
+    lval_add(expr, lval_pop(a, 0));
     lval_delete(a);
 
-    L_COUNT(v)++;
-    // realloc and unshift memory
-    L_CELL(v) = realloc(L_CELL(v), sizeof(lval*) * L_COUNT(v));
-    memmove(&L_CELL_N(v, 1), &L_CELL_N(v, 0), sizeof(lval*) * (L_COUNT(v) - 1));
-    L_CELL_N(v, 0) = x;
+    lenv *local = lenv_flatten(env);
+    E_BOUNDARY(local) = 1;
+    lfuture *f = lfuture_new(local, expr);
+    f->pool = pool;
+    lfiber *fb = lfiber_new(pool, f);
+    if (!fb) {
+        lfuture_release(f);
+        return lval_error("Function 'spawn-actor' could not map a stack.");
+    }
+    // before the actor can find itself alone with its mailbox
+    lchan_retain(c);
+    lpool_schedule(pool, fb);
+    return lval_channel(c);
+}
 
+lval* lval_atom(latom* t) {
+    lval* v = malloc(sizeof(lval));
+    L_TYPE(v) = LVAL_ATOM;
+    L_ATOM(v) = t;
     return v;
 }
 
-BUILTIN(init) {
-    LASSERT_ARGUMENT_NUMBER(a, 1, "init");
-    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "init");
-    LASSERT_NOT_EMPTY_QEXPR(a, "init");
+// (atom x) is a reference to x that can be read with deref and replaced
+// from any thread with reset!, swap! and cas!
+BUILTIN(atom) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "atom");
 
-    lval* v = lval_take(a, 0);
-    // delete last element and return
-    lval_delete(lval_pop(v, (L_COUNT(v) - 1)));
-    return v;
+    latom *t = latom_new(lval_take(a, 0));
+    return lval_atom(t);
 }
 
-BUILTIN(head) {
-    LASSERT_ARGUMENT_NUMBER(a, 1, "head");
-    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "head");
-    LASSERT_NOT_EMPTY_QEXPR(a, "head");
+// (reset! t x) replaces whatever t holds with x
+BUILTIN(reset) {
+    LASSERT_ARGUMENT_NUMBER(a, 2, "reset!");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_ATOM, "reset!");
 
-    lval* v = lval_take(a, 0);
-    // delete all elements that are not head and return
-    while (L_COUNT(v) > 1) {
-        lval_delete(lval_pop(v, 1));
+    latom *t = L_ATOM(L_CELL_N(a, 0));
+    lval *v = lval_pop(a, 1);
+    lval *x = lval_copy(v);
+    while (1) {
+        latom_cell *cell = latom_enter(t);
+        int done = latom_replace(t, cell, v);
+        latom_leave(t);
+        if (done) {
+            break;
+        }
+        v = lval_copy(x);
     }
-    return v;
+    lval_delete(a);
+    return x;
 }
 
-BUILTIN(tail) {
-    LASSERT_ARGUMENT_NUMBER(a, 1, "tail");
-    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "tail");
-    LASSERT_NOT_EMPTY_QEXPR(a, "tail");
+// (swap! t f args...) replaces the value x of t with (f x args...), calling
+// f again if t was changed meanwhile, so f should not have side effects; f
+// runs on a copy of x, outside of the reader section, so that a slow f does
+// not keep the cells other threads replace from being freed
+BUILTIN(swap) {
+    LASSERT(a, L_COUNT(a) >= 2,
+            "Wrong number of arguments for '%s'. Got %i, expected at least %i.",
+            "swap!", L_COUNT(a), 2);
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_ATOM, "swap!");
+    LASSERT_ARGUMENT_TYPE(a, 1, LVAL_FUNCTION, "swap!");
+
+    latom *t = L_ATOM(L_CELL_N(a, 0));
+    while (1) {
+        latom_cell *cell = latom_enter(t);
+        long version = cell->version;
+        lval *args = lval_sexpression();
+        lval_add(args, lval_copy(cell->value));
+        latom_leave(t);
+        for (int i = 2; i < L_COUNT(a); i++) {
+            lval_add(args, lval_copy(L_CELL_N(a, i)));
+        }
+        lval *f = lval_copy(L_CELL_N(a, 1));
+        lval *v = lval_call(env, f, args);
+        lval_delete(f);
+        if (L_TYPE(v) == LVAL_ERROR) {
+            lval_delete(a);
+            return v;
+        }
 
-    lval* v = lval_take(a, 0);
-    // delete first element and return
-    lval_delete(lval_pop(v, 0));
+        lval *x = lval_copy(v);
+        cell = latom_enter(t);
+        int done = 0;
+        if (cell->version == version) {
+            done = latom_replace(t, cell, v);
+        } else {
+            lval_delete(v);
+        }
+        latom_leave(t);
+        if (done) {
+            lval_delete(a);
+            return x;
+        }
+        lval_delete(x);
+    }
+}
+
+// (cas! t old new) replaces the value of t with new if it is equal to old,
+// and tells whether it did
+BUILTIN(cas) {
+    LASSERT_ARGUMENT_NUMBER(a, 3, "cas!");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_ATOM, "cas!");
+
+    latom *t = L_ATOM(L_CELL_N(a, 0));
+    lval *v = lval_pop(a, 2);
+    latom_cell *cell = latom_enter(t);
+    int done = 0;
+    if (lval_eq(cell->value, L_CELL_N(a, 1))) {
+        done = latom_replace(t, cell, v);
+    } else {
+        lval_delete(v);
+    }
+    latom_leave(t);
+
+    lval_delete(a);
+    return lval_boolean(done);
+}
+
+BUILTIN(to_string) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "to-string");
+
+    lbuffer *b = lbuffer_new();
+    lval_write(env, b, L_CELL_N(a, 0));
+    lval *v = lval_bytes(b->data, b->length);
+    lbuffer_delete(b);
+    lval_delete(a);
     return v;
 }
 
-BUILTIN(len) {
-    LASSERT_ARGUMENT_NUMBER(a, 1, "len");
-    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "len");
+BUILTIN(serialize) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "serialize");
 
-    lval* x = lval_take(a, 0);
-    int len = L_COUNT(x);
-    lval_delete(x);
+    long length;
+    char *data = lval_pack(L_CELL_N(a, 0), LPACK_MAGIC, &length);
+    lval_delete(a);
+    if (!data) {
+        return lval_error("Function 'serialize' cannot serialize futures, channels, atoms or unnamed builtins.");
+    }
 
-    return lval_integer(len);
+    lval *v = lval_bytes(data, length);
+    free(data);
+    return v;
 }
 
-BUILTIN(list) {
-    L_TYPE(a) = LVAL_QEXPRESSION;
-    return a;
+BUILTIN(deserialize) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "deserialize");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_STRING, "deserialize");
+
+    lval *v = lval_unpack(L_STRING(L_CELL_N(a, 0)), L_COUNT_N(a, 0));
+    lval_delete(a);
+    if (!v) {
+        return lval_error("Function 'deserialize' passed invalid data.");
+    }
+    return v;
 }
 
-lval* builtin_var(lenv *env, lval *a, char *func) {
-    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, func);
+// (save-image {}) saves the whole global env, (save-image {a b}) only the
+// given names
+BUILTIN(save_image) {
+    LASSERT_ARGUMENT_NUMBER(a, 1, "save-image");
+    LASSERT_ARGUMENT_TYPE(a, 0, LVAL_QEXPRESSION, "save-image");
+    char *path = E_INTERP(env) ? E_INTERP(env)->image : NULL;
+    LASSERT(a, path != NULL,
+            "Function '%s' needs an image file, start with '--image file'.", "save-image");
 
     lval *symbols = L_CELL_N(a, 0);
     L_FOREACH(i, symbols) {
         LASSERT(a, L_TYPE_N(symbols, i) == LVAL_SYMBOL,
-                "Function '%s' cannot define non-symbol. Gor %s, expected %s.",
-                func, ltype_name(L_TYPE_N(symbols, i)), ltype_name(LVAL_SYMBOL));
+                "Function '%s' cannot save non-symbol. Got %s, expected %s.",
+                "save-image", ltype_name(L_TYPE_N(symbols, i)), ltype_name(LVAL_SYMBOL));
     }
 
-    LASSERT(a, L_COUNT(symbols) == L_COUNT(a) - 1,
-            "Function '%s' passed too many arguments for symbols. Got %i, expected %i.",
-            func, L_COUNT(symbols), L_COUNT(a) - 1);
-
-    L_FOREACH(i, symbols) {
-        if (STR_EQ(func, "def")) {
-            lenv_def(env, L_CELL_N(symbols, i), L_CELL_N(a, i + 1));
-        }
+    while (E_PARENT(env)) {
+        env = E_PARENT(env);
+    }
 
-        if (STR_EQ(func, "=")) {
-            lenv_put(env, L_CELL_N(symbols, i), L_CELL_N(a, i + 1));
+    lenv *saved = env;
+    if (L_COUNT(symbols)) {
+        saved = lenv_new();
+        L_FOREACH(i, symbols) {
+            lval *x = lenv_get(env, L_CELL_N(symbols, i));
+            if (L_TYPE(x) == LVAL_ERROR) {
+                lenv_delete(saved);
+                lval_delete(a);
+                return x;
+            }
+            lenv_put(saved, L_CELL_N(symbols, i), x);
+            lval_delete(x);
         }
     }
 
+    int ok = limage_save(saved, path);
+    if (saved != env) {
+        lenv_delete(saved);
+    }
     lval_delete(a);
+    if (!ok) {
+        return lval_error("Could not save image to '%s'.", path);
+    }
     return lval_sexpression();
 }
 
-BUILTIN(def) {
-    return builtin_var(env, a, "def");
-}
-
-BUILTIN(put) {
-    return builtin_var(env, a, "=");
-}
-
-BUILTIN(exit) {
-    exit(0);
-}
-
 lval* lval_eval_sexpr(lenv *env, lval *v) {
     // evaluate children
     L_FOREACH(i, v) {
@@ -1453,7 +5676,7 @@ void lenv_add_builtins(lenv *env) {
     lenv_add_builtin(env, "len", builtin_len);
     lenv_add_builtin(env, "init", builtin_init);
     lenv_add_builtin(env, "min", builtin_min);
-    lenv_add_builtin(env, "min", builtin_max);
+    lenv_add_builtin(env, "max", builtin_max);
 
     /* Mathematical Functions */
     lenv_add_builtin(env, "+", builtin_add);
@@ -1481,6 +5704,29 @@ void lenv_add_builtins(lenv *env) {
 
     /* Other */
     lenv_add_builtin(env, "exit", builtin_exit);
+    lenv_add_builtin(env, "save-image", builtin_save_image);
+    lenv_add_builtin(env, "pmap", builtin_pmap);
+    lenv_add_builtin(env, "pfor-each", builtin_pfor_each);
+    lenv_add_builtin(env, "preduce", builtin_preduce);
+    lenv_add_builtin(env, "future", builtin_future);
+    lenv_add_builtin(env, "deref", builtin_deref);
+    lenv_add_builtin(env, "realized?", builtin_realized);
+    lenv_add_builtin(env, "spawn", builtin_spawn);
+    lenv_add_builtin(env, "yield", builtin_yield);
+    lenv_add_builtin(env, "sleep", builtin_sleep);
+    lenv_add_builtin(env, "chan", builtin_chan);
+    lenv_add_builtin(env, "send", builtin_send);
+    lenv_add_builtin(env, "recv", builtin_recv);
+    lenv_add_builtin(env, "try-recv", builtin_try_recv);
+    lenv_add_builtin(env, "select", builtin_select);
+    lenv_add_builtin(env, "spawn-actor", builtin_spawn_actor);
+    lenv_add_builtin(env, "atom", builtin_atom);
+    lenv_add_builtin(env, "reset!", builtin_reset);
+    lenv_add_builtin(env, "swap!", builtin_swap);
+    lenv_add_builtin(env, "cas!", builtin_cas);
+    lenv_add_builtin(env, "to-string", builtin_to_string);
+    lenv_add_builtin(env, "serialize", builtin_serialize);
+    lenv_add_builtin(env, "deserialize", builtin_deserialize);
     lenv_add_builtin(env, "\\", builtin_lambda);
 
     /* Constants */
@@ -1489,73 +5735,117 @@ void lenv_add_builtins(lenv *env) {
 }
 
 int main(int argc, char** argv) {
-    mpc_parser_t* Number = mpc_new("number");
-    mpc_parser_t* Decimal = mpc_new("decimal");
-    mpc_parser_t* Integer = mpc_new("integer");
-    mpc_parser_t* Symbol = mpc_new("symbol");
-    mpc_parser_t* Sexpr = mpc_new("sexpr");
-    mpc_parser_t* Qexpr = mpc_new("qexpr");
-    mpc_parser_t* Expr = mpc_new("expr");
-    mpc_parser_t* Lliisspp = mpc_new("lispy");
-
-    FILE *f = fopen("grammar", "rb");
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    char *grammar = malloc(fsize + 1);
-    fread(grammar, fsize, 1, f);
-    fclose(f);
+    if (!lval_read_tags()) {
+        fputs("Grammar tags are already in use\n", stderr);
+        return 1;
+    }
+
+    // `--image file` starts from the env saved in file, when there is one,
+    // and is where `save-image` writes; it can precede any other option
+    char* image = NULL;
+    if (argc > 2 && STR_EQ(argv[1], "--image")) {
+        image = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+
+    // `--load-chunks` reads large files on the pool threads ahead of
+    // evaluating them, see lload_file; it can follow `--image`
+    int load_chunks = argc > 1 && STR_EQ(argv[1], "--load-chunks");
+    if (load_chunks) {
+        argv++;
+        argc--;
+    }
+
+    int use_mpc = argc > 1 && STR_EQ(argv[1], "--mpc");
+    int serve = argc > 2 && STR_EQ(argv[1], "--serve");
+    char* script = argc > 1 && !use_mpc && !serve ? argv[1] : NULL;
+
+    lenv *env = NULL;
+    if (image && !limage_load(&env, image)) {
+        fprintf(stderr, "Invalid image '%s'\n", image);
+        return 1;
+    }
+    if (!env) {
+        env = lenv_new();
+        lenv_add_builtins(env);
+    }
+    linterp* in = linterp_new(env, image);
+    in->load_chunks = load_chunks;
+
+    // `lliisspp --serve socket [file.lisp...]` preloads the files and then
+    // answers requests on the socket
+    if (serve) {
+        for (int i = 3; i < argc; i++) {
+            FILE* f = fopen(argv[i], "rb");
+            if (!f) {
+                fprintf(stderr, "Could not open '%s'\n", argv[i]);
+                linterp_delete(in);
+                return 1;
+            }
+            int ok = lload_file(in, env, f, argv[i], stderr);
+            fclose(f);
+            if (!ok) {
+                linterp_delete(in);
+                return 1;
+            }
+        }
+
+        int ok = lserver_run(in, argv[2]);
+        linterp_delete(in);
+        return ok ? 0 : 1;
+    }
 
-    grammar[fsize] = 0;
+    // `lliisspp file.lisp` or `lliisspp -` runs a script without readline
+    if (script) {
+        FILE* f = STR_EQ(script, "-") ? stdin : fopen(script, "rb");
+        if (!f) {
+            fprintf(stderr, "Could not open '%s'\n", script);
+            linterp_delete(in);
+            return 1;
+        }
 
-    // todo [10.10.2015]: use mpca_lang_file and handle errors
-    mpca_lang(MPCA_LANG_DEFAULT,
-              grammar,
-              Number,
-              Decimal,
-              Integer,
-              Symbol,
-              Sexpr,
-              Qexpr,
-              Expr,
-              Lliisspp);
+        int ok = lload_file(in, env, f, STR_EQ(script, "-") ? "<stdin>" : script, stderr);
 
-    lenv *env = lenv_new();
-    lenv_add_builtins(env);
+        if (f != stdin) {
+            fclose(f);
+        }
+        linterp_delete(in);
+        return ok ? 0 : 1;
+    }
 
     puts("lliisspp version 0.0.1");
     puts("Press Ctrl+C to Exit\n");
 
+    // forms may span several lines, continuation lines get their own prompt
+    linput* lines = linput_new();
+
     while (1) {
-        char* input = readline("lliisspp> ");
+        char* line = readline(lines->length ? "      ... " : "lliisspp> ");
+        if (!line) {
+            break;
+        }
+
+        add_history(line);
 
-        add_history(input);
+        int complete = linput_add(lines, line);
+        free(line);
+        if (!complete) {
+            continue;
+        }
 
-        mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Lliisspp, &r)) {
-            lval* x = lval_eval(env, lval_read(r.output));
+        lval* x = linterp_read(in, lines->buffer, use_mpc);
+        if (x) {
+            x = lval_eval(env, x);
             lval_println(env, x);
-            mpc_ast_delete(r.output);
-        } else {
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
+            lval_delete(x);
         }
 
-        free(input);
+        linput_clear(lines);
     }
 
-    lenv_delete(env);
-    free(grammar);
-    mpc_cleanup(8,
-                Number,
-                Decimal,
-                Integer,
-                Symbol,
-                Sexpr,
-                Qexpr,
-                Expr,
-                Lliisspp);
+    linput_delete(lines);
+    linterp_delete(in);
 
     return 0;
 }
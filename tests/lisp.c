@@ -0,0 +1,749 @@
+// the interpreter is built into the tests with its main renamed, so that
+// they can call its C functions directly
+#define main lisp_main
+#include "../parsing.c"
+#undef main
+
+#include <sys/wait.h>
+
+static int failures = 0;
+
+static void check(int cond, char* name) {
+    if (!cond) {
+        printf("FAIL: %s\n", name);
+        failures++;
+    }
+}
+
+// unpacks `n` bytes and checks that they are refused
+static void check_refused(char* name, char* data, long n) {
+    lval* v = lval_unpack(data, n);
+    check(v == NULL, name);
+    if (v) {
+        lval_delete(v);
+    }
+}
+
+static lval* read_value(char* s) {
+    lreader* r = lreader_new(NULL, s);
+    lval* v = lreader_read(r);
+    lreader_delete(r);
+    return v;
+}
+
+static void test_unpack_corrupt(void) {
+    // no symbols, then a builtin named by symbol 5
+    char builtin[] = { 'L', 'P', 'K', '1', 0, LVAL_FUNCTION, 1, 5 };
+    check_refused("builtin with a bad symbol index", builtin, sizeof(builtin));
+
+    // no symbols, then an integer whose varint never ends
+    char varint[] = { 'L', 'P', 'K', '1', 0, LVAL_INTEGER, (char) 0x80 };
+    check_refused("truncated varint", varint, sizeof(varint));
+
+    // {1 2} then a reference to node 3 of a table that only has node 0
+    char reference[] = { 'L', 'P', 'K', '1', 0, LVAL_QEXPRESSION, 2,
+        LVAL_QEXPRESSION, 2, LVAL_INTEGER, 2, LVAL_INTEGER, 4,
+        LPACK_REFERENCE, 3 };
+    check_refused("reference past the node table", reference, sizeof(reference));
+    reference[sizeof(reference) - 1] = 0;
+    lval* v = lval_unpack(reference, sizeof(reference));
+    check(v != NULL, "reference to a node in the table");
+    if (v) {
+        lval_delete(v);
+    }
+
+    // every prefix of a valid value is refused, and no single changed byte
+    // may crash the reader
+    lenv* builtins = lenv_new();
+    lenv_add_builtins(builtins);
+    lval* plus = lval_symbol("+");
+    lval* x = read_value("{1 -2.5 foo {1 2 3} {1 2 3}}");
+    x = lval_add(x, lenv_get(builtins, plus));
+    x = lval_add(x, lval_lambda(read_value("{x}"), read_value("{* x 2}")));
+    lval_delete(plus);
+    lenv_delete(builtins);
+    long n;
+    char* data = lval_pack(x, LPACK_MAGIC, &n);
+    lval* y = lval_unpack(data, n);
+    check(y && lval_eq(x, y), "round trip");
+    if (y) {
+        lval_delete(y);
+    }
+    for (long i = 0; i < n; i++) {
+        check_refused("truncated value", data, i);
+    }
+    for (long i = LPACK_MAGIC_LENGTH; i < n; i++) {
+        char c = data[i];
+        for (int b = 0; b < 256; b++) {
+            data[i] = (char) b;
+            y = lval_unpack(data, n);
+            if (y) {
+                lval_delete(y);
+            }
+        }
+        data[i] = c;
+    }
+    free(data);
+    lval_delete(x);
+}
+
+static void test_image_corrupt(void) {
+    // symbol "x", version 2, then an env binding x to a builtin named by
+    // symbol 9
+    char image[] = { 'L', 'L', 'I', 'M', 1, 1, 'x', 0, LIMAGE_VERSION,
+        1, 0, LVAL_FUNCTION, 1, 9 };
+    char path[] = "/tmp/lisp-test-image-XXXXXX";
+    int fd = mkstemp(path);
+    check(fd >= 0 && write(fd, image, sizeof(image)) == sizeof(image), "write image");
+    close(fd);
+
+    lenv* env = NULL;
+    check(limage_load(&env, path) == 0, "image with a bad builtin is refused");
+    if (env) {
+        lenv_delete(env);
+    }
+    remove(path);
+}
+
+static int server_connect(char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // the server may not be listening yet
+    for (int i = 0; i < 2000; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        struct timespec t = { 0, 1000000 };
+        nanosleep(&t, NULL);
+    }
+    return -1;
+}
+
+// sends `request` and reads the whole reply into `reply`
+static void server_ask(char* path, char* request, char* reply, long n) {
+    long got = 0;
+    int fd = server_connect(path);
+    if (fd >= 0) {
+        ssize_t k = write(fd, request, strlen(request));
+        shutdown(fd, SHUT_WR);
+        while (k >= 0 && got < n - 1 && (k = read(fd, reply + got, n - 1 - got)) > 0) {
+            got += k;
+        }
+        close(fd);
+    }
+    reply[got] = '\0';
+}
+
+static void test_server(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/lisp-test-%d.sock", (int) getpid());
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // a file in the way of the socket is not deleted
+    FILE* f = fopen(path, "w");
+    fputs("keep", f);
+    fclose(f);
+    check(!lserver_run(in, path), "the server refuses a path that is not a socket");
+    struct stat st;
+    check(stat(path, &st) == 0 && S_ISREG(st.st_mode), "the file in the way is kept");
+    remove(path);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        lserver_run(in, path);
+        _exit(1);
+    }
+
+    // a client that never finishes its request is dropped instead of
+    // holding up the next one for good
+    int stalled = server_connect(path);
+    ssize_t k = write(stalled, "(+ 1", 4);
+    check(k == 4, "the stalled client connects");
+    char reply[256];
+    server_ask(path, "(def {x} 2) (+ x 3)", reply, sizeof(reply));
+    check(STR_EQ(reply, "()\n5\n"), "a request is answered over the socket");
+    // and its defs do not outlive it
+    server_ask(path, "x", reply, sizeof(reply));
+    check(STR_EQ(reply, "Error: Unbound symbol 'x'\n"), "requests do not change the root");
+    close(stalled);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    remove(path);
+    linterp_delete(in);
+}
+
+// evaluates `s` in the root of `in` and checks the printed result
+static void check_eval(linterp* in, char* s, char* expected) {
+    lval* x = lval_eval(in->root, read_value(s));
+    lbuffer* b = lbuffer_new();
+    lval_write(in->root, b, x);
+    lbuffer_putc(b, '\0');
+    if (strcmp(b->data, expected) != 0) {
+        printf("FAIL: %s gave %s, expected %s\n", s, b->data, expected);
+        failures++;
+    }
+    lbuffer_delete(b);
+    lval_delete(x);
+}
+
+static void test_serialize_round_trips(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // repeated expressions go out as back references and come back as
+    // copies, without an S-expression and a Q-expression being mixed up
+    lval* x = read_value("{{1 2 3} {1 2 3} ({1 2 3} (1 2 3)) {(1 2 3) {1 2 3}}}");
+    long n;
+    char* data = lval_pack(x, LPACK_MAGIC, &n);
+    check(data && memchr(data, LPACK_REFERENCE, n) != NULL, "repeats are packed as references");
+    lval* y = data ? lval_unpack(data, n) : NULL;
+    check(y && lval_eq(x, y), "references unpack to what was packed");
+    if (y) {
+        lval_delete(y);
+    }
+    free(data);
+    lval_delete(x);
+
+    check_eval(in, "(deserialize (serialize {1 -2.5 foo {} {1 2 3} {1 2 3}}))",
+               "{1 -2.500000 foo {} {1 2 3} {1 2 3}}");
+    check_eval(in, "(deserialize (serialize {{a {b}} {a {b}} {{a {b}} {a {b}}}}))",
+               "{{a {b}} {a {b}} {{a {b}} {a {b}}}}");
+    check_eval(in, "((deserialize (serialize +)) 1 2)", "3");
+
+    // lambdas keep their envs, including partially applied arguments and
+    // lambdas inside them
+    check_eval(in, "(def {add} (\\ {x y} {+ x y}))", "()");
+    check_eval(in, "(def {add5} (add 5))", "()");
+    check_eval(in, "((deserialize (serialize add5)) 3)", "8");
+    check_eval(in, "(def {twice} (\\ {f x} {f (f x)}))", "()");
+    check_eval(in, "(def {add10} (twice add5))", "()");
+    check_eval(in, "((deserialize (serialize add10)) 1)", "11");
+    check_eval(in, "(pmap (deserialize (serialize add5)) (deserialize (serialize {1 2})))",
+               "{6 7}");
+
+    check_eval(in, "(serialize (atom 1))",
+               "Error: Function 'serialize' cannot serialize futures, channels, atoms or unnamed builtins.");
+
+    linterp_delete(in);
+}
+
+static void test_def_during_parallel(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // the futures def while pmap and preduce wait for them, and their defs
+    // still reach the root
+    check_eval(in, "(def {f} (future {def {g} 7}))", "()");
+    check_eval(in, "(pmap (\\ {x} {deref f}) {1 2 3})", "{() () ()}");
+    check_eval(in, "g", "7");
+    check_eval(in, "(def {h} (future {def {k} 8}))", "()");
+    check_eval(in, "(preduce (\\ {a b} {deref h}) 0 {1 2 3})", "()");
+    check_eval(in, "k", "8");
+
+    // defs from the function itself stay in the env of its range
+    check_eval(in, "(pmap (\\ {x} {def {y} x}) {1 2 3})", "{() () ()}");
+    check_eval(in, "y", "Error: Unbound symbol 'y'");
+
+    linterp_delete(in);
+}
+
+static void test_pmap_order(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // results come back in the order of the list, however the ranges were
+    // split between the threads
+    char list[8 * 1000];
+    char squares[16 * 1000];
+    char* p = list;
+    char* q = squares;
+    *p++ = '{';
+    *q++ = '{';
+    for (int i = 0; i < 1000; i++) {
+        p += sprintf(p, i ? " %d" : "%d", i - 500);
+        q += sprintf(q, i ? " %d" : "%d", (i - 500) * (i - 500));
+    }
+    sprintf(p, "}");
+    sprintf(q, "}");
+    char expr[64 + sizeof(list)];
+    sprintf(expr, "(pmap (\\ {x} {* x x}) %s)", list);
+    check_eval(in, expr, squares);
+
+    check_eval(in, "(pmap (\\ {x} {- x}) {})", "{}");
+    check_eval(in, "(pmap (\\ {x} {- x}) {1})", "{-1}");
+    check_eval(in, "(pmap (\\ {x} {pmap (\\ {y} {* x y}) {1 2 3}}) {1 2 3 4})",
+               "{{1 2 3} {2 4 6} {3 6 9} {4 8 12}}");
+
+    linterp_delete(in);
+}
+
+static void test_futures(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    check_eval(in, "(def {f} (future {+ 1 2}))", "()");
+    check_eval(in, "(deref f)", "3");
+    check_eval(in, "(realized? f)", "true");
+    check_eval(in, "(deref f)", "3");
+
+    // a future is not realized while it runs, and deref waits for it
+    check_eval(in, "(def {s} (future {sleep 300}))", "()");
+    check_eval(in, "(realized? s)", "false");
+    check_eval(in, "(deref s)", "()");
+    check_eval(in, "(realized? s)", "true");
+
+    // the expression sees the env the future was made in, and futures made
+    // inside a future run on deref
+    check_eval(in, "(def {y} 10)", "()");
+    check_eval(in, "((\\ {x} {deref (future {+ x y})}) 5)", "15");
+    check_eval(in, "(deref (future {deref (future {* 6 7})}))", "42");
+    check_eval(in, "(deref (future {/ 1 0}))", "Error: Division by zero");
+    check_eval(in, "(realized? 1)",
+               "Error: Incorrect type of argument #1 for 'realized?'. Got Integer, expected Future.");
+
+    linterp_delete(in);
+}
+
+static int sync_reading = 1;
+
+static void* sync_reader(void* arg) {
+    while (__atomic_load_n(&sync_reading, __ATOMIC_RELAXED)) {
+        lval* x = lenv_sync_get(arg, "x");
+        if (x) {
+            lval_delete(x);
+        }
+    }
+    return NULL;
+}
+
+static long retired_length(lenv_sync* s) {
+    long n = 0;
+    for (lenv_retired* x = s->retired; x; x = x->next) {
+        n++;
+    }
+    for (lenv_retired* x = s->waiting; x; x = x->next) {
+        n++;
+    }
+    return n;
+}
+
+static void test_reclaim_while_reading(void) {
+    // readers that never all leave at once still let replaced values go
+    lenv* env = lenv_new();
+    lenv_sync_start(env);
+    pthread_t readers[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&readers[i], NULL, sync_reader, env);
+    }
+    lval* key = lval_symbol("x");
+    for (long i = 0; i < 20000; i++) {
+        lval* v = lval_integer(i);
+        lenv_sync_put(env, key, v);
+        lval_delete(v);
+    }
+    // no writer comes back to free the last of them, the readers do
+    long left = -1;
+    for (int i = 0; i < 1000 && left; i++) {
+        pthread_mutex_lock(&E_SYNC(env)->lock);
+        left = retired_length(E_SYNC(env));
+        pthread_mutex_unlock(&E_SYNC(env)->lock);
+        usleep(1000);
+    }
+    __atomic_store_n(&sync_reading, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < 4; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    check(left == 0, "retired values are freed under sustained reads");
+    lval_delete(key);
+    lenv_delete(env);
+}
+
+static void test_swap_totals(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // swaps racing from the pool threads each land exactly once
+    char list[2 + 2 * 2000];
+    char* p = list;
+    *p++ = '{';
+    for (int i = 0; i < 2000; i++) {
+        p += sprintf(p, i ? " 1" : "1");
+    }
+    sprintf(p, "}");
+    char expr[64 + sizeof(list)];
+    check_eval(in, "(def {t} (atom 0))", "()");
+    sprintf(expr, "(len (pmap (\\ {x} {swap! t + x}) %s))", list);
+    check_eval(in, expr, "2000");
+    check_eval(in, "(deref t)", "2000");
+    check_eval(in, "(len (pmap (\\ {x} {swap! t (\\ {y z} {+ y z}) x}) {1 2 3 4}))",
+               "4");
+    check_eval(in, "(deref t)", "2010");
+
+    linterp_delete(in);
+}
+
+// loads `path` into the root of `in` and returns what it printed to stdout,
+// then what it reported as errors
+static char* load_output(linterp* in, char* path) {
+    FILE* out = tmpfile();
+    FILE* f = fopen(path, "rb");
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(out), STDOUT_FILENO);
+    lload_file(in, in->root, f, "big", out);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    fclose(f);
+
+    long n = ftell(out);
+    char* data = malloc(n + 1);
+    rewind(out);
+    data[fread(data, 1, n, out)] = '\0';
+    fclose(out);
+    return data;
+}
+
+static void test_load_chunks(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // a few chunks of forms, some across lines, then a stray bracket
+    char path[] = "/tmp/lisp-test-load-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* f = fdopen(fd, "w");
+    long rows = 0;
+    for (long i = 0; ftell(f) < 3 * LLOAD_PARALLEL; i++) {
+        fprintf(f, i % 7 ? "(+ %ld 1)\n" : "(list %ld\n  {a b})\n", i);
+        rows += i % 7 ? 1 : 2;
+    }
+    fputs("(+ 1 2)\n  (+ 3 4))\n(+ 5 6)\n", f);
+    fclose(f);
+    char end[64];
+    snprintf(end, sizeof(end), "3\n7\nbig:%ld:10: unexpected character\n", rows + 2);
+
+    char* streamed = load_output(in, path);
+    in->load_chunks = 1;
+    char* chunked = load_output(in, path);
+    long n = strlen(streamed);
+    check(n > (long) strlen(end) && STR_EQ(streamed + n - strlen(end), end),
+          "a streamed load stops at the error");
+    check(STR_EQ(streamed, chunked), "chunked and streamed loads print the same");
+    free(streamed);
+    free(chunked);
+    remove(path);
+    linterp_delete(in);
+}
+
+static long pool_items = 0;
+
+static void pool_count(void* arg, long start, long end) {
+    __atomic_add_fetch(&pool_items, end - start, __ATOMIC_RELAXED);
+}
+
+static void test_pool_runs(void) {
+    // threads still finishing one job take ranges of the next
+    lpool* pool = lpool_new(4);
+    long total = 0;
+    for (int i = 0; i < 3000; i++) {
+        lpool_run(pool, pool_count, NULL, 1 + i % 20);
+        total += 1 + i % 20;
+    }
+    check(pool_items == total, "every range of back to back jobs runs once");
+    lpool_delete(pool);
+}
+
+static void test_chan_capacity(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // used to loop forever rounding up to a power of two
+    check_eval(in, "(chan 9223372036854775807)",
+               "Error: Function 'chan' passed capacity 9223372036854775807, more than 16777216.");
+    check_eval(in, "(chan 16777217)",
+               "Error: Function 'chan' passed capacity 16777217, more than 16777216.");
+    check_eval(in, "(def {c} (chan 3))", "()");
+    check_eval(in, "(send c 1)", "()");
+    check_eval(in, "(recv c)", "1");
+
+    linterp_delete(in);
+}
+
+typedef struct chan_test {
+    lchan* c;
+    long received;
+    long sum;
+} chan_test;
+
+enum { CHAN_SENDERS = 4, CHAN_RECEIVERS = 4, CHAN_ITEMS = 20000 };
+
+static void* chan_sender(void* arg) {
+    chan_test* t = arg;
+    for (long i = 1; i <= CHAN_ITEMS; i++) {
+        lval* v = lval_integer(i);
+        while (!lchan_try_send(t->c, v)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void* chan_receiver(void* arg) {
+    chan_test* t = arg;
+    while (__atomic_load_n(&t->received, __ATOMIC_RELAXED) < CHAN_SENDERS * CHAN_ITEMS) {
+        lval* v = lchan_try_recv(t->c);
+        if (!v) {
+            sched_yield();
+            continue;
+        }
+        __atomic_add_fetch(&t->sum, L_INTEGER(v), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&t->received, 1, __ATOMIC_RELAXED);
+        lval_delete(v);
+    }
+    return NULL;
+}
+
+// every value sent by several threads is received exactly once
+static void check_chan_threads(long capacity, char* name) {
+    chan_test t = { lchan_new(capacity), 0, 0 };
+    pthread_t threads[CHAN_SENDERS + CHAN_RECEIVERS];
+    for (int i = 0; i < CHAN_SENDERS + CHAN_RECEIVERS; i++) {
+        pthread_create(&threads[i], NULL, i < CHAN_SENDERS ? chan_sender : chan_receiver, &t);
+    }
+    for (int i = 0; i < CHAN_SENDERS + CHAN_RECEIVERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    check(t.sum == (long) CHAN_SENDERS * CHAN_ITEMS * (CHAN_ITEMS + 1) / 2, name);
+    check(lchan_try_recv(t.c) == NULL, name);
+    lchan_release(t.c);
+}
+
+static void test_chan_threads(void) {
+    check_chan_threads(0, "unbounded channel between threads");
+    check_chan_threads(64, "bounded channel between threads");
+
+    // values left in a channel across blocks go with it
+    lchan* c = lchan_new(0);
+    for (long i = 0; i < 3 * LCHAN_BLOCK; i++) {
+        lchan_try_send(c, lval_integer(i));
+    }
+    for (long i = 0; i < 2 * LCHAN_BLOCK; i++) {
+        lval* v = lchan_try_recv(c);
+        check(v && L_INTEGER(v) == i, "unbounded channel keeps its order");
+        if (v) {
+            lval_delete(v);
+        }
+    }
+    lchan_release(c);
+}
+
+static void test_sleeping_heap(void) {
+    lpool* pool = lpool_new(1);
+    lfiber fibers[200];
+    srand(7);
+    for (int i = 0; i < 200; i++) {
+        fibers[i].wake.tv_sec = rand() % 50;
+        fibers[i].wake.tv_nsec = rand() % 1000000000;
+        lpool_sleeping_push(pool, &fibers[i]);
+    }
+    lfiber* last = NULL;
+    int ordered = 1;
+    for (int i = 0; i < 200; i++) {
+        lfiber* fb = lpool_sleeping_pop(pool);
+        if (last && ltimespec_before(&fb->wake, &last->wake)) {
+            ordered = 0;
+        }
+        last = fb;
+    }
+    check(ordered && pool->sleeping_num == 0, "sleeping fibers wake earliest first");
+    lpool_delete(pool);
+}
+
+static void test_fibers(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    check_eval(in, "(deref (spawn {+ 1 2}))", "3");
+    check_eval(in, "(deref (spawn {yield 5}))", "5");
+    check_eval(in, "(yield 7)", "7");
+
+    // fibers that keep yielding to each other all run to the end
+    check_eval(in, "(def {spin} (\\ {n acc} {if (== n 0) {acc} {spin (- n 1) (+ acc (yield 1))}}))",
+               "()");
+    check_eval(in, "(def {spawn-all} (\\ {n e} {if (== n 0) {{}} {cons (spawn e) (spawn-all (- n 1) e)}}))",
+               "()");
+    check_eval(in, "(def {sum} (\\ {fs} {if (== fs {}) {0} {+ (deref (eval (head fs))) (sum (tail fs))}}))",
+               "()");
+    check_eval(in, "(sum (spawn-all 50 {spin 20 0}))", "1000");
+
+    // sleeping fibers leave their thread to the others, so 30 of them
+    // sleeping 200ms each take far less than the 3s that two threads
+    // blocked in nanosleep would
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    check_eval(in, "(def {fs} (spawn-all 30 {len (list (sleep 200))}))", "()");
+    check_eval(in, "(sum fs)", "30");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double took = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    check(took < 1.5, "sleeping fibers share their threads");
+
+    check_eval(in, "(def {t} (spawn {sleep 200}))", "()");
+    check_eval(in, "(realized? t)", "false");
+    check_eval(in, "(deref t)", "()");
+    check_eval(in, "(realized? t)", "true");
+
+    linterp_delete(in);
+}
+
+static int parked_fibers(lpool* pool) {
+    int n = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (lfiber* fb = pool->parked; fb; fb = fb->next) {
+        n++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+static void test_chan_park(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // fibers waiting on an empty channel are parked instead of polling it,
+    // and each value sent wakes them
+    check_eval(in, "(def {c} (chan 0))", "()");
+    check_eval(in, "(def {d} (chan 0))", "()");
+    for (int i = 0; i < 200; i++) {
+        check_eval(in, "(spawn {send d (recv c)})", "<future>");
+    }
+    for (int i = 0; i < 2000 && parked_fibers(in->pool) < 200; i++) {
+        struct timespec t = { 0, 1000000 };
+        nanosleep(&t, NULL);
+    }
+    check(parked_fibers(in->pool) == 200, "fibers waiting on a channel are parked");
+    for (int i = 0; i < 200; i++) {
+        check_eval(in, "(send c 2)", "()");
+    }
+    long sum = 0;
+    for (int i = 0; i < 200; i++) {
+        lval* x = lval_eval(in->root, read_value("(recv d)"));
+        sum += L_TYPE(x) == LVAL_INTEGER ? L_INTEGER(x) : 0;
+        lval_delete(x);
+    }
+    check(sum == 400, "parked fibers are woken by send");
+    check(parked_fibers(in->pool) == 0, "woken fibers are not parked");
+
+    // a fiber waiting on two channels is woken by either
+    check_eval(in, "(def {e} (chan 2))", "()");
+    check_eval(in, "(def {f} (spawn {select (list c e)}))", "()");
+    check_eval(in, "(sleep 20)", "()");
+    check_eval(in, "(send e 5)", "()");
+    check_eval(in, "(deref f)", "{1 5}");
+
+    linterp_delete(in);
+}
+
+static int ready_fibers(lpool* pool) {
+    int n = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (lfiber* fb = pool->fibers_head; fb; fb = fb->next) {
+        n++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+static void test_actor(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // the actor reads globals from the root, and its defs stay its own
+    check_eval(in, "(def {k} 10)", "()");
+    check_eval(in, "(def {out} (chan 0))", "()");
+    check_eval(in, "(def {a} (spawn-actor (\\ {x} {send out (+ k (len (list (def {seen} x))) x)})))",
+               "()");
+    check_eval(in, "(sleep 20)", "()");
+    check(parked_fibers(in->pool) == 1, "an idle actor is parked");
+    check_eval(in, "(send a 5)", "()");
+    check_eval(in, "(recv out)", "16");
+    check_eval(in, "seen", "Error: Unbound symbol 'seen'");
+
+    // dropping the last other reference to the mailbox ends the actor
+    check_eval(in, "(def {a} ())", "()");
+    check_eval(in, "(sleep 20)", "()");
+    check(parked_fibers(in->pool) == 0 && ready_fibers(in->pool) == 0,
+          "an actor ends with its last sender");
+
+    linterp_delete(in);
+}
+
+static void test_chan_shutdown(void) {
+    lenv* root = lenv_new();
+    lenv_add_builtins(root);
+    linterp* in = linterp_new(root, NULL);
+
+    // nothing is ever sent, so the future is still waiting when its pool
+    // is deleted, and has to notice that instead of holding up the exit
+    check_eval(in, "(def {c} (chan 0))", "()");
+    check_eval(in, "(def {f} (future {recv c}))", "()");
+    check_eval(in, "(def {g} (spawn {recv c}))", "()");
+    check_eval(in, "(sleep 50)", "()");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    linterp_delete(in);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    check(ms < LPOOL_SHUTDOWN, "channel waits stop with their pool");
+}
+
+int main(void) {
+    // a deadlock fails the tests instead of hanging them
+    alarm(120);
+    if (!lval_read_tags()) {
+        puts("FAIL: grammar tags");
+        return 1;
+    }
+    test_unpack_corrupt();
+    test_image_corrupt();
+    test_server();
+    test_serialize_round_trips();
+    test_def_during_parallel();
+    test_pmap_order();
+    test_futures();
+    test_reclaim_while_reading();
+    test_swap_totals();
+    test_load_chunks();
+    test_pool_runs();
+    test_chan_capacity();
+    test_chan_threads();
+    test_sleeping_heap();
+    test_fibers();
+    test_chan_park();
+    test_actor();
+    test_chan_shutdown();
+    if (failures) {
+        printf("%d failure(s)\n", failures);
+        return 1;
+    }
+    puts("lisp tests passed");
+    return 0;
+}
@@ -0,0 +1,375 @@
+/* mpc.c is built into the tests, so that they can reach its internals */
+#include "../mpc.c"
+
+static int failures = 0;
+
+static void check(int cond, const char *name) {
+  if (!cond) { printf("FAIL: %s\n", name); failures++; }
+}
+
+static FILE *open_tmp(const char *input) {
+  FILE *f = tmpfile();
+  fputs(input, f);
+  rewind(f);
+  return f;
+}
+
+/* Parses `input` from a file or pipe and checks the AST against `expected` */
+static void check_stream(const char *name, int pipe, const char *input, mpc_parser_t *p, mpc_ast_t *expected) {
+  
+  int ok;
+  mpc_result_t r;
+  FILE *f = open_tmp(input);
+  
+  ok = pipe ? mpc_parse_pipe("<test>", f, p, &r) : mpc_parse_file("<test>", f, p, &r);
+  fclose(f);
+  
+  if (!ok) {
+    printf("FAIL: %s: ", name);
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    failures++;
+    return;
+  }
+  
+  check(mpc_ast_eq(r.output, expected), name);
+  mpc_ast_delete(r.output);
+}
+
+/* Regex tokens read from files and pipes must stop at the end of the match */
+static void test_stream_tokens(int flags) {
+  
+  const char *input = "(ab 12 (cd 345) e)";
+  mpc_result_t r;
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *List = mpc_new("list");
+  mpc_parser_t *Item = mpc_new("item");
+  mpc_parser_t *Top = mpc_new("top");
+  mpc_err_t *e = mpca_lang(flags,
+    " number : /[0-9]+/ ;                          "
+    " symbol : /[a-z]+/ ;                          "
+    " list   : '(' <item>* ')' ;                   "
+    " item   : <number> | <symbol> | <list> ;      "
+    " top    : /^/ <item>* /$/ ;                   ",
+    Number, Symbol, List, Item, Top, NULL);
+  
+  check(e == NULL, "grammar builds");
+  if (e) { mpc_err_print(e); mpc_err_delete(e); return; }
+  
+  if (mpc_parse("<test>", input, Top, &r)) {
+    check_stream(flags ? "predictive file parse" : "file parse", 0, input, Top, r.output);
+    check_stream(flags ? "predictive pipe parse" : "pipe parse", 1, input, Top, r.output);
+    mpc_ast_delete(r.output);
+  } else {
+    check(0, "string parse");
+    mpc_err_delete(r.error);
+  }
+  
+  mpc_cleanup(5, Number, Symbol, List, Item, Top);
+}
+
+/* Builds the same grammar with `flags`; `ps` gets number, symbol, pair, list, item, top */
+static int packrat_grammar(int flags, mpc_parser_t **ps) {
+  
+  mpc_err_t *e;
+  ps[0] = mpc_new("number");
+  ps[1] = mpc_new("symbol");
+  ps[2] = mpc_new("pair");
+  ps[3] = mpc_new("list");
+  ps[4] = mpc_new("item");
+  ps[5] = mpc_new("top");
+  e = mpca_lang(flags,
+    " number : /[0-9]+/ ;                          "
+    " symbol : /[a-z]+/ ;                          "
+    " pair   : '(' <item> '.' <item> ')' ;         "
+    " list   : '(' <item>* ')' ;                   "
+    " item   : <pair> | <list> | <number> | <symbol> ; "
+    " top    : /^/ <item>* /$/ ;                   ",
+    ps[0], ps[1], ps[2], ps[3], ps[4], ps[5], NULL);
+  if (e) { mpc_err_print(e); mpc_err_delete(e); return 0; }
+  return 1;
+}
+
+/* Packrat parses give the same ASTs as plain ones, also once the matches
+** cached cover more input than the cache keeps (64KB) and it is emptied,
+** and with single matches that are larger than that */
+static void test_packrat(void) {
+  
+  int i, j;
+  long n = 0;
+  char *input = malloc(1 << 20);
+  mpc_result_t r, m;
+  mpc_parser_t *plain[6], *packrat[6];
+  
+  check(packrat_grammar(MPCA_LANG_DEFAULT, plain), "plain grammar builds");
+  check(packrat_grammar(MPCA_LANG_PACKRAT, packrat), "packrat grammar builds");
+  
+  /* lists whose items start out like pairs */
+  for (i = 0; i < 1000; i++) {
+    n += sprintf(input + n, "(a %d (b . %d) (c d", i, i);
+    for (j = 0; j < 20; j++) { n += sprintf(input + n, " (%d . e)", j); }
+    n += sprintf(input + n, ")) ");
+  }
+  /* long symbols, so that few cached matches cover a lot of input */
+  for (i = 0; i < 200; i++) {
+    memset(input + n, 'a' + i % 26, 1000);
+    n += 1000;
+    input[n++] = ' ';
+  }
+  /* and one list of about 100KB */
+  n += sprintf(input + n, "(");
+  for (i = 0; i < 10000; i++) { n += sprintf(input + n, "(x . %d) ", i); }
+  sprintf(input + n, ")");
+  
+  if (mpc_parse("<test>", input, plain[5], &r)) {
+    if (mpc_parse("<test>", input, packrat[5], &m)) {
+      check(mpc_ast_eq(r.output, m.output), "packrat string parse");
+      mpc_ast_delete(m.output);
+    } else {
+      check(0, "packrat string parse");
+      mpc_err_delete(m.error);
+    }
+    /* pipes cannot seek past a cached match, so they skip the cache */
+    check_stream("packrat file parse", 0, input, packrat[5], r.output);
+    mpc_ast_delete(r.output);
+  } else {
+    check(0, "plain string parse");
+    mpc_err_delete(r.error);
+  }
+  
+  free(input);
+  mpc_cleanup(6, plain[0], plain[1], plain[2], plain[3], plain[4], plain[5]);
+  mpc_cleanup(6, packrat[0], packrat[1], packrat[2], packrat[3], packrat[4], packrat[5]);
+}
+
+/* Repeats fold what they expected into a single message */
+static void check_error(const char *name, mpc_parser_t *p, const char *input, const char *expected) {
+  
+  char *m;
+  mpc_result_t r;
+  
+  if (mpc_parse("<test>", input, p, &r)) {
+    check(0, name);
+    free(r.output);
+  } else {
+    m = mpc_err_string(r.error);
+    if (strcmp(m, expected) != 0) { printf("FAIL: %s: got %s", name, m); failures++; }
+    free(m);
+    mpc_err_delete(r.error);
+  }
+  
+  mpc_delete(p);
+}
+
+static void test_repeat_errors(void) {
+  check_error("many1 error", mpc_many1(mpcf_strfold, mpc_or(3, mpc_digit(), mpc_char('a'), mpc_char('b'))), "x",
+    "<test>:1:1: error: expected one or more of digit, 'a' or 'b' at 'x'\n");
+  check_error("count error", mpc_count(3, mpcf_strfold, mpc_digit(), free), "12x",
+    "<test>:1:3: error: expected 3 of digit at 'x'\n");
+}
+
+/* The regexes of the terminals in grammar */
+static const char *grammar_res[] = {
+  "-?[0-9]+\\.[0-9]+",
+  "-?[0-9]+",
+  "[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%^|?]+",
+  NULL
+};
+
+/* Parses `input` with `p` and writes what came of it to `out` */
+static void regex_outcome(mpc_parser_t *p, const char *input, char *out) {
+  mpc_result_t r;
+  if (mpc_parse("<test>", input, p, &r)) {
+    sprintf(out, "match '%s'", (char*)r.output);
+    free(r.output);
+  } else {
+    sprintf(out, "error at %ld", r.error->state.pos);
+    mpc_err_delete(r.error);
+  }
+}
+
+/* The DFA of a regex matches what its combinator version matches, and
+** fails at the same position, on every short input over a few characters */
+static void test_dfa_agrees(void) {
+  
+  int k, j, n;
+  long x, y;
+  char input[8], dfa_out[64], comb_out[64];
+  const char *chars = "0123456789.-a_+(\\";
+  mpc_parser_t *dfa, *comb;
+  
+  for (k = 0; grammar_res[k]; k++) {
+    dfa = mpc_re(grammar_res[k]);
+    check(dfa->type == MPC_TYPE_DFA, "the grammar's regexes compile to DFAs");
+    dfa = mpc_whole(dfa, free);
+    comb = mpc_whole(mpc_re_combinators(grammar_res[k]), free);
+    
+    for (n = 0; n <= 4; n++) {
+      for (y = 1, j = 0; j < n; j++) { y *= (long)strlen(chars); }
+      for (x = 0; x < y; x++) {
+        long z = x;
+        for (j = 0; j < n; j++) { input[j] = chars[z % strlen(chars)]; z /= strlen(chars); }
+        input[n] = '\0';
+        regex_outcome(dfa, input, dfa_out);
+        regex_outcome(comb, input, comb_out);
+        if (strcmp(dfa_out, comb_out) != 0) {
+          printf("FAIL: /%s/ on '%s': DFA %s, combinators %s\n", grammar_res[k], input, dfa_out, comb_out);
+          failures++;
+        }
+      }
+    }
+    
+    mpc_delete(dfa);
+    mpc_delete(comb);
+  }
+}
+
+/* A DFA that dies past the start of the input reports the error there */
+static void test_dfa_errors(void) {
+  
+  char *m;
+  FILE *f;
+  mpc_result_t r;
+  mpc_parser_t *number = mpc_whole(mpc_or(2, mpc_re(grammar_res[0]), mpc_re(grammar_res[1])), free);
+  
+  check_error("decimal missing its fraction", number, "12.",
+    "<test>:1:4: error: expected /-?[0-9]+\\.[0-9]+/ at end of input\n");
+  number = mpc_whole(mpc_or(2, mpc_re(grammar_res[0]), mpc_re(grammar_res[1])), free);
+  check_error("decimal with a bad fraction", number, "-1.x",
+    "<test>:1:4: error: expected /-?[0-9]+\\.[0-9]+/ at 'x'\n");
+  
+  /* The decimal scan reads the pipe to its end before the integer is tried */
+  number = mpc_whole(mpc_or(2, mpc_re(grammar_res[0]), mpc_re(grammar_res[1])), free);
+  f = open_tmp("12.");
+  if (mpc_parse_pipe("<test>", f, number, &r)) {
+    check(0, "decimal missing its fraction from a pipe");
+    free(r.output);
+  } else {
+    m = mpc_err_string(r.error);
+    check(strcmp(m, "<test>:1:4: error: expected /-?[0-9]+\\.[0-9]+/ at end of input\n") == 0,
+      "decimal missing its fraction from a pipe");
+    free(m);
+    mpc_err_delete(r.error);
+  }
+  fclose(f);
+  mpc_delete(number);
+}
+
+/* Builds grammar; `ps` gets decimal, integer, number, symbol, sexpr, qexpr, expr, lispy */
+static int lispy_grammar(mpc_parser_t **ps) {
+  
+  mpc_err_t *e;
+  ps[0] = mpc_new("decimal");
+  ps[1] = mpc_new("integer");
+  ps[2] = mpc_new("number");
+  ps[3] = mpc_new("symbol");
+  ps[4] = mpc_new("sexpr");
+  ps[5] = mpc_new("qexpr");
+  ps[6] = mpc_new("expr");
+  ps[7] = mpc_new("lispy");
+  e = mpca_lang_contents(MPCA_LANG_DEFAULT, "grammar",
+    ps[0], ps[1], ps[2], ps[3], ps[4], ps[5], ps[6], ps[7], NULL);
+  if (e) { mpc_err_print(e); mpc_err_delete(e); return 0; }
+  return 1;
+}
+
+/* Parses `input` with `p` from a string, file or pipe (`stream` 0, 1 or 2),
+** and gives the AST or the error as text */
+static char *lispy_outcome(mpc_parser_t *p, int stream, const char *input) {
+  
+  int ok;
+  long n;
+  char *out;
+  mpc_result_t r;
+  FILE *f;
+  
+  if (stream) {
+    f = open_tmp(input);
+    ok = stream == 2 ? mpc_parse_pipe("<test>", f, p, &r) : mpc_parse_file("<test>", f, p, &r);
+    fclose(f);
+  } else {
+    ok = mpc_parse("<test>", input, p, &r);
+  }
+  
+  if (!ok) {
+    out = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    return out;
+  }
+  
+  f = tmpfile();
+  mpc_ast_print_to(r.output, f);
+  mpc_ast_delete(r.output);
+  n = ftell(f);
+  rewind(f);
+  out = malloc(n + 1);
+  out[fread(out, 1, n, f)] = '\0';
+  fclose(f);
+  return out;
+}
+
+/* Dispatching `or` through first-character tables parses every input,
+** valid or not, exactly like trying each alternative in turn */
+static void test_or_dispatch(void) {
+  
+  int k, j, n, m;
+  long x, y, z;
+  char input[8], *a, *b;
+  const char *chars = "(){}1.-a ";
+  const char *inputs[] = {
+    "(+ 1 2)", "{1 2 (3 4.5)}", "(+ 1 ]", "(def {x} 5) (* x 2.5)", "-5 (- 12abc)",
+    "1.", "(list 1 -x - --2 3.25 -0.5)", ")", "((({{{}}})))", "(a\n b\n  (c", NULL
+  };
+  mpc_parser_t *plain[8], *dispatch[8];
+  
+  check(lispy_grammar(plain), "plain grammar builds");
+  check(lispy_grammar(dispatch), "dispatch grammar builds");
+  if (failures) { return; }
+  mpc_optimise(dispatch[7]);
+  
+  for (k = 0; k < 3; k++) {
+    for (m = 0; inputs[m]; m++) {
+      a = lispy_outcome(plain[7], k, inputs[m]);
+      b = lispy_outcome(dispatch[7], k, inputs[m]);
+      if (strcmp(a, b) != 0) {
+        printf("FAIL: dispatch on '%s' gave %s, expected %s\n", inputs[m], b, a);
+        failures++;
+      }
+      free(a);
+      free(b);
+    }
+  }
+  
+  for (n = 0; n <= 4; n++) {
+    for (y = 1, j = 0; j < n; j++) { y *= (long)strlen(chars); }
+    for (x = 0; x < y; x++) {
+      for (z = x, j = 0; j < n; j++) { input[j] = chars[z % strlen(chars)]; z /= strlen(chars); }
+      input[n] = '\0';
+      a = lispy_outcome(plain[7], 0, input);
+      b = lispy_outcome(dispatch[7], 0, input);
+      if (strcmp(a, b) != 0) {
+        printf("FAIL: dispatch on '%s' gave %s, expected %s\n", input, b, a);
+        failures++;
+      }
+      free(a);
+      free(b);
+    }
+  }
+  
+  mpc_cleanup(8, plain[0], plain[1], plain[2], plain[3], plain[4], plain[5], plain[6], plain[7]);
+  mpc_cleanup(8, dispatch[0], dispatch[1], dispatch[2], dispatch[3], dispatch[4], dispatch[5], dispatch[6], dispatch[7]);
+}
+
+int main(void) {
+  test_stream_tokens(MPCA_LANG_DEFAULT);
+  test_stream_tokens(MPCA_LANG_PREDICTIVE);
+  test_repeat_errors();
+  test_packrat();
+  test_dfa_agrees();
+  test_dfa_errors();
+  test_or_dispatch();
+  if (failures) { printf("%d failure(s)\n", failures); return 1; }
+  printf("mpc tests passed\n");
+  return 0;
+}